@@ -0,0 +1,165 @@
+#include "corpus.h"
+#include <QFile>
+#include <QRandomGenerator>
+#include <QStringList>
+#include <iterator>
+
+namespace {
+const char* const Words[] = {
+    "the", "sync", "is", "stuck", "again", "anyone", "seen", "this", "node", "peer",
+    "relay", "store", "message", "waku", "works", "for", "me", "restart", "it", "logs",
+    "here", "https://example.org/issues/1234", "lol", "ok", "thanks", "build", "failed", "on", "main", "ci"
+};
+
+QByteArray words(QRandomGenerator& random, int bytes)
+{
+    QByteArray text;
+    while (text.size() < bytes) {
+        if (!text.isEmpty()) {
+            text += ' ';
+        }
+        text += Words[random.bounded(int(std::size(Words)))];
+    }
+    return text;
+}
+
+QByteArray nick(QRandomGenerator& random)
+{
+    return "user" + QByteArray::number(random.bounded(500));
+}
+
+void finish(BenchCorpus& corpus)
+{
+    corpus.stream.clear();
+    for (const QByteArray& line : std::as_const(corpus.lines)) {
+        corpus.stream += line;
+        corpus.stream += "\r\n";
+    }
+}
+
+// What clients send, with the odd relayed line and IRCv3 tags
+BenchCorpus chat()
+{
+    BenchCorpus corpus;
+    corpus.name = "chat";
+    QRandomGenerator random(1);
+    for (int i = 0; i < 4000; ++i) {
+        QByteArray channel = "#channel" + QByteArray::number(random.bounded(20));
+        int kind = random.bounded(100);
+        if (kind < 65) {
+            corpus.lines.append("PRIVMSG " + channel + " :" + words(random, 10 + random.bounded(190)));
+        } else if (kind < 75) {
+            QByteArray from = nick(random);
+            corpus.lines.append(":" + from + "!" + from + "@10.0.0." + QByteArray::number(random.bounded(255))
+                                + " PRIVMSG " + channel + " :" + words(random, 10 + random.bounded(120)));
+        } else if (kind < 82) {
+            corpus.lines.append("@time=2026-01-01T12:00:00.000Z;msgid=" + QByteArray::number(random.generate64(), 36)
+                                + " PRIVMSG " + channel + " :" + words(random, 20 + random.bounded(80)));
+        } else if (kind < 88) {
+            corpus.lines.append("PING :" + QByteArray::number(random.generate(), 16));
+        } else if (kind < 93) {
+            corpus.lines.append("JOIN " + channel);
+        } else if (kind < 96) {
+            corpus.lines.append("NICK " + nick(random));
+        } else {
+            corpus.lines.append("MODE " + channel);
+        }
+    }
+    finish(corpus);
+    return corpus;
+}
+
+// Lines right at the limit, a few past it, and lines with many parameters
+BenchCorpus longLines()
+{
+    BenchCorpus corpus;
+    corpus.name = "long";
+    QRandomGenerator random(2);
+    for (int i = 0; i < 400; ++i) {
+        int kind = random.bounded(10);
+        if (kind < 6) {
+            corpus.lines.append("PRIVMSG #channel :" + words(random, 4000));
+        } else if (kind < 8) {
+            corpus.lines.append("PRIVMSG #channel :" + QByteArray(6000, 'x'));
+        } else {
+            QByteArray line = "MODE #channel +ooooooooooooo";
+            for (int p = 0; p < 13; ++p) {
+                line += ' ';
+                line += nick(random);
+            }
+            corpus.lines.append(line);
+        }
+    }
+    finish(corpus);
+    return corpus;
+}
+
+// Text from several scripts, two to four bytes per character
+BenchCorpus utf8()
+{
+    static const struct { char32_t first; char32_t last; } Ranges[] = {
+        {0x00C0, 0x00FF},       // Latin-1 letters
+        {0x0410, 0x044F},       // Cyrillic
+        {0x4E00, 0x9FFF},       // CJK
+        {0x1F600, 0x1F64F},     // Emoji
+    };
+
+    BenchCorpus corpus;
+    corpus.name = "utf8";
+    QRandomGenerator random(3);
+    for (int i = 0; i < 4000; ++i) {
+        QString text;
+        int length = 5 + random.bounded(120);
+        for (int c = 0; c < length; ++c) {
+            if (random.bounded(6) == 0) {
+                text += ' ';
+                continue;
+            }
+            const auto& range = Ranges[random.bounded(int(std::size(Ranges)))];
+            char32_t codePoint = range.first + char32_t(random.bounded(int(range.last - range.first + 1)));
+            text += QString::fromUcs4(&codePoint, 1);
+        }
+        corpus.lines.append("PRIVMSG #channel" + QByteArray::number(random.bounded(20)) + " :" + text.toUtf8());
+    }
+    finish(corpus);
+    return corpus;
+}
+}
+
+QStringList Corpus::builtinNames()
+{
+    return {"chat", "long", "utf8"};
+}
+
+BenchCorpus Corpus::builtin(const QString& name)
+{
+    if (name == "long") {
+        return longLines();
+    }
+    if (name == "utf8") {
+        return utf8();
+    }
+    return chat();
+}
+
+bool Corpus::load(const QString& path, BenchCorpus& corpus)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    corpus.name = path;
+    corpus.lines.clear();
+    const QList<QByteArray> lines = file.readAll().split('\n');
+    for (QByteArray line : lines) {
+        if (line.endsWith('\r')) {
+            line.chop(1);
+        }
+        if (!line.isEmpty()) {
+            corpus.lines.append(line);
+        }
+    }
+    finish(corpus);
+    return !corpus.lines.isEmpty();
+}
@@ -0,0 +1,29 @@
+#ifndef CORPUS_H
+#define CORPUS_H
+
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+// Input lines for the microbenchmarks, without terminators, plus the same
+// lines as one CR/LF stream the way they arrive on a socket
+struct BenchCorpus
+{
+    QString name;
+    QList<QByteArray> lines;
+    QByteArray stream;
+
+    qint64 bytes() const { return stream.size(); }
+};
+
+namespace Corpus {
+// Built-in corpora: "chat" (typical client traffic), "long" (lines at and
+// past the line length limit) and "utf8" (multi-byte heavy text)
+QStringList builtinNames();
+BenchCorpus builtin(const QString& name);
+
+// A captured session, one IRC line per line of the file
+bool load(const QString& path, BenchCorpus& corpus);
+}
+
+#endif // CORPUS_H
@@ -0,0 +1,325 @@
+// End-to-end load generator: starts an IRCServer on loopback, drives it
+// with a synthetic client population and prints the results as JSON.
+//
+//   logos-irc-loadgen --clients 2000 --channels 50 --rate 0.5
+//       --sizes 40:70,200:25,1000:5 --churn 0.01 --storm-interval 10
+//
+// CPU and RSS cover the whole process, clients included; the server
+// thread's own CPU time is reported separately.
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
+#include <cstdio>
+#include "irclog.h"
+#include "ircserver.h"
+#include "loadgroup.h"
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace {
+struct CpuTime
+{
+    double user = 0.0;
+    double system = 0.0;
+};
+
+CpuTime processCpuTime()
+{
+    CpuTime cpu;
+#ifdef Q_OS_UNIX
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        cpu.user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+        cpu.system = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    }
+#endif
+    return cpu;
+}
+
+// CPU time of the calling thread
+double threadCpuSeconds()
+{
+#ifdef Q_OS_UNIX
+    timespec time;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) == 0) {
+        return time.tv_sec + time.tv_nsec / 1e9;
+    }
+#endif
+    return 0.0;
+}
+
+qint64 residentBytes()
+{
+#ifdef Q_OS_LINUX
+    QFile statm("/proc/self/statm");
+    if (statm.open(QIODevice::ReadOnly)) {
+        QList<QByteArray> fields = statm.readAll().split(' ');
+        if (fields.size() > 1) {
+            return fields[1].toLongLong() * sysconf(_SC_PAGESIZE);
+        }
+    }
+#endif
+    return 0;
+}
+
+qint64 peakResidentBytes()
+{
+#ifdef Q_OS_UNIX
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef Q_OS_MACOS
+        return usage.ru_maxrss;
+#else
+        return qint64(usage.ru_maxrss) * 1024;
+#endif
+    }
+#endif
+    return 0;
+}
+
+// "40:70,200:25,1000:5", sizes in bytes with relative weights
+bool parseSizes(const QString& spec, QList<QPair<int, double>>& sizes)
+{
+    const QStringList parts = spec.split(',', Qt::SkipEmptyParts);
+    for (const QString& part : parts) {
+        QStringList fields = part.split(':');
+        bool sizeOk = false;
+        bool weightOk = true;
+        int size = fields[0].toInt(&sizeOk);
+        double weight = fields.size() > 1 ? fields[1].toDouble(&weightOk) : 1.0;
+        if (!sizeOk || !weightOk || size <= 0 || weight < 0.0 || fields.size() > 2) {
+            return false;
+        }
+        sizes.append(qMakePair(size, weight));
+    }
+    return !sizes.isEmpty();
+}
+
+QJsonObject latencyJson(const IRCHistogram& histogram)
+{
+    // Recorded in ns, reported in us
+    QJsonObject json;
+    json["count"] = qint64(histogram.count());
+    json["mean"] = histogram.count() > 0 ? double(histogram.sum()) / histogram.count() / 1000.0 : 0.0;
+    json["p50"] = histogram.percentile(0.50) / 1000.0;
+    json["p99"] = histogram.percentile(0.99) / 1000.0;
+    json["p999"] = histogram.percentile(0.999) / 1000.0;
+    json["max"] = histogram.max() / 1000.0;
+    return json;
+}
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("logos-irc-loadgen");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Drives an in-process IRC server with synthetic clients and reports JSON");
+    parser.addHelpOption();
+    QCommandLineOption portOption("port", "Loopback port to serve on.", "port", "16667");
+    QCommandLineOption clientsOption("clients", "Number of clients.", "n", "100");
+    QCommandLineOption channelsOption("channels", "Number of channels.", "n", "10");
+    QCommandLineOption perClientOption("channels-per-client", "Channels each client joins.", "n", "2");
+    QCommandLineOption rateOption("rate", "PRIVMSGs per client per second.", "rate", "1");
+    QCommandLineOption sizesOption("sizes", "Message sizes in bytes with weights, e.g. 40:70,200:25,1000:5.", "spec", "80:1");
+    QCommandLineOption churnOption("churn", "Part/join cycles per client per second.", "rate", "0");
+    QCommandLineOption stormOption("storm-interval", "Seconds between reconnect storms, 0 for none.", "secs", "0");
+    QCommandLineOption stormFractionOption("storm-fraction", "Share of clients reconnecting in a storm.", "fraction", "0.1");
+    QCommandLineOption threadsOption("threads", "Client threads.", "n", "2");
+    QCommandLineOption workersOption("server-workers", "Server worker threads.", "n", "0");
+    QCommandLineOption backendOption("backend", "Server connection backend: qt or epoll.", "name", "qt");
+    QCommandLineOption floodOption("flood-rate", "Server flood control tokens per client per second, 0 for none.", "rate", "0");
+    QCommandLineOption warmupOption("warmup", "Seconds to run before measuring.", "secs", "2");
+    QCommandLineOption durationOption("duration", "Seconds to measure.", "secs", "10");
+    QCommandLineOption outputOption("output", "Write the JSON report to a file instead of stdout.", "path");
+    parser.addOptions({portOption, clientsOption, channelsOption, perClientOption, rateOption, sizesOption,
+                       churnOption, stormOption, stormFractionOption, threadsOption, workersOption, backendOption, floodOption,
+                       warmupOption, durationOption, outputOption});
+    parser.process(app);
+
+    LoadConfig config;
+    config.port = quint16(parser.value(portOption).toUInt());
+    config.clients = qMax(1, parser.value(clientsOption).toInt());
+    config.channels = qMax(1, parser.value(channelsOption).toInt());
+    config.channelsPerClient = qBound(1, parser.value(perClientOption).toInt(), config.channels);
+    config.rate = qMax(0.0, parser.value(rateOption).toDouble());
+    config.churn = qMax(0.0, parser.value(churnOption).toDouble());
+    config.stormInterval = qMax(0, parser.value(stormOption).toInt());
+    config.stormFraction = qBound(0.0, parser.value(stormFractionOption).toDouble(), 1.0);
+    config.threads = qBound(1, parser.value(threadsOption).toInt(), config.clients);
+    if (!parseSizes(parser.value(sizesOption), config.sizes)) {
+        fprintf(stderr, "Invalid --sizes: %s\n", qPrintable(parser.value(sizesOption)));
+        return 2;
+    }
+    int workers = qMax(0, parser.value(workersOption).toInt());
+    QString backend = parser.value(backendOption);
+    if (backend != "qt" && backend != "epoll") {
+        fprintf(stderr, "Invalid --backend: %s\n", qPrintable(backend));
+        return 2;
+    }
+    IRCFloodLimits floodLimits;
+    floodLimits.rate = qMax(0, parser.value(floodOption).toInt());
+    int warmup = qMax(0, parser.value(warmupOption).toInt());
+    int duration = qMax(1, parser.value(durationOption).toInt());
+
+    // Per-connection logging would dominate the profile
+    IRCLog::setLevels("warning");
+
+    // The server gets a thread of its own, like it has in the plugin host
+    QThread serverThread;
+    serverThread.setObjectName("irc-server");
+    IRCServer* server = new IRCServer;
+    server->setWorkerThreads(workers);
+    server->setBackend(backend == "epoll" ? IRCServer::Epoll : IRCServer::QtSockets);
+    // Off unless asked for: the point is to push the server past normal rates
+    server->setFloodLimits(floodLimits);
+    server->moveToThread(&serverThread);
+    serverThread.start();
+
+    bool started = false;
+    QMetaObject::invokeMethod(server, [&]() {
+        started = server->start(config.host, config.port);
+    }, Qt::BlockingQueuedConnection);
+    if (!started) {
+        fprintf(stderr, "Cannot listen on %s:%u\n", qPrintable(config.host), config.port);
+        serverThread.quit();
+        serverThread.wait();
+        delete server;
+        return 1;
+    }
+
+    // Taken before any client exists, so the growth up to registration is
+    // what the connections cost at both ends; with --rate 0 they stay idle
+    qint64 baseRss = residentBytes();
+
+    LoadTotals totals;
+    QList<QThread*> threads;
+    QList<LoadGroup*> groups;
+    for (int i = 0, first = 0; i < config.threads; ++i) {
+        int count = config.clients / config.threads + (i < config.clients % config.threads ? 1 : 0);
+        QThread* thread = new QThread;
+        thread->setObjectName(QString("loadgen-%1").arg(i));
+        LoadGroup* group = new LoadGroup(config, first, count, &totals);
+        group->moveToThread(thread);
+        thread->start();
+        QMetaObject::invokeMethod(group, &LoadGroup::start, Qt::QueuedConnection);
+        threads.append(thread);
+        groups.append(group);
+        first += count;
+    }
+
+    fprintf(stderr, "Connecting %d clients...\n", config.clients);
+    QElapsedTimer clock;
+    clock.start();
+    while (totals.registered.load() < config.clients && clock.elapsed() < 60000) {
+        QThread::msleep(50);
+    }
+    qint64 connectMs = clock.elapsed();
+    int registered = totals.registered.load();
+    qint64 connectedRss = residentBytes();
+    fprintf(stderr, "%d clients registered in %lld ms, warming up\n", registered, (long long)connectMs);
+    QThread::sleep(warmup);
+
+    // Measurement window
+    double serverCpuStart = 0.0;
+    QMetaObject::invokeMethod(server, [&]() { serverCpuStart = threadCpuSeconds(); }, Qt::BlockingQueuedConnection);
+    CpuTime cpuStart = processCpuTime();
+    totals.windowStart.store(IRCMetrics::now());
+    clock.restart();
+
+    qint64 nextStorm = config.stormInterval * 1000;
+    while (clock.elapsed() < duration * 1000) {
+        QThread::msleep(20);
+        if (nextStorm > 0 && clock.elapsed() >= nextStorm) {
+            for (LoadGroup* group : std::as_const(groups)) {
+                QMetaObject::invokeMethod(group, &LoadGroup::storm, Qt::QueuedConnection);
+            }
+            nextStorm += config.stormInterval * 1000;
+        }
+    }
+    double elapsed = clock.elapsed() / 1000.0;
+    totals.windowEnd.store(IRCMetrics::now());
+    CpuTime cpuEnd = processCpuTime();
+    double serverCpuEnd = 0.0;
+    QMetaObject::invokeMethod(server, [&]() { serverCpuEnd = threadCpuSeconds(); }, Qt::BlockingQueuedConnection);
+    qint64 rss = residentBytes();
+
+    // Let deliveries of messages sent inside the window arrive
+    QThread::sleep(1);
+
+    QJsonObject serverMetrics;
+    QMetaObject::invokeMethod(server, [&]() { serverMetrics = server->metricsSnapshot(); }, Qt::BlockingQueuedConnection);
+
+    for (int i = 0; i < groups.size(); ++i) {
+        QMetaObject::invokeMethod(groups[i], &LoadGroup::stop, Qt::BlockingQueuedConnection);
+        threads[i]->quit();
+        threads[i]->wait();
+        delete groups[i];
+        delete threads[i];
+    }
+    QMetaObject::invokeMethod(server, &IRCServer::stop, Qt::BlockingQueuedConnection);
+    serverThread.quit();
+    serverThread.wait();
+    delete server;
+
+    QJsonObject configJson;
+    configJson["clients"] = config.clients;
+    configJson["channels"] = config.channels;
+    configJson["channels_per_client"] = config.channelsPerClient;
+    configJson["rate"] = config.rate;
+    configJson["sizes"] = parser.value(sizesOption);
+    configJson["churn"] = config.churn;
+    configJson["storm_interval"] = config.stormInterval;
+    configJson["storm_fraction"] = config.stormFraction;
+    configJson["client_threads"] = config.threads;
+    configJson["server_workers"] = workers;
+    configJson["backend"] = backend;
+    configJson["duration"] = duration;
+
+    QJsonObject cpu;
+    cpu["user_seconds"] = cpuEnd.user - cpuStart.user;
+    cpu["system_seconds"] = cpuEnd.system - cpuStart.system;
+    cpu["utilization"] = (cpuEnd.user + cpuEnd.system - cpuStart.user - cpuStart.system) / elapsed;
+    cpu["server_thread_seconds"] = serverCpuEnd - serverCpuStart;
+
+    QJsonObject report;
+    report["config"] = configJson;
+    report["connect_ms"] = connectMs;
+    report["elapsed_seconds"] = elapsed;
+    report["messages_sent"] = qint64(totals.sent.value());
+    report["messages_per_second"] = totals.sent.value() / elapsed;
+    report["deliveries"] = qint64(totals.delivered.value());
+    report["deliveries_per_second"] = totals.delivered.value() / elapsed;
+    report["delivery_latency_us"] = latencyJson(totals.latency);
+    report["register_latency_us"] = latencyJson(totals.registerLatency);
+    report["connects"] = qint64(totals.connects.value());
+    report["reconnects"] = qint64(totals.reconnects.value());
+    report["server_disconnects"] = qint64(totals.disconnects.value());
+    report["cpu"] = cpu;
+    report["rss_bytes"] = rss;
+    report["peak_rss_bytes"] = peakResidentBytes();
+    report["connected_rss_bytes_per_client"] = registered > 0 ? (connectedRss - baseRss) / registered : 0;
+    report["server"] = serverMetrics;
+
+    QByteArray json = QJsonDocument(report).toJson(QJsonDocument::Indented);
+    if (parser.isSet(outputOption)) {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(json) != json.size()) {
+            fprintf(stderr, "Cannot write %s\n", qPrintable(file.fileName()));
+            return 1;
+        }
+    } else {
+        fwrite(json.constData(), 1, size_t(json.size()), stdout);
+    }
+    return 0;
+}
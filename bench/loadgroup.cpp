@@ -0,0 +1,299 @@
+#include "loadgroup.h"
+#include <QTcpSocket>
+#include <QTimer>
+
+namespace {
+constexpr int TickMs = 10;
+
+// Clients cut off by the server wait this long before coming back
+constexpr int ReconnectDelayMs = 1000;
+
+// Lines above this are rejected by the server's line buffer
+constexpr int MaxMessageBytes = 4000;
+}
+
+LoadGroup::LoadGroup(const LoadConfig& config, int first, int count, LoadTotals* totals)
+    : m_config(config)
+    , m_first(first)
+    , m_totals(totals)
+    , m_clients(count)
+    , m_timer(nullptr)
+    , m_lastTick(0)
+    , m_random(quint32(first + 1))
+    , m_sizeWeights(0.0)
+    , m_stopping(false)
+{
+    for (const auto& size : std::as_const(m_config.sizes)) {
+        m_sizeWeights += size.second;
+    }
+
+    // Every client starts in distinct channels picked from the whole range
+    int perClient = qMin(m_config.channelsPerClient, m_config.channels);
+    for (Client& client : m_clients) {
+        while (client.channels.size() < perClient) {
+            int channel = m_random.bounded(m_config.channels);
+            if (!client.channels.contains(channel)) {
+                client.channels.append(channel);
+            }
+        }
+    }
+}
+
+LoadGroup::~LoadGroup()
+{
+    stop();
+}
+
+QByteArray LoadGroup::channelName(int channel)
+{
+    return "#bench" + QByteArray::number(channel);
+}
+
+void LoadGroup::start()
+{
+    m_timer = new QTimer(this);
+    m_timer->setTimerType(Qt::PreciseTimer);
+    connect(m_timer, &QTimer::timeout, this, &LoadGroup::tick);
+    m_clock.start();
+    m_timer->start(TickMs);
+
+    for (int i = 0; i < m_clients.size(); ++i) {
+        connectClient(i);
+    }
+}
+
+void LoadGroup::connectClient(int index)
+{
+    static std::atomic<int> generation { 0 };
+
+    Client& client = m_clients[index];
+    client.socket = new QTcpSocket(this);
+    client.buffer.clear();
+    client.registered = false;
+    client.credit = 0.0;
+    // A fresh nick each time, so a reconnect never races the old session
+    client.nick = "bench" + QByteArray::number(m_first + index) + "-" + QByteArray::number(generation.fetch_add(1, std::memory_order_relaxed), 36);
+    client.connectedAt = IRCMetrics::now();
+
+    QTcpSocket* socket = client.socket;
+    connect(socket, &QTcpSocket::connected, this, [this, socket, index]() {
+        const QByteArray& nick = m_clients[index].nick;
+        socket->write("NICK " + nick + "\r\nUSER " + nick + " 0 * :load generator\r\n");
+    });
+    connect(socket, &QTcpSocket::readyRead, this, [this, index]() { readClient(index); });
+    connect(socket, &QTcpSocket::disconnected, this, [this, index]() { clientClosed(index); });
+    connect(socket, &QTcpSocket::errorOccurred, this, [this, socket, index](QAbstractSocket::SocketError) {
+        // A refused connect never reaches disconnected
+        if (socket->state() == QAbstractSocket::UnconnectedState) {
+            clientClosed(index);
+        }
+    });
+
+    m_totals->connects.add();
+    socket->connectToHost(m_config.host, m_config.port);
+}
+
+void LoadGroup::readClient(int index)
+{
+    Client& client = m_clients[index];
+    client.buffer += client.socket->readAll();
+
+    qsizetype start = 0;
+    qsizetype end;
+    while ((end = client.buffer.indexOf('\n', start)) >= 0) {
+        qsizetype length = end - start;
+        if (length > 0 && client.buffer[end - 1] == '\r') {
+            --length;
+        }
+        handleLine(index, QByteArrayView(client.buffer.constData() + start, length));
+        start = end + 1;
+    }
+    client.buffer.remove(0, start);
+}
+
+void LoadGroup::handleLine(int index, QByteArrayView line)
+{
+    Client& client = m_clients[index];
+
+    // ":prefix COMMAND params"
+    if (line.startsWith(':')) {
+        qsizetype space = line.indexOf(' ');
+        if (space < 0) {
+            return;
+        }
+        line = line.mid(space + 1);
+    }
+    qsizetype space = line.indexOf(' ');
+    QByteArrayView command = space < 0 ? line : line.first(space);
+    QByteArrayView params = space < 0 ? QByteArrayView() : line.mid(space + 1);
+
+    if (command == QByteArrayView("PRIVMSG")) {
+        qsizetype colon = params.indexOf(" :");
+        if (colon < 0) {
+            return;
+        }
+        QByteArrayView text = params.mid(colon + 2);
+        qsizetype stamp = text.indexOf(' ');
+        bool ok = false;
+        qint64 sentAt = (stamp < 0 ? text : text.first(stamp)).toLongLong(&ok);
+        qint64 windowStart = m_totals->windowStart.load(std::memory_order_relaxed);
+        qint64 windowEnd = m_totals->windowEnd.load(std::memory_order_relaxed);
+        if (ok && windowStart > 0 && sentAt >= windowStart && (windowEnd == 0 || sentAt < windowEnd)) {
+            m_totals->delivered.add();
+            m_totals->latency.record(quint64(qMax<qint64>(0, IRCMetrics::now() - sentAt)));
+        }
+    } else if (command == QByteArrayView("PING")) {
+        client.socket->write("PONG " + params.toByteArray() + "\r\n");
+    } else if (command == QByteArrayView("001") && !client.registered) {
+        client.registered = true;
+        m_totals->registered.fetch_add(1, std::memory_order_relaxed);
+        m_totals->registerLatency.record(quint64(IRCMetrics::now() - client.connectedAt));
+
+        QByteArray joins;
+        for (int channel : std::as_const(client.channels)) {
+            joins += "JOIN " + channelName(channel) + "\r\n";
+        }
+        client.socket->write(joins);
+    }
+}
+
+void LoadGroup::clientClosed(int index)
+{
+    Client& client = m_clients[index];
+    if (!client.socket) {
+        return;
+    }
+    if (client.registered) {
+        m_totals->registered.fetch_sub(1, std::memory_order_relaxed);
+    }
+    client.registered = false;
+    client.socket->disconnect(this);
+    client.socket->deleteLater();
+    client.socket = nullptr;
+
+    if (!m_stopping) {
+        m_totals->disconnects.add();
+        QTimer::singleShot(ReconnectDelayMs, this, [this, index]() {
+            if (!m_stopping && !m_clients[index].socket) {
+                connectClient(index);
+            }
+        });
+    }
+}
+
+void LoadGroup::tick()
+{
+    qint64 elapsed = m_clock.elapsed();
+    double seconds = (elapsed - m_lastTick) / 1000.0;
+    m_lastTick = elapsed;
+
+    double churnChance = m_config.churn * seconds;
+    for (Client& client : m_clients) {
+        if (!client.registered) {
+            continue;
+        }
+        client.credit += m_config.rate * seconds;
+        while (client.credit >= 1.0) {
+            client.credit -= 1.0;
+            sendMessage(client);
+        }
+        if (churnChance > 0.0 && m_random.generateDouble() < churnChance) {
+            cycleChannel(client);
+        }
+    }
+}
+
+int LoadGroup::messageSize()
+{
+    if (m_config.sizes.isEmpty() || m_sizeWeights <= 0.0) {
+        return 80;
+    }
+    double pick = m_random.generateDouble() * m_sizeWeights;
+    for (const auto& size : std::as_const(m_config.sizes)) {
+        pick -= size.second;
+        if (pick < 0.0) {
+            return size.first;
+        }
+    }
+    return m_config.sizes.constLast().first;
+}
+
+void LoadGroup::sendMessage(Client& client)
+{
+    if (client.channels.isEmpty()) {
+        return;
+    }
+
+    qint64 now = IRCMetrics::now();
+    QByteArray text = QByteArray::number(now);
+    int size = qBound(int(text.size()), messageSize(), MaxMessageBytes);
+    text += ' ';
+    text += QByteArray(qMax(0, size - int(text.size())), 'x');
+
+    int channel = client.channels[m_random.bounded(int(client.channels.size()))];
+    client.socket->write("PRIVMSG " + channelName(channel) + " :" + text + "\r\n");
+
+    if (m_totals->windowStart.load(std::memory_order_relaxed) > 0 && m_totals->windowEnd.load(std::memory_order_relaxed) == 0) {
+        m_totals->sent.add();
+    }
+}
+
+void LoadGroup::cycleChannel(Client& client)
+{
+    if (client.channels.isEmpty() || client.channels.size() >= m_config.channels) {
+        return;
+    }
+
+    int slot = m_random.bounded(int(client.channels.size()));
+    int next;
+    do {
+        next = m_random.bounded(m_config.channels);
+    } while (client.channels.contains(next));
+
+    client.socket->write("PART " + channelName(client.channels[slot]) + " :churn\r\nJOIN " + channelName(next) + "\r\n");
+    client.channels[slot] = next;
+}
+
+void LoadGroup::storm()
+{
+    if (m_stopping) {
+        return;
+    }
+    for (int i = 0; i < m_clients.size(); ++i) {
+        Client& client = m_clients[i];
+        if (!client.socket || m_random.generateDouble() >= m_config.stormFraction) {
+            continue;
+        }
+        if (client.registered) {
+            m_totals->registered.fetch_sub(1, std::memory_order_relaxed);
+        }
+        client.socket->disconnect(this);
+        client.socket->abort();
+        client.socket->deleteLater();
+        client.socket = nullptr;
+
+        m_totals->reconnects.add();
+        connectClient(i);
+    }
+}
+
+void LoadGroup::stop()
+{
+    m_stopping = true;
+    if (m_timer) {
+        m_timer->stop();
+    }
+    for (Client& client : m_clients) {
+        if (!client.socket) {
+            continue;
+        }
+        if (client.registered) {
+            m_totals->registered.fetch_sub(1, std::memory_order_relaxed);
+            client.registered = false;
+        }
+        client.socket->disconnect(this);
+        client.socket->abort();
+        delete client.socket;
+        client.socket = nullptr;
+    }
+}
@@ -0,0 +1,100 @@
+#ifndef LOADGROUP_H
+#define LOADGROUP_H
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QElapsedTimer>
+#include <QList>
+#include <QObject>
+#include <QPair>
+#include <QRandomGenerator>
+#include <QString>
+#include <atomic>
+#include "ircmetrics.h"
+
+class QTcpSocket;
+class QTimer;
+
+struct LoadConfig
+{
+    QString host = "127.0.0.1";
+    quint16 port = 16667;
+    int clients = 100;
+    int channels = 10;
+    int channelsPerClient = 2;
+    double rate = 1.0;                  // PRIVMSGs per client per second
+    QList<QPair<int, double>> sizes;    // Message bytes and relative weight
+    double churn = 0.0;                 // Part/join cycles per client per second
+    int stormInterval = 0;              // Seconds between reconnect storms, 0 for none
+    double stormFraction = 0.1;         // Share of clients reconnecting in a storm
+    int threads = 2;                    // Client threads
+};
+
+// Shared by every group; messages only count if they were sent while the
+// measurement window was open
+struct LoadTotals
+{
+    std::atomic<int> registered { 0 };
+    std::atomic<qint64> windowStart { 0 };      // IRCMetrics::now(), 0 while closed
+    std::atomic<qint64> windowEnd { 0 };
+    IRCCounter sent;
+    IRCCounter delivered;
+    IRCCounter connects;
+    IRCCounter reconnects;
+    IRCCounter disconnects;                     // Closed by the server
+    IRCHistogram latency;                       // Send to delivery, ns
+    IRCHistogram registerLatency;               // Connect to 001, ns
+};
+
+// A share of the synthetic clients, served on one thread. Every client
+// registers, joins its channels and then sends at the configured rate;
+// each PRIVMSG carries its send time so receivers measure delivery latency.
+class LoadGroup : public QObject
+{
+    Q_OBJECT
+
+public:
+    LoadGroup(const LoadConfig& config, int first, int count, LoadTotals* totals);
+    ~LoadGroup();
+
+public slots:
+    void start();
+    // Drops and reconnects a share of the clients at once
+    void storm();
+    void stop();
+
+private:
+    struct Client
+    {
+        QTcpSocket* socket = nullptr;
+        QByteArray nick;
+        QByteArray buffer;
+        QList<int> channels;
+        qint64 connectedAt = 0;
+        double credit = 0.0;
+        bool registered = false;
+    };
+
+    void connectClient(int index);
+    void readClient(int index);
+    void handleLine(int index, QByteArrayView line);
+    void clientClosed(int index);
+    void tick();
+    void sendMessage(Client& client);
+    void cycleChannel(Client& client);
+    int messageSize();
+    static QByteArray channelName(int channel);
+
+    LoadConfig m_config;
+    int m_first;
+    LoadTotals* m_totals;
+    QList<Client> m_clients;
+    QTimer* m_timer;
+    QElapsedTimer m_clock;
+    qint64 m_lastTick;
+    QRandomGenerator m_random;
+    double m_sizeWeights;
+    bool m_stopping;
+};
+
+#endif // LOADGROUP_H
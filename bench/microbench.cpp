@@ -0,0 +1,328 @@
+// Microbenchmarks for the per-line kernels, each run over every corpus:
+//
+//   frame          IRCLineBuffer splitting socket-sized reads into lines
+//   parse          IRCMessage::parse and the command lookup
+//   format.text    IRCMessage::format from QStrings, as IRCClient::sendMessage does
+//   format.bytes   IRCMessage::format from UTF-8 views, as relayed PRIVMSGs do
+//   fanout         one line to every member of a channel, over mock sockets
+//
+//   logos-irc-microbench --corpus capture.txt --filter parse --output parse.json
+//
+// Results go out as JSON so runs can be compared over time.
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTcpSocket>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include "corpus.h"
+#include "ircchannel.h"
+#include "ircclient.h"
+#include "ircconnection.h"
+#include "irclinebuffer.h"
+#include "ircmessage.h"
+
+namespace {
+// TCP segment sized reads, as the socket tends to hand them over
+constexpr qsizetype ReadSize = 1460;
+
+// Keeps results alive so the compiler cannot drop the work
+volatile quint64 sink = 0;
+
+// A socket that is always connected and swallows whatever is written
+class MockSocket : public QTcpSocket
+{
+public:
+    MockSocket()
+    {
+        setSocketState(QAbstractSocket::ConnectedState);
+        setOpenMode(QIODevice::ReadWrite | QIODevice::Unbuffered);
+    }
+
+    // Lets the connection be torn down without a real disconnect
+    void detach() { setSocketState(QAbstractSocket::UnconnectedState); }
+
+    qint64 written = 0;
+
+protected:
+    qint64 writeData(const char* data, qint64 size) override
+    {
+        Q_UNUSED(data)
+        written += size;
+        return size;
+    }
+};
+
+struct Pass
+{
+    quint64 ops = 0;
+    quint64 bytes = 0;
+};
+
+// Repeats whole passes over the corpus until minNsecs have gone by
+QJsonObject measure(const QString& kernel, const BenchCorpus& corpus, qint64 minNsecs, const std::function<Pass()>& pass)
+{
+    pass();     // Warm up caches and allocators
+
+    Pass total;
+    int passes = 0;
+    QElapsedTimer timer;
+    timer.start();
+    do {
+        Pass one = pass();
+        total.ops += one.ops;
+        total.bytes += one.bytes;
+        ++passes;
+    } while (timer.nsecsElapsed() < minNsecs);
+    qint64 nsecs = timer.nsecsElapsed();
+    double nsPerOp = total.ops > 0 ? double(nsecs) / total.ops : 0.0;
+    double opsPerSecond = total.ops * 1e9 / nsecs;
+    double mbPerSecond = total.bytes * 1e9 / nsecs / (1024.0 * 1024.0);
+
+    fprintf(stderr, "%-14s %-10s %12.1f ns/op %14.0f ops/s %10.1f MB/s\n",
+            qPrintable(kernel), qPrintable(corpus.name), nsPerOp, opsPerSecond, mbPerSecond);
+
+    QJsonObject result;
+    result["kernel"] = kernel;
+    result["corpus"] = corpus.name;
+    result["passes"] = passes;
+    result["ops"] = qint64(total.ops);
+    result["ns_per_op"] = nsPerOp;
+    result["ops_per_second"] = opsPerSecond;
+    result["mb_per_second"] = mbPerSecond;
+    return result;
+}
+
+Pass frame(const BenchCorpus& corpus)
+{
+    IRCLineBuffer buffer;
+    Pass pass;
+    const char* data = corpus.stream.constData();
+    qsizetype remaining = corpus.stream.size();
+    while (remaining > 0) {
+        char* writePointer = buffer.writePointer();
+        qsizetype size = qMin(qMin(ReadSize, remaining), buffer.writableBytes());
+        memcpy(writePointer, data, size_t(size));
+        buffer.commit(size);
+        data += size;
+        remaining -= size;
+
+        QByteArrayView line;
+        IRCLineBuffer::Status status;
+        while ((status = buffer.nextLine(line)) != IRCLineBuffer::NeedMore) {
+            if (status == IRCLineBuffer::Line) {
+                sink = sink + quint64(line.size());
+            }
+            ++pass.ops;
+        }
+    }
+    pass.bytes = quint64(corpus.stream.size());
+    return pass;
+}
+
+Pass parse(const BenchCorpus& corpus)
+{
+    Pass pass;
+    IRCParsedMessage message;
+    for (const QByteArray& line : corpus.lines) {
+        if (IRCMessage::parse(line, message)) {
+            sink = sink + quint64(IRCMessage::command(message.command)) + quint64(message.paramCount);
+        }
+        pass.bytes += quint64(line.size());
+    }
+    pass.ops = quint64(corpus.lines.size());
+    return pass;
+}
+
+// The corpus lines become the trailing parameter of relayed PRIVMSGs
+struct FormatInput
+{
+    QString prefix = "someone!someone@10.0.0.1";
+    QList<QString> params;
+    QList<QByteArray> trailing;
+};
+
+FormatInput formatInput(const BenchCorpus& corpus)
+{
+    FormatInput input;
+    for (const QByteArray& line : corpus.lines) {
+        input.params.append("#channel :" + QString::fromUtf8(line));
+        input.trailing.append(line);
+    }
+    return input;
+}
+
+Pass formatText(const FormatInput& input)
+{
+    Pass pass;
+    const QString command("PRIVMSG");
+    for (const QString& params : input.params) {
+        QByteArray line = IRCMessage::format(input.prefix, command, params);
+        pass.bytes += quint64(line.size());
+    }
+    pass.ops = quint64(input.params.size());
+    return pass;
+}
+
+Pass formatBytes(const FormatInput& input)
+{
+    Pass pass;
+    const QByteArray prefix = input.prefix.toUtf8();
+    for (const QByteArray& trailing : input.trailing) {
+        QByteArray line = IRCMessage::format(prefix, "PRIVMSG", "#channel", trailing);
+        pass.bytes += quint64(line.size());
+    }
+    pass.ops = quint64(input.trailing.size());
+    return pass;
+}
+
+// A channel full of registered clients served on this thread
+class FanoutChannel
+{
+public:
+    explicit FanoutChannel(int members)
+        : m_channels(&m_strings)
+    {
+        const IRCName host = m_strings.intern(QByteArrayView("10.0.0.1"));
+        const IRCName user = m_strings.intern(QByteArrayView("member"));
+        m_channel = m_channels.findOrCreate("#bench");
+        for (int i = 0; i < members; ++i) {
+            MockSocket* socket = new MockSocket;
+            m_sockets.append(socket);
+            IRCClient* client = m_pool.create(new IRCConnection(socket), nullptr, host);
+            client->setNick(m_strings.intern("member" + QString::number(i)));
+            client->setUser(user);
+            client->setRegistered(true);
+            m_clients.append(client);
+            m_channels.join(m_channel, client);
+        }
+    }
+
+    ~FanoutChannel()
+    {
+        for (MockSocket* socket : std::as_const(m_sockets)) {
+            socket->detach();
+        }
+        m_channels.clear();
+        for (IRCClient* client : std::as_const(m_clients)) {
+            m_pool.destroy(client);
+        }
+    }
+
+    // What IRCServer::sendToChannel does for clients on its own thread,
+    // followed by the once-per-pass flush of the send queues
+    Pass deliver(const QList<QByteArray>& lines)
+    {
+        Pass pass;
+        for (const QByteArray& line : lines) {
+            for (const IRCMember& member : m_channel->members()) {
+                if (member.client->isRegistered()) {
+                    member.client->sendLine(line);
+                    ++pass.ops;
+                    pass.bytes += quint64(line.size());
+                }
+            }
+            QCoreApplication::sendPostedEvents(nullptr, QEvent::MetaCall);
+        }
+        return pass;
+    }
+
+private:
+    IRCStringTable m_strings;
+    IRCClientPool m_pool;
+    IRCChannelRegistry m_channels;
+    IRCChannel* m_channel;
+    QList<IRCClient*> m_clients;
+    QList<MockSocket*> m_sockets;
+};
+}
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName("logos-irc-microbench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Microbenchmarks for line framing, parsing, formatting and fan-out");
+    parser.addHelpOption();
+    QCommandLineOption corpusOption("corpus", "Captured traffic to run, one IRC line per line; repeatable. "
+                                    "Built in: chat, long, utf8.", "path|name");
+    QCommandLineOption filterOption("filter", "Only run kernels whose name contains this.", "text");
+    QCommandLineOption timeOption("min-time", "Milliseconds to run each kernel on each corpus.", "ms", "500");
+    QCommandLineOption membersOption("members", "Channel size for the fanout kernel.", "n", "1000");
+    QCommandLineOption outputOption("output", "Write the JSON report to a file instead of stdout.", "path");
+    parser.addOptions({corpusOption, filterOption, timeOption, membersOption, outputOption});
+    parser.process(app);
+
+    QList<BenchCorpus> corpora;
+    QStringList names = parser.values(corpusOption);
+    if (names.isEmpty()) {
+        names = Corpus::builtinNames();
+    }
+    for (const QString& name : std::as_const(names)) {
+        if (Corpus::builtinNames().contains(name)) {
+            corpora.append(Corpus::builtin(name));
+            continue;
+        }
+        BenchCorpus corpus;
+        if (!Corpus::load(name, corpus)) {
+            fprintf(stderr, "Cannot read corpus %s\n", qPrintable(name));
+            return 2;
+        }
+        corpora.append(corpus);
+    }
+
+    QString filter = parser.value(filterOption);
+    qint64 minNsecs = qMax<qint64>(1, parser.value(timeOption).toLongLong()) * 1000000;
+    int members = qMax(1, parser.value(membersOption).toInt());
+    auto selected = [&](const QString& kernel) { return filter.isEmpty() || kernel.contains(filter); };
+
+    QJsonArray results;
+    for (const BenchCorpus& corpus : std::as_const(corpora)) {
+        if (selected("frame")) {
+            results.append(measure("frame", corpus, minNsecs, [&]() { return frame(corpus); }));
+        }
+        if (selected("parse")) {
+            results.append(measure("parse", corpus, minNsecs, [&]() { return parse(corpus); }));
+        }
+        if (selected("format.text") || selected("format.bytes")) {
+            FormatInput input = formatInput(corpus);
+            if (selected("format.text")) {
+                results.append(measure("format.text", corpus, minNsecs, [&]() { return formatText(input); }));
+            }
+            if (selected("format.bytes")) {
+                results.append(measure("format.bytes", corpus, minNsecs, [&]() { return formatBytes(input); }));
+            }
+        }
+        if (selected("fanout")) {
+            // Lines as the server relays them, formatted once up front
+            QList<QByteArray> lines;
+            for (const QByteArray& line : corpus.lines) {
+                lines.append(IRCMessage::format("someone!someone@10.0.0.1", "PRIVMSG", "#bench", line));
+            }
+            FanoutChannel channel(members);
+            results.append(measure("fanout", corpus, minNsecs, [&]() { return channel.deliver(lines); }));
+        }
+    }
+
+    QJsonObject report;
+    report["members"] = members;
+    report["results"] = results;
+    QByteArray json = QJsonDocument(report).toJson(QJsonDocument::Indented);
+    if (parser.isSet(outputOption)) {
+        QFile file(parser.value(outputOption));
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(json) != json.size()) {
+            fprintf(stderr, "Cannot write %s\n", qPrintable(file.fileName()));
+            return 1;
+        }
+    } else {
+        fwrite(json.constData(), 1, size_t(json.size()), stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+#include "ircbridge.h"
+#include "ircmetrics.h"
+#include <QDebug>
+#include <QThread>
+
+namespace {
+// Messages handled per wakeup before yielding to the worker's event loop,
+// so stop() is not held up by a long backlog
+constexpr int MaxBatch = 64;
+}
+
+IRCBridgeOutbox::IRCBridgeOutbox(Sender sender, Finisher finisher, int limit)
+    : m_sender(std::move(sender))
+    , m_finisher(std::move(finisher))
+    , m_limit(qMax(1, limit))
+    , m_thread(nullptr)
+    , m_depth(0)
+    , m_sent(0)
+    , m_dropped(0)
+    , m_batches(0)
+    , m_overflowing(false)
+{
+}
+
+IRCBridgeOutbox::~IRCBridgeOutbox()
+{
+    stop();
+}
+
+void IRCBridgeOutbox::start()
+{
+    if (m_thread) {
+        return;
+    }
+    m_thread = new QThread;
+    m_thread->setObjectName("irc-bridge");
+    moveToThread(m_thread);
+    m_thread->start();
+}
+
+void IRCBridgeOutbox::stop()
+{
+    if (!m_thread) {
+        return;
+    }
+
+    // Hand the outbox back before the thread goes away
+    QMetaObject::invokeMethod(this, [this, owner = QThread::currentThread()]() {
+        if (m_finisher) {
+            m_finisher();
+        }
+        moveToThread(owner);
+    }, Qt::BlockingQueuedConnection);
+    m_thread->quit();
+    m_thread->wait();
+    delete m_thread;
+    m_thread = nullptr;
+
+    m_queue.beginDrain();
+    IRCBridgeMessage message;
+    while (m_queue.pop(message)) {
+        m_depth.fetch_sub(1, std::memory_order_relaxed);
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+bool IRCBridgeOutbox::post(IRCBridgeMessage&& message)
+{
+    if (message.type == IRCBridgeMessage::Send && m_depth.load(std::memory_order_relaxed) >= m_limit) {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        if (!m_overflowing) {
+            m_overflowing = true;
+            qWarning() << "IRCBridgeOutbox: chat is falling behind," << m_limit << "messages queued, dropping new ones";
+        }
+        return false;
+    }
+    m_overflowing = false;
+
+    message.posted = IRCMetrics::now();
+    m_depth.fetch_add(1, std::memory_order_relaxed);
+    if (m_queue.push(std::move(message))) {
+        QMetaObject::invokeMethod(this, &IRCBridgeOutbox::drain, Qt::QueuedConnection);
+    }
+    return true;
+}
+
+void IRCBridgeOutbox::drain()
+{
+    m_queue.beginDrain();
+    m_batches.fetch_add(1, std::memory_order_relaxed);
+
+    IRCBridgeMessage message;
+    for (int handled = 0; handled < MaxBatch; ++handled) {
+        if (!m_queue.pop(message)) {
+            return;
+        }
+        m_depth.fetch_sub(1, std::memory_order_relaxed);
+        m_sender(message);
+        m_sent.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // More work left; continue on the next pass
+    QMetaObject::invokeMethod(this, &IRCBridgeOutbox::drain, Qt::QueuedConnection);
+}
@@ -0,0 +1,80 @@
+#ifndef IRCBRIDGE_H
+#define IRCBRIDGE_H
+
+#include <QObject>
+#include <QString>
+#include <atomic>
+#include <functional>
+#include "ircqueue.h"
+
+class QThread;
+
+// A request from IRC on its way to the chat module
+struct IRCBridgeMessage
+{
+    enum Type {
+        Send,       // text from nick to channel
+        Join        // join channel and retrieve its history
+    };
+
+    Type type = Send;
+    QString channel;    // chat channel, without the leading '#'
+    QString nick;
+    QString text;
+    qint64 posted = 0;  // IRCMetrics::now() when queued, set by post()
+};
+
+// Bounded queue of outbound bridge traffic, drained by a dedicated worker
+// thread so a slow chat module never holds up the IRC server. The sender is
+// called on the worker thread, in the order messages were posted, and the
+// finisher runs there once the sender will not be called again, so anything
+// the sender creates can live and die on that thread.
+//
+// When the chat side falls behind and the queue is full, new Send messages
+// are dropped and counted rather than queued without bound. Joins are
+// always queued; callers coalesce them.
+class IRCBridgeOutbox : public QObject
+{
+    Q_OBJECT
+
+public:
+    using Sender = std::function<void(const IRCBridgeMessage&)>;
+    using Finisher = std::function<void()>;
+
+    static constexpr int DefaultLimit = 1024;
+
+    explicit IRCBridgeOutbox(Sender sender, Finisher finisher = Finisher(), int limit = DefaultLimit);
+    ~IRCBridgeOutbox();
+
+    // Starts the worker thread; stop() discards whatever is still queued.
+    // Call both from the thread that created the outbox.
+    void start();
+    void stop();
+
+    // Returns false if the queue was full and the message was dropped.
+    // Called from a single producer thread.
+    bool post(IRCBridgeMessage&& message);
+
+    // Counters, readable from any thread
+    int depth() const { return m_depth.load(std::memory_order_relaxed); }
+    quint64 sent() const { return m_sent.load(std::memory_order_relaxed); }
+    quint64 dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+    quint64 batches() const { return m_batches.load(std::memory_order_relaxed); }
+
+private slots:
+    void drain();
+
+private:
+    Sender m_sender;
+    Finisher m_finisher;
+    int m_limit;
+    QThread* m_thread;
+    IRCMpscQueue<IRCBridgeMessage> m_queue;
+    std::atomic<int> m_depth;
+    std::atomic<quint64> m_sent;
+    std::atomic<quint64> m_dropped;
+    std::atomic<quint64> m_batches;
+    bool m_overflowing;     // Producer side, to warn once per overflow
+};
+
+#endif // IRCBRIDGE_H
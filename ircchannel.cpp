@@ -0,0 +1,129 @@
+#include "ircchannel.h"
+#include "ircclient.h"
+
+IRCChannel::IRCChannel(quint32 id, const IRCName& name)
+    : m_id(id)
+    , m_name(name)
+{
+}
+
+IRCChannelRegistry::IRCChannelRegistry(IRCStringTable* strings)
+    : m_strings(strings)
+{
+}
+
+IRCChannelRegistry::~IRCChannelRegistry()
+{
+    clear();
+}
+
+IRCChannel* IRCChannelRegistry::find(QByteArrayView name) const
+{
+    // A name nothing has interned cannot belong to a channel
+    const IRCInternedString* key = m_strings->findFolded(name).foldedKey();
+    return key ? m_index.value(key) : nullptr;
+}
+
+IRCChannel* IRCChannelRegistry::find(const QString& name) const
+{
+    return find(QByteArrayView(name.toUtf8()));
+}
+
+IRCChannel* IRCChannelRegistry::channel(quint32 id) const
+{
+    return id < quint32(m_channels.size()) ? m_channels.at(id) : nullptr;
+}
+
+IRCChannel* IRCChannelRegistry::findOrCreate(const QString& name)
+{
+    if (IRCChannel* channel = find(name)) {
+        return channel;
+    }
+
+    quint32 id;
+    if (!m_freeIds.isEmpty()) {
+        id = m_freeIds.takeLast();
+    } else {
+        id = quint32(m_channels.size());
+        m_channels.append(nullptr);
+    }
+
+    IRCChannel* channel = new IRCChannel(id, m_strings->intern(name));
+    m_channels[id] = channel;
+    m_index.insert(channel->m_name.foldedKey(), channel);
+    return channel;
+}
+
+bool IRCChannelRegistry::join(IRCChannel* channel, IRCClient* client)
+{
+    if (client->isInChannel(channel)) {
+        return false;
+    }
+
+    const quint32 memberSlot = quint32(channel->m_members.size());
+    const quint32 membershipSlot = quint32(client->m_memberships.size());
+    channel->m_members.append({client, membershipSlot});
+    client->m_memberships.append({channel->m_id, memberSlot});
+    return true;
+}
+
+bool IRCChannelRegistry::part(IRCChannel* channel, IRCClient* client)
+{
+    const qsizetype membershipSlot = client->membershipIndex(channel);
+    if (membershipSlot < 0) {
+        return false;
+    }
+    const quint32 memberSlot = client->m_memberships.at(membershipSlot).slot;
+
+    // Swap-remove the client from the channel, then fix up the moved
+    // member's record of where it sits
+    const IRCMember lastMember = channel->m_members.last();
+    channel->m_members.removeLast();
+    if (memberSlot < quint32(channel->m_members.size())) {
+        channel->m_members[memberSlot] = lastMember;
+        lastMember.client->m_memberships[lastMember.slot].slot = memberSlot;
+    }
+
+    // Same for the channel in the client's list
+    const IRCMembership lastMembership = client->m_memberships.last();
+    client->m_memberships.removeLast();
+    if (membershipSlot < client->m_memberships.size()) {
+        client->m_memberships[membershipSlot] = lastMembership;
+        m_channels.at(lastMembership.channel)->m_members[lastMembership.slot].slot = quint32(membershipSlot);
+    }
+
+    if (channel->isEmpty()) {
+        destroy(channel);
+    }
+    return true;
+}
+
+void IRCChannelRegistry::partAll(IRCClient* client)
+{
+    // Parting from the back never moves another entry of this client's list
+    while (!client->m_memberships.isEmpty()) {
+        part(m_channels.at(client->m_memberships.last().channel), client);
+    }
+}
+
+void IRCChannelRegistry::clear()
+{
+    for (IRCChannel* channel : std::as_const(m_channels)) {
+        if (!channel) continue;
+        for (const IRCMember& member : std::as_const(channel->m_members)) {
+            member.client->m_memberships.clear();
+        }
+        delete channel;
+    }
+    m_channels.clear();
+    m_freeIds.clear();
+    m_index.clear();
+}
+
+void IRCChannelRegistry::destroy(IRCChannel* channel)
+{
+    m_index.remove(channel->m_name.foldedKey());
+    m_channels[channel->id()] = nullptr;
+    m_freeIds.append(channel->id());
+    delete channel;
+}
@@ -0,0 +1,93 @@
+#ifndef IRCCHANNEL_H
+#define IRCCHANNEL_H
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include "ircintern.h"
+
+class IRCClient;
+
+// A membership as the client stores it: which channel, and the client's
+// index in that channel's member array
+struct IRCMembership
+{
+    quint32 channel;
+    quint32 slot;
+};
+
+// A membership as the channel stores it: which client, and the channel's
+// index in that client's membership list
+struct IRCMember
+{
+    IRCClient* client;
+    quint32 slot;
+};
+
+class IRCChannel
+{
+public:
+    IRCChannel(quint32 id, const IRCName& name);
+
+    quint32 id() const { return m_id; }
+    // Spelled as the channel's first member spelled it
+    const QString& name() const { return m_name.toString(); }
+    const QByteArray& encodedName() const { return m_name.utf8(); }
+    // Casemapped name, the same however the channel was spelled; history is
+    // kept under it
+    const QString& foldedName() const { return m_name.foldedString(); }
+    // Dense and unordered; removing a member moves the last one into its place
+    const QList<IRCMember>& members() const { return m_members; }
+    bool isEmpty() const { return m_members.isEmpty(); }
+
+private:
+    friend class IRCChannelRegistry;
+
+    quint32 m_id;
+    IRCName m_name;
+    QList<IRCMember> m_members;
+};
+
+// Owns every channel on the server. Each name is interned in strings and the
+// channel given a small ID that clients store instead of the name. Both sides
+// of a membership record the other side's index, so joining and parting are
+// O(1). Names match under IRC casemapping, like nicks.
+class IRCChannelRegistry
+{
+public:
+    explicit IRCChannelRegistry(IRCStringTable* strings);
+    ~IRCChannelRegistry();
+
+    // Lookups by name; the view overload does not allocate when the name is
+    // spelled as some interned string is
+    IRCChannel* find(QByteArrayView name) const;
+    IRCChannel* find(const QString& name) const;
+    IRCChannel* channel(quint32 id) const;
+    IRCChannel* findOrCreate(const QString& name);
+    qsizetype size() const { return m_index.size(); }
+
+    // Returns false if the client already is a member
+    bool join(IRCChannel* channel, IRCClient* client);
+    // Returns false if the client is not a member. A channel is deleted as
+    // soon as its last member leaves, so do not use it after this returns.
+    bool part(IRCChannel* channel, IRCClient* client);
+    // Parts every channel the client is in, O(channels of that client)
+    void partAll(IRCClient* client);
+
+    // Deletes all channels and empties their members' membership lists
+    void clear();
+
+private:
+    Q_DISABLE_COPY(IRCChannelRegistry)
+
+    void destroy(IRCChannel* channel);
+
+    IRCStringTable* m_strings;
+    QList<IRCChannel*> m_channels;              // Indexed by ID, null when free
+    QList<quint32> m_freeIds;
+    QHash<const IRCInternedString*, IRCChannel*> m_index;  // Keyed by IRCName::foldedKey()
+};
+
+#endif // IRCCHANNEL_H
@@ -1,91 +1,155 @@
 #include "ircclient.h"
-#include <QDebug>
-
-IRCClient::IRCClient(QTcpSocket* socket, QObject* parent)
-    : QObject(parent)
-    , m_socket(socket)
-    , m_registered(false)
-{
-    if (m_socket) {
-        m_socket->setParent(this);
-        
-        connect(m_socket, &QTcpSocket::readyRead, this, &IRCClient::onReadyRead);
-        connect(m_socket, &QTcpSocket::disconnected, this, &IRCClient::onDisconnected);
-    }
+#include "ircepoll.h"
+#include "ircmessage.h"
+#include "ircshard.h"
+
+IRCClient::IRCClient(IRCClientDetails* details, IRCConnection* connection, IRCShard* shard, IRCEpollConnection* epollConnection)
+    : m_connection(connection)
+    , m_shard(shard)
+    , m_epollConnection(epollConnection)
+    , m_fanoutMark(0)
+    , m_flags(0)
+    , m_capabilities(0)
+    , m_lastActivity(0)
+    , m_details(details)
+{
+    m_timer.data = this;
+    updatePrefix();
 }
 
 IRCClient::~IRCClient()
 {
-    if (m_socket && m_socket->state() == QTcpSocket::ConnectedState) {
-        m_socket->disconnectFromHost();
+    if (m_connection && !m_shard) {
+        delete m_connection;
     }
 }
 
-void IRCClient::joinChannel(const QString& channel)
+const void* IRCClient::connectionKey() const
 {
-    m_channels.insert(channel);
+    if (m_epollConnection) {
+        return m_epollConnection;
+    }
+    return m_connection;
 }
 
-void IRCClient::leaveChannel(const QString& channel)
+qsizetype IRCClient::membershipIndex(const IRCChannel* channel) const
 {
-    m_channels.remove(channel);
+    for (qsizetype i = 0; i < m_memberships.size(); ++i) {
+        if (m_memberships.at(i).channel == channel->id()) {
+            return i;
+        }
+    }
+    return -1;
 }
 
-bool IRCClient::isInChannel(const QString& channel) const
+void IRCClient::updatePrefix()
 {
-    return m_channels.contains(channel);
+    m_details->prefix = nick() + "!" + user() + "@" + hostAddress();
+    m_encodedPrefix = m_details->prefix.toUtf8();
 }
 
-void IRCClient::sendMessage(const QString& message)
+void IRCClient::sendLine(const QByteArray& line)
 {
-    if (m_socket && m_socket->state() == QTcpSocket::ConnectedState) {
-        QString msg = message + "\r\n";
-        m_socket->write(msg.toUtf8());
-        m_socket->flush();
+    if (m_epollConnection) {
+        m_epollConnection->owner->sendLine(m_epollConnection, line);
+        return;
+    }
+    // For bot clients (no connection), we don't need to send anything
+    if (!m_connection) {
+        return;
+    }
+    if (m_shard) {
+        m_shard->send(m_connection, line);
+    } else {
+        m_connection->sendLine(line);
     }
-    // For bot clients (no socket), we don't need to send anything
+}
+
+void IRCClient::sendMessage(const QString& message)
+{
+    sendLine(IRCMessage::format(message));
 }
 
 void IRCClient::sendMessage(const QString& prefix, const QString& command, const QString& params)
 {
-    QString message;
-    if (!prefix.isEmpty()) {
-        message = ":" + prefix + " ";
+    sendLine(IRCMessage::format(prefix, command, params));
+}
+
+qint64 IRCClient::sendQueueBytes() const
+{
+    if (m_epollConnection) {
+        return m_epollConnection->sendQueueBytes;
     }
-    message += command;
-    if (!params.isEmpty()) {
-        message += " " + params;
+    return m_connection ? m_connection->sendQueueBytes() : 0;
+}
+
+bool IRCClient::isLagging() const
+{
+    if (m_epollConnection) {
+        return m_epollConnection->lagging;
     }
-    sendMessage(message);
+    return m_connection && m_connection->isLagging();
 }
 
-void IRCClient::onReadyRead()
+void IRCClient::disconnectFromHost()
 {
-    QByteArray data = m_socket->readAll();
-    m_buffer.append(QString::fromUtf8(data));
-    
-    // Process complete lines
-    while (m_buffer.contains("\r\n") || m_buffer.contains("\n")) {
-        int pos = m_buffer.indexOf("\r\n");
-        if (pos == -1) {
-            pos = m_buffer.indexOf("\n");
-        }
-        
-        QString line = m_buffer.left(pos).trimmed();
-        
-        if (m_buffer.indexOf("\r\n") != -1) {
-            m_buffer.remove(0, pos + 2);
-        } else {
-            m_buffer.remove(0, pos + 1);
-        }
-        
-        if (!line.isEmpty()) {
-            emit messageReceived(line);
-        }
+    if (m_epollConnection) {
+        m_epollConnection->owner->disconnectFromHost(m_epollConnection);
+        return;
     }
+    if (!m_connection) {
+        return;
+    }
+    if (m_shard) {
+        m_shard->disconnectFromHost(m_connection);
+    } else {
+        m_connection->disconnectFromHost();
+    }
+}
+
+void IRCClient::abort()
+{
+    if (m_epollConnection) {
+        m_epollConnection->owner->abort(m_epollConnection);
+        return;
+    }
+    if (!m_connection) {
+        return;
+    }
+    if (m_shard) {
+        m_shard->abort(m_connection);
+    } else {
+        m_connection->abort();
+    }
+}
+
+qsizetype IRCClient::heapBytes() const
+{
+    return m_encodedPrefix.capacity() + m_details->prefix.capacity() * qsizetype(sizeof(QChar))
+        + m_memberships.capacity() * qsizetype(sizeof(IRCMembership));
 }
 
-void IRCClient::onDisconnected()
+IRCClient* IRCClientPool::create(IRCConnection* connection, IRCShard* shard, const IRCName& hostAddress)
 {
-    emit disconnected();
-} 
\ No newline at end of file
+    return create(connection, shard, nullptr, hostAddress);
+}
+
+IRCClient* IRCClientPool::create(IRCEpollConnection* connection, const IRCName& hostAddress)
+{
+    return create(nullptr, nullptr, connection, hostAddress);
+}
+
+IRCClient* IRCClientPool::create(IRCConnection* connection, IRCShard* shard, IRCEpollConnection* epollConnection, const IRCName& hostAddress)
+{
+    IRCClientDetails* details = m_details.create();
+    details->hostAddress = hostAddress;
+    return new (m_clients.allocate()) IRCClient(details, connection, shard, epollConnection);
+}
+
+void IRCClientPool::destroy(IRCClient* client)
+{
+    IRCClientDetails* details = client->m_details;
+    client->~IRCClient();
+    m_clients.deallocate(client);
+    m_details.destroy(details);
+}
@@ -1,57 +1,192 @@
 #ifndef IRCCLIENT_H
 #define IRCCLIENT_H
 
-#include <QObject>
-#include <QTcpSocket>
 #include <QString>
-#include <QSet>
-#include <QHostAddress>
+#include <QByteArray>
+#include <QList>
+#include "ircchannel.h"
+#include "ircconnection.h"
+#include "ircflood.h"
+#include "ircintern.h"
+#include "ircpool.h"
+#include "irctimerwheel.h"
 
-class IRCClient : public QObject
+class IRCShard;
+struct IRCEpollConnection;
+
+// The parts of a client only replies, WHO and logging read. They sit in a
+// record of their own so the hot one stays small.
+struct IRCClientDetails
 {
-    Q_OBJECT
+    IRCName user;
+    IRCName hostAddress;
+    QString prefix;
+};
 
+// A connected client, or a bot user. The record holds what the line, fan-out
+// and timer paths touch on every pass: the connection, packed state flags,
+// the encoded nick and prefix, memberships, flood and timeout state. Clients
+// are created and destroyed through IRCClientPool only.
+class IRCClient
+{
 public:
-    explicit IRCClient(QTcpSocket* socket, QObject* parent = nullptr);
-    ~IRCClient();
+    // IRCv3 capabilities a client can enable with CAP REQ
+    enum Capability {
+        ServerTime = 0x1,
+        Batch = 0x2,
+        ChatHistory = 0x4
+    };
 
-    // Getters
-    QString nick() const { return m_nick; }
-    QString user() const { return m_user; }
-    QString hostAddress() const { return m_socket ? m_socket->peerAddress().toString() : "bot.localhost"; }
-    bool isRegistered() const { return m_registered; }
-    QSet<QString> channels() const { return m_channels; }
-    QTcpSocket* socket() const { return m_socket; }
+    // Getters; names are interned in the server's string table
+    const QString& nick() const { return m_nick.toString(); }
+    const QByteArray& encodedNick() const { return m_nick.utf8(); }
+    const IRCName& nickName() const { return m_nick; }
+    // Nick up to casemapping, the key of the server's nick index
+    const IRCInternedString* nickKey() const { return m_nick.foldedKey(); }
+    const QString& user() const { return m_details->user.toString(); }
+    const QString& hostAddress() const { return m_details->hostAddress.toString(); }
+    // "nick!user@host", rebuilt only when the nick or user changes
+    const QString& prefix() const { return m_details->prefix; }
+    const QByteArray& encodedPrefix() const { return m_encodedPrefix; }
+    bool isRegistered() const { return m_flags & Registered; }
+    bool isOper() const { return m_flags & Oper; }
+    // Channels this client is in, maintained by IRCChannelRegistry
+    const QList<IRCMembership>& memberships() const { return m_memberships; }
+    IRCConnection* connection() const { return m_connection; }
+    IRCShard* shard() const { return m_shard; }
+    IRCEpollConnection* epollConnection() const { return m_epollConnection; }
+    // Identifies the connection whichever backend serves it, null for bots
+    const void* connectionKey() const;
 
     // Setters
-    void setNick(const QString& nick) { m_nick = nick; }
-    void setUser(const QString& user) { m_user = user; }
-    void setRegistered(bool registered) { m_registered = registered; }
+    void setNick(const IRCName& nick) { m_nick = nick; updatePrefix(); }
+    void setUser(const IRCName& user) { m_details->user = user; updatePrefix(); }
+    void setRegistered(bool registered) { setFlag(Registered, registered); }
+    void setOper(bool oper) { setFlag(Oper, oper); }
+
+    // Enabled capabilities, a combination of Capability values
+    uint capabilities() const { return m_capabilities; }
+    bool hasCapability(Capability capability) const { return m_capabilities & capability; }
+    void setCapabilities(uint capabilities) { m_capabilities = quint8(capabilities); }
+    // Registration is held back while the client negotiates, until CAP END
+    bool isNegotiatingCaps() const { return m_flags & NegotiatingCaps; }
+    void setNegotiatingCaps(bool negotiating) { setFlag(NegotiatingCaps, negotiating); }
+
+    // Scratch mark the server uses to reach each client once per fan-out
+    quint32 fanoutMark() const { return m_fanoutMark; }
+    void setFanoutMark(quint32 mark) { m_fanoutMark = mark; }
 
-    // Channel management
-    void joinChannel(const QString& channel);
-    void leaveChannel(const QString& channel);
-    bool isInChannel(const QString& channel) const;
+    bool isInChannel(const IRCChannel* channel) const { return membershipIndex(channel) >= 0; }
+
+    // Token bucket and held-back lines, managed by the server
+    IRCFloodControl& flood() { return m_flood; }
+
+    // Registration, keepalive and close timeouts, armed on the server's wheel
+    IRCTimer& timer() { return m_timer; }
+    // When the client last sent a line, in ms on the server's clock
+    qint64 lastActivity() const { return m_lastActivity; }
+    void setLastActivity(qint64 time) { m_lastActivity = time; setFlag(AwaitingPong, false); }
+    // A PING went out and nothing has come back since
+    bool isAwaitingPong() const { return m_flags & AwaitingPong; }
+    void setAwaitingPong(bool awaiting) { setFlag(AwaitingPong, awaiting); }
+    // The server has closed the link; what the client still sends is ignored
+    bool isClosing() const { return m_flags & Closing; }
+    void setClosing(bool closing) { setFlag(Closing, closing); }
+    // The server is done with the client and frees it on its next pass
+    bool isReleased() const { return m_flags & Released; }
+    void setReleased() { setFlag(Released, true); }
+
+    // Queue an already serialized line (see IRCMessage::format). The buffer is
+    // shared, not copied, so fan-out can hand the same line to every member.
+    void sendLine(const QByteArray& line);
 
     // Send message to client
     void sendMessage(const QString& message);
     void sendMessage(const QString& prefix, const QString& command, const QString& params = QString());
 
-signals:
-    void messageReceived(const QString& message);
-    void disconnected();
+    // Send queue state, see IRCConnection
+    qint64 sendQueueBytes() const;
+    bool isLagging() const;
+
+    // Connection control, safe to call from the server thread in either mode
+    void disconnectFromHost();
+    void abort();
+
+    // Heap held by the prefix and lists the client owns, on top of its pool
+    // records; interned names are counted with the string table
+    qsizetype heapBytes() const;
+
+private:
+    friend class IRCChannelRegistry;
+    friend class IRCClientPool;
+
+    enum Flag : quint8 {
+        Registered = 0x1,
+        Oper = 0x2,
+        NegotiatingCaps = 0x4,
+        AwaitingPong = 0x8,
+        Closing = 0x10,
+        Released = 0x20
+    };
+
+    // A client served on the server thread owns its connection. A client
+    // whose connection lives on a worker shard only refers to it, and all
+    // socket operations are posted to that shard. Bot users have neither.
+    IRCClient(IRCClientDetails* details, IRCConnection* connection, IRCShard* shard, IRCEpollConnection* epollConnection);
+    ~IRCClient();
+    Q_DISABLE_COPY(IRCClient)
+
+    void setFlag(Flag flag, bool on) { m_flags = quint8(on ? m_flags | flag : m_flags & ~flag); }
+    // Linear, clients are in few channels
+    qsizetype membershipIndex(const IRCChannel* channel) const;
+    void updatePrefix();
+
+    // Touched on every line and fan-out, kept together at the front
+    IRCConnection* m_connection;
+    IRCShard* m_shard;
+    IRCEpollConnection* m_epollConnection;
+    quint32 m_fanoutMark;
+    quint8 m_flags;             // Flag values
+    quint8 m_capabilities;      // Capability values
+    qint64 m_lastActivity;
+    IRCName m_nick;
+    QByteArray m_encodedPrefix;
+    QList<IRCMembership> m_memberships;
+    IRCFloodControl m_flood;
+    IRCTimer m_timer;
+    IRCClientDetails* m_details;
+};
+
+// Allocates clients and their details from two slab pools, so connecting or
+// dropping thousands of clients touches the heap a few times per slab rather
+// than several times per client. Used on the server thread only.
+class IRCClientPool
+{
+public:
+    IRCClientPool() = default;
+    Q_DISABLE_COPY(IRCClientPool)
+
+    // Served on the server thread or by a worker shard, see IRCClient
+    IRCClient* create(IRCConnection* connection, IRCShard* shard, const IRCName& hostAddress);
+    // Served by the epoll backend, which owns the connection
+    IRCClient* create(IRCEpollConnection* connection, const IRCName& hostAddress);
+    // Deletes an owned connection along with the client
+    void destroy(IRCClient* client);
 
-private slots:
-    void onReadyRead();
-    void onDisconnected();
+    qsizetype liveClients() const { return m_clients.liveRecords(); }
+    qsizetype slabCount() const { return m_clients.slabCount() + m_details.slabCount(); }
+    qsizetype reservedBytes() const { return m_clients.reservedBytes() + m_details.reservedBytes(); }
+    // Pool memory for one client, hot and cold records together
+    static constexpr qsizetype recordBytes()
+    {
+        return IRCSlabPool<IRCClient>::recordBytes() + IRCSlabPool<IRCClientDetails>::recordBytes();
+    }
 
 private:
-    QTcpSocket* m_socket;
-    QString m_nick;
-    QString m_user;
-    bool m_registered;
-    QSet<QString> m_channels;
-    QString m_buffer;
+    IRCClient* create(IRCConnection* connection, IRCShard* shard, IRCEpollConnection* epollConnection, const IRCName& hostAddress);
+
+    IRCSlabPool<IRCClient> m_clients;
+    IRCSlabPool<IRCClientDetails> m_details;
 };
 
-#endif // IRCCLIENT_H 
\ No newline at end of file
+#endif // IRCCLIENT_H
@@ -0,0 +1,243 @@
+#include "ircconnection.h"
+#include <QAbstractEventDispatcher>
+#include <QHostAddress>
+
+#ifdef Q_OS_LINUX
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <cerrno>
+#endif
+
+namespace {
+// Connections with queued output on this thread, flushed together once per pass
+thread_local QList<IRCConnection*> pendingFlush;
+
+#ifdef Q_OS_LINUX
+constexpr int MaxIovecs = 64;
+#endif
+}
+
+IRCConnection::IRCConnection(QTcpSocket* socket, QObject* parent)
+    : QObject(parent)
+    , m_socket(socket)
+    , m_sendQueueQueued(0)
+    , m_sendQueueLimit(DefaultSendQueueLimit)
+    , m_sendQueuePolicy(Disconnect)
+    , m_sendQueueDepth(0)
+    , m_droppedLines(0)
+    , m_lagging(false)
+    , m_flushScheduled(false)
+    , m_closing(false)
+{
+    m_socket->setParent(this);
+
+    connect(m_socket, &QTcpSocket::readyRead, this, &IRCConnection::onReadyRead);
+    connect(m_socket, &QTcpSocket::bytesWritten, this, &IRCConnection::onBytesWritten);
+    connect(m_socket, &QTcpSocket::disconnected, this, &IRCConnection::disconnected);
+}
+
+IRCConnection::~IRCConnection()
+{
+    if (m_flushScheduled) {
+        pendingFlush.removeOne(this);
+    }
+    if (m_socket->state() == QTcpSocket::ConnectedState) {
+        m_socket->disconnectFromHost();
+    }
+}
+
+QString IRCConnection::peerAddress() const
+{
+    return m_socket->peerAddress().toString();
+}
+
+void IRCConnection::sendLine(const QByteArray& line)
+{
+    if (m_closing || m_socket->state() != QTcpSocket::ConnectedState) {
+        return;
+    }
+
+    if (m_sendQueueLimit > 0) {
+        if (m_lagging.load(std::memory_order_relaxed)) {
+            m_droppedLines.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        if (m_sendQueueQueued + m_socket->bytesToWrite() + line.size() > m_sendQueueLimit) {
+            m_droppedLines.fetch_add(1, std::memory_order_relaxed);
+            if (m_sendQueuePolicy == DropLines) {
+                return;
+            }
+            if (m_sendQueuePolicy == MarkLagging) {
+                m_lagging.store(true, std::memory_order_relaxed);
+            } else {
+                // Release the backlog now; the server closes the link once
+                // it is safe to touch channel state again
+                m_closing = true;
+                m_sendQueue.clear();
+                m_sendQueueQueued = 0;
+                updateSendQueueDepth();
+            }
+            QMetaObject::invokeMethod(this, &IRCConnection::sendQueueExceeded, Qt::QueuedConnection);
+            return;
+        }
+    }
+
+    m_sendQueue.append(line);
+    m_sendQueueQueued += line.size();
+    updateSendQueueDepth();
+
+    if (!m_flushScheduled) {
+        m_flushScheduled = true;
+        if (pendingFlush.isEmpty()) {
+            QMetaObject::invokeMethod(QAbstractEventDispatcher::instance(), &IRCConnection::flushPendingConnections, Qt::QueuedConnection);
+        }
+        pendingFlush.append(this);
+    }
+}
+
+void IRCConnection::setSendQueueLimit(qint64 bytes, SendQueuePolicy policy)
+{
+    m_sendQueueLimit = bytes;
+    m_sendQueuePolicy = policy;
+}
+
+void IRCConnection::disconnectFromHost()
+{
+    m_socket->disconnectFromHost();
+}
+
+void IRCConnection::abort()
+{
+    m_closing = true;
+    m_socket->abort();
+}
+
+void IRCConnection::updateSendQueueDepth()
+{
+    m_sendQueueDepth.store(m_sendQueueQueued + m_socket->bytesToWrite(), std::memory_order_relaxed);
+}
+
+void IRCConnection::flushPendingConnections()
+{
+    QList<IRCConnection*> connections;
+    connections.swap(pendingFlush);
+    for (IRCConnection* connection : std::as_const(connections)) {
+        connection->flushSendQueue();
+    }
+}
+
+void IRCConnection::flushSendQueue()
+{
+    m_flushScheduled = false;
+    if (m_sendQueue.isEmpty()) {
+        return;
+    }
+
+    if (!m_closing && m_socket->state() == QTcpSocket::ConnectedState) {
+#ifdef Q_OS_LINUX
+        // With nothing buffered inside QTcpSocket we can write around it
+        // without reordering, sending the whole pass in one sendmsg()
+        if (m_socket->bytesToWrite() == 0) {
+            writeGathered();
+        }
+#endif
+        // Whatever the kernel did not take is left to QTcpSocket, which
+        // finishes it once the socket becomes writable again
+        for (const QByteArray& line : std::as_const(m_sendQueue)) {
+            m_socket->write(line);
+        }
+    }
+
+    m_sendQueue.clear();
+    m_sendQueueQueued = 0;
+    onBytesWritten();
+}
+
+qint64 IRCConnection::writeGathered()
+{
+#ifdef Q_OS_LINUX
+    const int fd = int(m_socket->socketDescriptor());
+    if (fd < 0) {
+        return 0;
+    }
+
+    qint64 total = 0;
+    qsizetype written = 0; // buffers fully handed to the kernel
+    while (written < m_sendQueue.size()) {
+        iovec iov[MaxIovecs];
+        int count = 0;
+        qint64 batchBytes = 0;
+        for (qsizetype i = written; i < m_sendQueue.size() && count < MaxIovecs; ++i, ++count) {
+            iov[count].iov_base = const_cast<char*>(m_sendQueue.at(i).constData());
+            iov[count].iov_len = size_t(m_sendQueue.at(i).size());
+            batchBytes += m_sendQueue.at(i).size();
+        }
+
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = size_t(count);
+        const ssize_t sent = ::sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            break;
+        }
+        total += sent;
+
+        qint64 remaining = sent;
+        while (remaining > 0) {
+            const qsizetype size = m_sendQueue.at(written).size();
+            if (remaining < size) {
+                m_sendQueue[written] = m_sendQueue.at(written).mid(remaining);
+                break;
+            }
+            remaining -= size;
+            ++written;
+        }
+
+        if (sent < batchBytes) {
+            break; // socket buffer is full
+        }
+    }
+
+    m_sendQueue.erase(m_sendQueue.begin(), m_sendQueue.begin() + written);
+    return total;
+#else
+    return 0;
+#endif
+}
+
+void IRCConnection::onReadyRead()
+{
+    // Read straight into the line buffer and hand out complete lines as views;
+    // nothing is decoded until a handler asks for the text.
+    while (m_socket->bytesAvailable() > 0) {
+        char* writePointer = m_readBuffer.writePointer();
+        qint64 bytesRead = m_socket->read(writePointer, m_readBuffer.writableBytes());
+        if (bytesRead <= 0) {
+            break;
+        }
+        m_readBuffer.commit(bytesRead);
+
+        QByteArrayView line;
+        IRCLineBuffer::Status status;
+        while ((status = m_readBuffer.nextLine(line)) != IRCLineBuffer::NeedMore) {
+            if (status == IRCLineBuffer::Overflow) {
+                emit lineTooLong();
+            } else if (!line.isEmpty()) {
+                emit lineReceived(line);
+            }
+        }
+    }
+}
+
+void IRCConnection::onBytesWritten()
+{
+    updateSendQueueDepth();
+
+    // Lagging clients start receiving again once they have drained below half the limit
+    if (m_lagging.load(std::memory_order_relaxed) && sendQueueBytes() <= m_sendQueueLimit / 2) {
+        m_lagging.store(false, std::memory_order_relaxed);
+    }
+}
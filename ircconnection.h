@@ -0,0 +1,81 @@
+#ifndef IRCCONNECTION_H
+#define IRCCONNECTION_H
+
+#include <QObject>
+#include <QTcpSocket>
+#include <QByteArray>
+#include <QList>
+#include <atomic>
+#include "irclinebuffer.h"
+
+// Socket side of a client: line framing on the way in, the send queue on the
+// way out. A connection lives in the thread that serves its socket, which is
+// either the server thread or one of its worker shards. The counters exposed
+// here may be read from any thread.
+class IRCConnection : public QObject
+{
+    Q_OBJECT
+
+public:
+    // What happens to a client whose send queue passes the high-water mark
+    enum SendQueuePolicy {
+        DropLines,      // discard lines that do not fit
+        MarkLagging,    // discard lines until the queue drains below half the limit
+        Disconnect      // close the connection with "SendQ exceeded"
+    };
+
+    static constexpr qint64 DefaultSendQueueLimit = 1024 * 1024;
+
+    explicit IRCConnection(QTcpSocket* socket, QObject* parent = nullptr);
+    ~IRCConnection();
+
+    QTcpSocket* socket() const { return m_socket; }
+    QString peerAddress() const;
+
+    // Queue an already serialized line (see IRCMessage::format). Everything
+    // queued during one event loop pass is written out together.
+    void sendLine(const QByteArray& line);
+
+    void setSendQueueLimit(qint64 bytes, SendQueuePolicy policy);
+    qint64 sendQueueLimit() const { return m_sendQueueLimit; }
+    SendQueuePolicy sendQueuePolicy() const { return m_sendQueuePolicy; }
+    // Bytes queued here plus bytes still pending in the socket
+    qint64 sendQueueBytes() const { return m_sendQueueDepth.load(std::memory_order_relaxed); }
+    quint64 droppedLines() const { return m_droppedLines.load(std::memory_order_relaxed); }
+    bool isLagging() const { return m_lagging.load(std::memory_order_relaxed); }
+
+    void disconnectFromHost();
+    void abort();
+
+signals:
+    // The view points into the receive buffer and is only valid during the emission
+    void lineReceived(QByteArrayView line);
+    void lineTooLong();
+    void sendQueueExceeded();
+    void disconnected();
+
+private slots:
+    void onReadyRead();
+    void onBytesWritten();
+
+private:
+    void flushSendQueue();
+    qint64 writeGathered();
+    void updateSendQueueDepth();
+    static void flushPendingConnections();
+
+    QTcpSocket* m_socket;
+    IRCLineBuffer m_readBuffer;
+
+    QList<QByteArray> m_sendQueue;
+    qint64 m_sendQueueQueued;
+    qint64 m_sendQueueLimit;
+    SendQueuePolicy m_sendQueuePolicy;
+    std::atomic<qint64> m_sendQueueDepth;
+    std::atomic<quint64> m_droppedLines;
+    std::atomic<bool> m_lagging;
+    bool m_flushScheduled;
+    bool m_closing;
+};
+
+#endif // IRCCONNECTION_H
@@ -0,0 +1,63 @@
+#include "ircdedup.h"
+
+IRCDedupCache::IRCDedupCache(int capacity, qint64 window)
+    : m_capacity(qMax(1, capacity))
+    , m_window(window)
+{
+}
+
+quint64 IRCDedupCache::key(const QString& channel, const QString& nick, qint64 time, const QString& text)
+{
+    // Two independently seeded hashes make a 64-bit key on every platform
+    size_t low = qHashMulti(0, channel, nick, time, text);
+    size_t high = qHashMulti(0x9e3779b9, text, time, nick, channel);
+    return (quint64(high) << 32) ^ quint64(low);
+}
+
+bool IRCDedupCache::insert(quint64 key, qint64 now)
+{
+    expire(now);
+
+    auto it = m_entries.find(key);
+    if (it != m_entries.end()) {
+        ++it->count;
+        return false;
+    }
+
+    m_entries.insert(key, Entry{now, 1});
+    m_order.enqueue(qMakePair(key, now));
+    if (m_order.size() > m_capacity) {
+        QPair<quint64, qint64> oldest = m_order.dequeue();
+        m_entries.remove(oldest.first);
+    }
+    return true;
+}
+
+bool IRCDedupCache::take(quint64 key, qint64 now, qint64* recorded)
+{
+    expire(now);
+
+    auto it = m_entries.find(key);
+    if (it == m_entries.end() || it->count == 0) {
+        return false;
+    }
+    // The entry stays until it expires so m_order keeps matching it
+    --it->count;
+    if (recorded) {
+        *recorded = it->time;
+    }
+    return true;
+}
+
+bool IRCDedupCache::contains(quint64 key, qint64 now)
+{
+    expire(now);
+    return m_entries.contains(key);
+}
+
+void IRCDedupCache::expire(qint64 now)
+{
+    while (!m_order.isEmpty() && now - m_order.head().second > m_window) {
+        m_entries.remove(m_order.dequeue().first);
+    }
+}
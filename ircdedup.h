@@ -0,0 +1,52 @@
+#ifndef IRCDEDUP_H
+#define IRCDEDUP_H
+
+#include <QHash>
+#include <QQueue>
+#include <QString>
+
+// Remembers recently seen messages by a 64-bit content hash, so the bridge
+// can drop echoes and replays before they are fanned out. Entries expire
+// after a time window, and the oldest go first once the cache is full.
+class IRCDedupCache
+{
+public:
+    static constexpr int DefaultCapacity = 4096;
+    static constexpr qint64 DefaultWindow = 10 * 60 * 1000;    // ms
+
+    explicit IRCDedupCache(int capacity = DefaultCapacity, qint64 window = DefaultWindow);
+
+    // Hash of the fields that identify a message; time is 0 where the
+    // original time is not known, e.g. for lines we sent ourselves
+    static quint64 key(const QString& channel, const QString& nick, qint64 time, const QString& text);
+
+    // Records key at now. Returns false if it was already seen within the
+    // window, in which case the message is a duplicate.
+    bool insert(quint64 key, qint64 now);
+
+    // Consumes one record of key, e.g. once per echo of a line sent once.
+    // Returns false if there is none within the window. recorded, if given,
+    // is set to when the key was first recorded.
+    bool take(quint64 key, qint64 now, qint64* recorded = nullptr);
+
+    // Whether key was recorded within the window, without consuming it
+    bool contains(quint64 key, qint64 now);
+
+    int size() const { return m_entries.size(); }
+
+private:
+    struct Entry
+    {
+        qint64 time;    // When first recorded
+        int count;      // Records not yet taken
+    };
+
+    void expire(qint64 now);
+
+    QHash<quint64, Entry> m_entries;
+    QQueue<QPair<quint64, qint64>> m_order;    // Keys in the order recorded
+    int m_capacity;
+    qint64 m_window;
+};
+
+#endif // IRCDEDUP_H
@@ -0,0 +1,629 @@
+#include "ircepoll.h"
+#include <QDebug>
+#include <QSocketNotifier>
+#include <QTimer>
+
+#ifdef Q_OS_LINUX
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+namespace {
+constexpr int MaxEventsPerWait = 256;
+// Bound the work done per event loop pass so timers and queued calls run
+constexpr int MaxWaitsPerPass = 16;
+constexpr int MaxAcceptsPerPass = 256;
+// Bytes read from one connection before the others get a turn
+constexpr qint64 MaxReadPerPass = 64 * 1024;
+constexpr int MaxIovecs = 64;
+// How long the listener is left alone when connections cannot be accepted,
+// and how often that is logged at most
+constexpr int AcceptPauseMs = 500;
+constexpr qint64 AcceptWarningIntervalMs = 10000;
+
+QString errnoString()
+{
+    return QString::fromLocal8Bit(std::strerror(errno));
+}
+}
+
+IRCEpollServer::IRCEpollServer(IRCEpollSink* sink, QObject* parent)
+    : QObject(parent)
+    , m_sink(sink)
+    , m_epollFd(-1)
+    , m_listenFd(-1)
+    , m_notifier(nullptr)
+    , m_reserveFd(-1)
+    , m_acceptPaused(false)
+    , m_acceptFailures(0)
+    , m_sendQueueLimit(IRCConnection::DefaultSendQueueLimit)
+    , m_sendQueuePolicy(IRCConnection::Disconnect)
+    , m_flushScheduled(false)
+    , m_deferredScheduled(false)
+{
+}
+
+IRCEpollServer::~IRCEpollServer()
+{
+    close();
+}
+
+bool IRCEpollServer::isSupported()
+{
+    return true;
+}
+
+bool IRCEpollServer::listen(const QHostAddress& address, quint16 port)
+{
+    close();
+
+    // Any listens dual-stack on IPv6, falling back to IPv4 where there is none
+    sockaddr_storage storage = {};
+    socklen_t length = 0;
+    bool ipv4 = address.protocol() == QAbstractSocket::IPv4Protocol;
+    if (!ipv4) {
+        m_listenFd = ::socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_listenFd < 0 && errno == EAFNOSUPPORT && address == QHostAddress::Any) {
+            ipv4 = true;
+        }
+    }
+    if (ipv4) {
+        m_listenFd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        sockaddr_in* in = reinterpret_cast<sockaddr_in*>(&storage);
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        in->sin_addr.s_addr = htonl(address == QHostAddress::Any ? INADDR_ANY : address.toIPv4Address());
+        length = sizeof(sockaddr_in);
+    } else {
+        sockaddr_in6* in6 = reinterpret_cast<sockaddr_in6*>(&storage);
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        Q_IPV6ADDR bytes = address.toIPv6Address();
+        std::memcpy(&in6->sin6_addr, &bytes, sizeof(bytes));
+        length = sizeof(sockaddr_in6);
+    }
+    if (m_listenFd < 0) {
+        m_errorString = errnoString();
+        return false;
+    }
+
+    int on = 1;
+    int off = 0;
+    ::setsockopt(m_listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (!ipv4 && address == QHostAddress::Any) {
+        ::setsockopt(m_listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    }
+    if (::bind(m_listenFd, reinterpret_cast<sockaddr*>(&storage), length) < 0 || ::listen(m_listenFd, SOMAXCONN) < 0) {
+        m_errorString = errnoString();
+        close();
+        return false;
+    }
+
+    // The listener stays level-triggered, so a pass that stops accepting
+    // early is picked up again on the next one
+    m_epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (m_epollFd < 0 || ::epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_listenFd, &event) < 0) {
+        m_errorString = errnoString();
+        close();
+        return false;
+    }
+
+    m_notifier = new QSocketNotifier(m_epollFd, QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &IRCEpollServer::processEvents);
+    
+    // Given up when out of descriptors, to accept and drop a connection
+    m_reserveFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return true;
+}
+
+void IRCEpollServer::close()
+{
+    delete m_notifier;
+    m_notifier = nullptr;
+
+    for (IRCEpollConnection* connection : std::as_const(m_connections)) {
+        if (connection->fd >= 0) {
+            ::close(connection->fd);
+        }
+        m_connectionPool.destroy(connection);
+    }
+    m_connections.clear();
+    m_pendingFlush.clear();
+    m_pendingRead.clear();
+    m_pendingDisconnects.clear();
+    m_pendingExceeded.clear();
+    m_released.clear();
+
+    if (m_listenFd >= 0) {
+        ::close(m_listenFd);
+        m_listenFd = -1;
+    }
+    if (m_reserveFd >= 0) {
+        ::close(m_reserveFd);
+        m_reserveFd = -1;
+    }
+    m_acceptPaused = false;
+    m_acceptFailures = 0;
+    if (m_epollFd >= 0) {
+        ::close(m_epollFd);
+        m_epollFd = -1;
+    }
+}
+
+void IRCEpollServer::setSendQueueLimit(qint64 bytes, IRCConnection::SendQueuePolicy policy)
+{
+    m_sendQueueLimit = bytes;
+    m_sendQueuePolicy = policy;
+}
+
+qint64 IRCEpollServer::memoryBytes() const
+{
+    qint64 bytes = m_connectionPool.reservedBytes();
+    for (const IRCEpollConnection* connection : m_connections) {
+        bytes += connection->readBuffer.allocatedBytes() + connection->sendQueueBytes;
+    }
+    return bytes;
+}
+
+void IRCEpollServer::processEvents()
+{
+    // Connections cut short on the last pass go first
+    QList<IRCEpollConnection*> resumed;
+    resumed.swap(m_pendingRead);
+    for (IRCEpollConnection* connection : std::as_const(resumed)) {
+        connection->readPending = false;
+        if (!connection->closed) {
+            readConnection(connection);
+        }
+    }
+
+    epoll_event events[MaxEventsPerWait];
+    for (int wait = 0; wait < MaxWaitsPerPass; ++wait) {
+        const int count = ::epoll_wait(m_epollFd, events, MaxEventsPerWait, 0);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        for (int i = 0; i < count; ++i) {
+            IRCEpollConnection* connection = static_cast<IRCEpollConnection*>(events[i].data.ptr);
+            if (!connection) {
+                acceptConnections();
+                continue;
+            }
+            // Closed earlier in this batch; it is not deleted before the next pass
+            if (connection->closed) {
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                readConnection(connection);
+            }
+            if (!connection->closed && (events[i].events & EPOLLOUT)) {
+                connection->writable = true;
+                writeConnection(connection);
+            }
+        }
+        if (count < MaxEventsPerWait) {
+            break;
+        }
+    }
+}
+
+void IRCEpollServer::acceptConnections()
+{
+    for (int accepted = 0; accepted < MaxAcceptsPerPass; ++accepted) {
+        sockaddr_storage storage;
+        socklen_t length = sizeof(storage);
+        const int fd = ::accept4(m_listenFd, reinterpret_cast<sockaddr*>(&storage), &length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            // The connection stays in the backlog and the level-triggered
+            // listener would report it on every pass. Out of descriptors,
+            // refuse it with the reserve one; otherwise, or without a
+            // reserve, stop watching the listener for a while.
+            const int error = errno;
+            acceptFailed(error);
+            if ((error == EMFILE || error == ENFILE) && dropConnection()) {
+                continue;
+            }
+            pauseAccepting();
+            return;
+        }
+
+        IRCEpollConnection* connection = m_connectionPool.create(this, fd);
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = connection;
+        if (::epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            qWarning() << "IRCEpollServer: cannot watch accepted socket:" << errnoString();
+            ::close(fd);
+            m_connectionPool.destroy(connection);
+            continue;
+        }
+        connection->index = m_connections.size();
+        m_connections.append(connection);
+
+        // Report IPv4 peers on a dual-stack listener as plain IPv4, as QTcpSocket does
+        QHostAddress peer(reinterpret_cast<sockaddr*>(&storage));
+        bool mapped = false;
+        quint32 ipv4 = peer.toIPv4Address(&mapped);
+        if (mapped) {
+            peer = QHostAddress(ipv4);
+        }
+        m_sink->epollConnected(connection, peer.toString());
+    }
+}
+
+bool IRCEpollServer::dropConnection()
+{
+    if (m_reserveFd < 0) {
+        return false;
+    }
+    ::close(m_reserveFd);
+    const int fd = ::accept4(m_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+    const bool drained = fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    m_reserveFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return fd >= 0 || drained;
+}
+
+void IRCEpollServer::pauseAccepting()
+{
+    epoll_event event = {};
+    event.data.ptr = nullptr;
+    if (::epoll_ctl(m_epollFd, EPOLL_CTL_MOD, m_listenFd, &event) < 0) {
+        return;
+    }
+    m_acceptPaused = true;
+    QTimer::singleShot(AcceptPauseMs, this, [this]() {
+        // close() clears the flag, so a listener opened since is left alone
+        if (!m_acceptPaused) {
+            return;
+        }
+        m_acceptPaused = false;
+        if (m_reserveFd < 0) {
+            m_reserveFd = ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+        }
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        ::epoll_ctl(m_epollFd, EPOLL_CTL_MOD, m_listenFd, &event);
+    });
+}
+
+void IRCEpollServer::acceptFailed(int error)
+{
+    // A full descriptor table fails every accept, so only the first failure
+    // in each interval is logged, with a count of the rest
+    ++m_acceptFailures;
+    if (m_acceptWarning.isValid() && m_acceptWarning.elapsed() < AcceptWarningIntervalMs) {
+        return;
+    }
+    qWarning() << "IRCEpollServer: accept failed:" << QString::fromLocal8Bit(std::strerror(error))
+               << "(" << m_acceptFailures << "failures since the last report, refused or deferred)";
+    m_acceptFailures = 0;
+    m_acceptWarning.start();
+}
+
+void IRCEpollServer::readConnection(IRCEpollConnection* connection)
+{
+    // Edge-triggered: read until the kernel has nothing left, or until this
+    // connection has had its share of the pass
+    qint64 budget = MaxReadPerPass;
+    IRCLineBuffer& buffer = connection->readBuffer;
+    while (!connection->closed) {
+        // writePointer() makes the room that writableBytes() reports, so it
+        // has to run first
+        char* writePointer = buffer.writePointer();
+        const ssize_t bytes = ::read(connection->fd, writePointer, size_t(buffer.writableBytes()));
+        if (bytes < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (bytes <= 0) {
+            closeConnection(connection, false);
+            return;
+        }
+        buffer.commit(bytes);
+
+        // The server may close the connection from any of these calls
+        QByteArrayView line;
+        IRCLineBuffer::Status status;
+        while (!connection->closed && (status = buffer.nextLine(line)) != IRCLineBuffer::NeedMore) {
+            if (status == IRCLineBuffer::Overflow) {
+                m_sink->epollLineTooLong(connection);
+            } else if (!line.isEmpty()) {
+                m_sink->epollLineReceived(connection, line);
+            }
+        }
+
+        budget -= bytes;
+        if (budget <= 0 && !connection->closed) {
+            // No new edge will come for what is still unread
+            if (!connection->readPending) {
+                connection->readPending = true;
+                if (m_pendingRead.isEmpty()) {
+                    QMetaObject::invokeMethod(this, &IRCEpollServer::processEvents, Qt::QueuedConnection);
+                }
+                m_pendingRead.append(connection);
+            }
+            return;
+        }
+    }
+
+    if (!connection->closed) {
+        buffer.squeeze();
+    }
+}
+
+void IRCEpollServer::sendLine(IRCEpollConnection* connection, const QByteArray& line)
+{
+    if (connection->closed || connection->closing) {
+        return;
+    }
+
+    if (m_sendQueueLimit > 0) {
+        if (connection->lagging) {
+            return;
+        }
+        if (connection->sendQueueBytes + line.size() > m_sendQueueLimit) {
+            if (m_sendQueuePolicy == IRCConnection::DropLines) {
+                return;
+            }
+            if (m_sendQueuePolicy == IRCConnection::MarkLagging) {
+                connection->lagging = true;
+            } else {
+                // Release the backlog now; the server closes the link
+                connection->closing = true;
+                connection->sendQueue.clear();
+                connection->sendOffset = 0;
+                connection->sendQueueBytes = 0;
+            }
+            m_pendingExceeded.append(connection);
+            scheduleDeferred();
+            return;
+        }
+    }
+
+    connection->sendQueue.append(line);
+    connection->sendQueueBytes += line.size();
+
+    // Everything queued during one pass goes out together
+    if (!connection->flushScheduled) {
+        connection->flushScheduled = true;
+        m_pendingFlush.append(connection);
+        if (!m_flushScheduled) {
+            m_flushScheduled = true;
+            QMetaObject::invokeMethod(this, &IRCEpollServer::flushPending, Qt::QueuedConnection);
+        }
+    }
+}
+
+void IRCEpollServer::flushPending()
+{
+    m_flushScheduled = false;
+    QList<IRCEpollConnection*> connections;
+    connections.swap(m_pendingFlush);
+    for (IRCEpollConnection* connection : std::as_const(connections)) {
+        connection->flushScheduled = false;
+        if (!connection->closed && connection->writable) {
+            writeConnection(connection);
+        }
+    }
+}
+
+void IRCEpollServer::writeConnection(IRCEpollConnection* connection)
+{
+    QList<QByteArray>& queue = connection->sendQueue;
+    while (!queue.isEmpty() && connection->writable) {
+        iovec iov[MaxIovecs];
+        int count = 0;
+        for (qsizetype i = 0; i < queue.size() && count < MaxIovecs; ++i, ++count) {
+            const qsizetype offset = i == 0 ? connection->sendOffset : 0;
+            iov[count].iov_base = const_cast<char*>(queue.at(i).constData()) + offset;
+            iov[count].iov_len = size_t(queue.at(i).size() - offset);
+        }
+
+        msghdr message = {};
+        message.msg_iov = iov;
+        message.msg_iovlen = size_t(count);
+        const ssize_t sent = ::sendmsg(connection->fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                connection->writable = false;
+                break;
+            }
+            closeConnection(connection, false);
+            return;
+        }
+
+        connection->sendQueueBytes -= sent;
+        qint64 remaining = sent;
+        qsizetype written = 0;
+        while (remaining > 0) {
+            const qsizetype left = queue.at(written).size() - connection->sendOffset;
+            if (remaining < left) {
+                connection->sendOffset += remaining;
+                break;
+            }
+            remaining -= left;
+            connection->sendOffset = 0;
+            ++written;
+        }
+        queue.erase(queue.begin(), queue.begin() + written);
+    }
+
+    // Lagging clients start receiving again once they have drained below half the limit
+    if (connection->lagging && connection->sendQueueBytes <= m_sendQueueLimit / 2) {
+        connection->lagging = false;
+    }
+    if (queue.isEmpty() && connection->closing) {
+        closeConnection(connection, false);
+    }
+}
+
+void IRCEpollServer::disconnectFromHost(IRCEpollConnection* connection)
+{
+    if (connection->closed) {
+        return;
+    }
+    // Like QTcpSocket, write out what is queued first
+    connection->closing = true;
+    if (connection->sendQueue.isEmpty()) {
+        closeConnection(connection, false);
+    }
+}
+
+void IRCEpollServer::abort(IRCEpollConnection* connection)
+{
+    closeConnection(connection, true);
+}
+
+void IRCEpollServer::closeConnection(IRCEpollConnection* connection, bool reset)
+{
+    if (connection->closed) {
+        return;
+    }
+    if (reset) {
+        linger option = {1, 0};
+        ::setsockopt(connection->fd, SOL_SOCKET, SO_LINGER, &option, sizeof(option));
+    }
+    // Closing the only descriptor also takes it out of the epoll set
+    ::close(connection->fd);
+    connection->fd = -1;
+    connection->closed = true;
+    connection->sendQueue.clear();
+    connection->sendOffset = 0;
+    connection->sendQueueBytes = 0;
+    // The receive buffer may still back a line being handled; it goes when
+    // the connection is deleted
+
+    m_pendingDisconnects.append(connection);
+    scheduleDeferred();
+}
+
+void IRCEpollServer::release(IRCEpollConnection* connection)
+{
+    if (!connection->closed) {
+        ::close(connection->fd);
+        connection->fd = -1;
+        connection->closed = true;
+    }
+    connection->released = true;
+    m_released.append(connection);
+    scheduleDeferred();
+}
+
+void IRCEpollServer::scheduleDeferred()
+{
+    if (!m_deferredScheduled) {
+        m_deferredScheduled = true;
+        QMetaObject::invokeMethod(this, &IRCEpollServer::processDeferred, Qt::QueuedConnection);
+    }
+}
+
+void IRCEpollServer::processDeferred()
+{
+    m_deferredScheduled = false;
+
+    QList<IRCEpollConnection*> exceeded;
+    exceeded.swap(m_pendingExceeded);
+    for (IRCEpollConnection* connection : std::as_const(exceeded)) {
+        if (!connection->released) {
+            m_sink->epollSendQueueExceeded(connection);
+        }
+    }
+
+    QList<IRCEpollConnection*> disconnects;
+    disconnects.swap(m_pendingDisconnects);
+    for (IRCEpollConnection* connection : std::as_const(disconnects)) {
+        if (!connection->released) {
+            m_sink->epollDisconnected(connection);
+        }
+    }
+
+    // Released ones are closed, so nothing queues them again
+    QList<IRCEpollConnection*> released;
+    released.swap(m_released);
+    for (IRCEpollConnection* connection : std::as_const(released)) {
+        if (connection->flushScheduled) {
+            m_pendingFlush.removeOne(connection);
+        }
+        if (connection->readPending) {
+            m_pendingRead.removeOne(connection);
+        }
+        IRCEpollConnection* last = m_connections.takeLast();
+        if (last != connection) {
+            last->index = connection->index;
+            m_connections[connection->index] = last;
+        }
+        m_connectionPool.destroy(connection);
+    }
+}
+
+#else
+
+IRCEpollServer::IRCEpollServer(IRCEpollSink* sink, QObject* parent)
+    : QObject(parent)
+    , m_sink(sink)
+    , m_epollFd(-1)
+    , m_listenFd(-1)
+    , m_notifier(nullptr)
+    , m_reserveFd(-1)
+    , m_acceptPaused(false)
+    , m_acceptFailures(0)
+    , m_sendQueueLimit(IRCConnection::DefaultSendQueueLimit)
+    , m_sendQueuePolicy(IRCConnection::Disconnect)
+    , m_flushScheduled(false)
+    , m_deferredScheduled(false)
+{
+}
+
+IRCEpollServer::~IRCEpollServer()
+{
+}
+
+bool IRCEpollServer::isSupported()
+{
+    return false;
+}
+
+bool IRCEpollServer::listen(const QHostAddress& address, quint16 port)
+{
+    Q_UNUSED(address)
+    Q_UNUSED(port)
+    m_errorString = "epoll is only available on Linux";
+    return false;
+}
+
+void IRCEpollServer::close() {}
+void IRCEpollServer::setSendQueueLimit(qint64 bytes, IRCConnection::SendQueuePolicy policy) { m_sendQueueLimit = bytes; m_sendQueuePolicy = policy; }
+qint64 IRCEpollServer::memoryBytes() const { return 0; }
+void IRCEpollServer::sendLine(IRCEpollConnection*, const QByteArray&) {}
+void IRCEpollServer::disconnectFromHost(IRCEpollConnection*) {}
+void IRCEpollServer::abort(IRCEpollConnection*) {}
+void IRCEpollServer::release(IRCEpollConnection*) {}
+void IRCEpollServer::processEvents() {}
+void IRCEpollServer::flushPending() {}
+void IRCEpollServer::processDeferred() {}
+
+#endif
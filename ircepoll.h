@@ -0,0 +1,133 @@
+#ifndef IRCEPOLL_H
+#define IRCEPOLL_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHostAddress>
+#include <QList>
+#include "ircconnection.h"
+#include "irclinebuffer.h"
+#include "ircpool.h"
+
+class IRCClient;
+class IRCEpollServer;
+class QSocketNotifier;
+
+// A client socket served by IRCEpollServer: a non-blocking descriptor and the
+// two buffers in front of it, with no QObject or QTcpSocket. An idle
+// connection holds no buffer memory at all; the receive buffer is freed
+// whenever it has been drained, and the send queue is empty.
+struct IRCEpollConnection
+{
+    explicit IRCEpollConnection(IRCEpollServer* owner, int fd)
+        : owner(owner)
+        , fd(fd)
+    {
+    }
+
+    IRCEpollServer* owner;
+    IRCClient* client = nullptr;    // Set by the server on connect
+    int fd;                         // -1 once closed
+    qsizetype index = -1;           // Position in the owner's connection list
+    IRCLineBuffer readBuffer;
+    QList<QByteArray> sendQueue;
+    qsizetype sendOffset = 0;       // Bytes of the first queued line already written
+    qint64 sendQueueBytes = 0;
+    bool writable = true;           // Edge-triggered: false until EPOLLOUT after EAGAIN
+    bool flushScheduled = false;
+    bool readPending = false;       // Stopped reading before EAGAIN to let others in
+    bool lagging = false;
+    bool closing = false;           // Close once the send queue has drained
+    bool closed = false;            // Descriptor closed, disconnect reported or pending
+    bool released = false;          // The server forgot it, delete on the next pass
+};
+
+// What IRCEpollServer reports, on the thread it runs on. A connection stays
+// valid until it has been reported disconnected and then released.
+class IRCEpollSink
+{
+public:
+    virtual ~IRCEpollSink() {}
+    virtual void epollConnected(IRCEpollConnection* connection, const QString& peerAddress) = 0;
+    // The view points into the receive buffer and is only valid during the call
+    virtual void epollLineReceived(IRCEpollConnection* connection, QByteArrayView line) = 0;
+    virtual void epollLineTooLong(IRCEpollConnection* connection) = 0;
+    virtual void epollSendQueueExceeded(IRCEpollConnection* connection) = 0;
+    virtual void epollDisconnected(IRCEpollConnection* connection) = 0;
+};
+
+// Linux connection backend: accepts and serves client sockets directly on an
+// edge-triggered epoll set, read into IRCLineBuffer and written with
+// sendmsg() from the send queue. The whole set is watched by one socket
+// notifier on the epoll descriptor, so the event loop sees a single source
+// however many connections there are. Send queue limits and policies behave
+// as in IRCConnection. Not available on other platforms; see isSupported().
+class IRCEpollServer : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit IRCEpollServer(IRCEpollSink* sink, QObject* parent = nullptr);
+    ~IRCEpollServer();
+
+    static bool isSupported();
+
+    bool listen(const QHostAddress& address, quint16 port);
+    QString errorString() const { return m_errorString; }
+    // Closes the listener and every connection without reporting them
+    void close();
+
+    void setSendQueueLimit(qint64 bytes, IRCConnection::SendQueuePolicy policy);
+    qsizetype connectionCount() const { return m_connections.size(); }
+    // Connection records, receive buffers and queued output
+    qint64 memoryBytes() const;
+
+    // Connection operations, mirroring IRCConnection
+    void sendLine(IRCEpollConnection* connection, const QByteArray& line);
+    void disconnectFromHost(IRCEpollConnection* connection);
+    void abort(IRCEpollConnection* connection);
+    // The server is done with connection; it is deleted on the next pass
+    void release(IRCEpollConnection* connection);
+
+private slots:
+    void processEvents();
+    void flushPending();
+    void processDeferred();
+
+private:
+    void acceptConnections();
+    bool dropConnection();
+    void pauseAccepting();
+    void acceptFailed(int error);
+    void readConnection(IRCEpollConnection* connection);
+    void writeConnection(IRCEpollConnection* connection);
+    void closeConnection(IRCEpollConnection* connection, bool reset);
+    void scheduleDeferred();
+
+    IRCEpollSink* m_sink;
+    int m_epollFd;
+    int m_listenFd;
+    QSocketNotifier* m_notifier;
+    int m_reserveFd;            // Spare descriptor for refusing connections when out of them
+    bool m_acceptPaused;
+    int m_acceptFailures;       // Since the last warning
+    QElapsedTimer m_acceptWarning;
+    QString m_errorString;
+    qint64 m_sendQueueLimit;
+    IRCConnection::SendQueuePolicy m_sendQueuePolicy;
+
+    IRCSlabPool<IRCEpollConnection> m_connectionPool;
+    QList<IRCEpollConnection*> m_connections;   // Every connection not yet deleted, unordered
+    QList<IRCEpollConnection*> m_pendingFlush;
+    QList<IRCEpollConnection*> m_pendingRead;
+    // Reported from processDeferred, so nothing is reported re-entrantly
+    // from inside a server call
+    QList<IRCEpollConnection*> m_pendingDisconnects;
+    QList<IRCEpollConnection*> m_pendingExceeded;
+    QList<IRCEpollConnection*> m_released;
+    bool m_flushScheduled;
+    bool m_deferredScheduled;
+};
+
+#endif // IRCEPOLL_H
@@ -0,0 +1,33 @@
+#include "ircflood.h"
+
+bool IRCFloodControl::take(const IRCFloodLimits& limits, qint64 cost, qint64 now)
+{
+    if (!limits.isEnabled()) {
+        return true;
+    }
+
+    const qint64 capacity = qint64(limits.burst) * Unit;
+    if (m_refilled < 0) {
+        m_tokens = capacity;
+        m_refilled = now;
+    } else if (now > m_refilled) {
+        // rate tokens per second is rate thousandths per ms
+        m_tokens = qMin(capacity, m_tokens + (now - m_refilled) * limits.rate);
+        m_refilled = now;
+    }
+
+    if (m_tokens < qMin(cost, capacity)) {
+        return false;
+    }
+    m_tokens -= cost;
+    return true;
+}
+
+bool IRCFloodControl::hold(QByteArrayView line, int limit)
+{
+    if (m_held.size() >= limit) {
+        return false;
+    }
+    m_held.enqueue(line.toByteArray());
+    return true;
+}
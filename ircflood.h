@@ -0,0 +1,49 @@
+#ifndef IRCFLOOD_H
+#define IRCFLOOD_H
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QQueue>
+
+// Flood limits applied to every client. Each command costs tokens (see
+// IRCServer::commandCost); a client may spend up to burst tokens at once and
+// regains rate tokens per second. A rate of 0 turns flood control off.
+struct IRCFloodLimits
+{
+    int rate = 5;
+    int burst = 20;
+    int queueLines = 64;        // Lines held back before "Excess Flood"
+    int fanoutPerToken = 500;   // Channel members one token of fan-out pays for
+
+    bool isEnabled() const { return rate > 0; }
+};
+
+// A client's token bucket and the lines held back while it is empty. Tokens
+// are kept in thousandths, so fractional costs and refills stay exact.
+class IRCFloodControl
+{
+public:
+    static constexpr qint64 Unit = 1000;    // Thousandths per token
+
+    // Refills for the time since the last call, then spends cost if the
+    // bucket holds that much. A cost above the burst goes through once the
+    // bucket is full and leaves it in debt, so the long-run rate holds for
+    // any channel size. now is in ms on a monotonic clock.
+    bool take(const IRCFloodLimits& limits, qint64 cost, qint64 now);
+
+    // Lines waiting for tokens, oldest first. hold() returns false once
+    // limit lines are waiting.
+    bool isHolding() const { return !m_held.isEmpty(); }
+    int heldLines() const { return m_held.size(); }
+    bool hold(QByteArrayView line, int limit);
+    const QByteArray& nextLine() const { return m_held.head(); }
+    void dropNextLine() { m_held.dequeue(); }
+    void clear() { m_held.clear(); }
+
+private:
+    qint64 m_tokens = 0;
+    qint64 m_refilled = -1;     // When m_tokens was last topped up, -1 before first use
+    QQueue<QByteArray> m_held;
+};
+
+#endif // IRCFLOOD_H
@@ -0,0 +1,173 @@
+#include "irchistory.h"
+#include "irchistorylog.h"
+#include <algorithm>
+#include <limits>
+
+namespace {
+bool earlier(const IRCHistoryEntry& entry, qint64 time)
+{
+    return entry.time < time;
+}
+
+bool later(qint64 time, const IRCHistoryEntry& entry)
+{
+    return time < entry.time;
+}
+
+constexpr qint64 Earliest = std::numeric_limits<qint64>::min();
+constexpr qint64 Latest = std::numeric_limits<qint64>::max();
+}
+
+IRCHistory::IRCHistory()
+    : m_capacity(DefaultCapacity)
+    , m_log(nullptr)
+{
+}
+
+IRCHistory::~IRCHistory()
+{
+    delete m_log;
+}
+
+void IRCHistory::setCapacity(int entries)
+{
+    m_capacity = qMax(0, entries);
+    for (QList<IRCHistoryEntry>& history : m_channels) {
+        if (history.size() > m_capacity) {
+            history.remove(0, history.size() - m_capacity);
+        }
+    }
+}
+
+bool IRCHistory::setStorage(const QString& directory, qint64 segmentBytes, qint64 retentionBytes)
+{
+    delete m_log;
+    m_log = nullptr;
+    if (directory.isEmpty()) {
+        return true;
+    }
+
+    IRCHistoryLog* log = new IRCHistoryLog(directory, segmentBytes, retentionBytes);
+    if (!log->isValid()) {
+        delete log;
+        return false;
+    }
+    m_log = log;
+
+    // The log is the history from now on
+    m_channels.clear();
+    return true;
+}
+
+QString IRCHistory::storage() const
+{
+    return m_log ? m_log->directory() : QString();
+}
+
+IRCHistoryStats IRCHistory::stats() const
+{
+    return m_log ? m_log->stats() : IRCHistoryStats();
+}
+
+void IRCHistory::append(const QString& channel, qint64 time, const QByteArray& prefix, const QByteArray& text)
+{
+    if (m_log) {
+        m_log->append(channel, IRCHistoryEntry{time, prefix, text});
+        return;
+    }
+    if (m_capacity == 0) {
+        return;
+    }
+
+    QList<IRCHistoryEntry>& entries = m_channels[channel];
+    IRCHistoryEntry entry{time, prefix, text};
+
+    // Live traffic appends; only replayed bridge history lands in the middle
+    if (entries.isEmpty() || entries.last().time <= time) {
+        entries.append(entry);
+    } else {
+        auto it = std::upper_bound(entries.begin(), entries.end(), time, later);
+        entries.insert(it, entry);
+    }
+
+    if (entries.size() > m_capacity) {
+        entries.removeFirst();
+    }
+}
+
+bool IRCHistory::contains(const QString& channel, qint64 time, const QByteArray& prefix, const QByteArray& text)
+{
+    if (m_log) {
+        return m_log->contains(channel, IRCHistoryEntry{time, prefix, text});
+    }
+
+    const QList<IRCHistoryEntry> entries = m_channels.value(channel);
+    auto it = std::lower_bound(entries.cbegin(), entries.cend(), time, earlier);
+    for (; it != entries.cend() && it->time == time; ++it) {
+        if (it->text == text && it->prefix == prefix) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void IRCHistory::clear()
+{
+    m_channels.clear();
+}
+
+QList<IRCHistoryEntry> IRCHistory::latest(const QString& channel, qint64 after, int limit)
+{
+    if (m_log) {
+        return m_log->select(channel, after >= 0 ? after : Earliest, Latest, limit, true);
+    }
+
+    auto found = m_channels.constFind(channel);
+    if (found == m_channels.constEnd() || limit <= 0) {
+        return QList<IRCHistoryEntry>();
+    }
+    const QList<IRCHistoryEntry>& entries = found.value();
+
+    auto first = entries.cbegin();
+    if (after >= 0) {
+        first = std::upper_bound(entries.cbegin(), entries.cend(), after, later);
+    }
+    if (entries.cend() - first > limit) {
+        first = entries.cend() - limit;
+    }
+    return QList<IRCHistoryEntry>(first, entries.cend());
+}
+
+QList<IRCHistoryEntry> IRCHistory::before(const QString& channel, qint64 time, int limit)
+{
+    if (m_log) {
+        return m_log->select(channel, Earliest, time, limit, true);
+    }
+
+    auto found = m_channels.constFind(channel);
+    if (found == m_channels.constEnd() || limit <= 0) {
+        return QList<IRCHistoryEntry>();
+    }
+    const QList<IRCHistoryEntry>& entries = found.value();
+
+    auto last = std::lower_bound(entries.cbegin(), entries.cend(), time, earlier);
+    auto first = last - qMin(qsizetype(limit), qsizetype(last - entries.cbegin()));
+    return QList<IRCHistoryEntry>(first, last);
+}
+
+QList<IRCHistoryEntry> IRCHistory::after(const QString& channel, qint64 time, int limit)
+{
+    if (m_log) {
+        return m_log->select(channel, time, Latest, limit, false);
+    }
+
+    auto found = m_channels.constFind(channel);
+    if (found == m_channels.constEnd() || limit <= 0) {
+        return QList<IRCHistoryEntry>();
+    }
+    const QList<IRCHistoryEntry>& entries = found.value();
+
+    auto first = std::upper_bound(entries.cbegin(), entries.cend(), time, later);
+    auto last = first + qMin(qsizetype(limit), qsizetype(entries.cend() - first));
+    return QList<IRCHistoryEntry>(first, last);
+}
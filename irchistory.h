@@ -0,0 +1,77 @@
+#ifndef IRCHISTORY_H
+#define IRCHISTORY_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QString>
+
+class IRCHistoryLog;
+
+// One message kept for CHATHISTORY replay
+struct IRCHistoryEntry
+{
+    qint64 time;            // ms since epoch, UTC
+    QByteArray prefix;      // encoded "nick!user@host"
+    QByteArray text;        // encoded message body
+};
+
+// Archive tier counters, see IRCHistoryLog
+struct IRCHistoryStats
+{
+    qint64 archivedBytes = 0;       // Archives on disk
+    qint64 archivedRawBytes = 0;    // The same records uncompressed
+    qint64 decodedBytes = 0;        // Decompressed by reads so far
+    qint64 decodeNsecs = 0;         // Time spent doing so
+};
+
+// Channel messages for CHATHISTORY, kept per channel name so history
+// outlives the channel emptying. Callers pass the casemapped name (see
+// IRCChannel::foldedName), so every spelling of a channel shares its
+// history. By default the most recent messages are kept in memory, ordered
+// by time; bridged history may arrive out of order and is inserted where it
+// belongs. With storage configured, everything goes to an IRCHistoryLog on
+// disk instead.
+class IRCHistory
+{
+public:
+    static constexpr int DefaultCapacity = 1000;
+
+    IRCHistory();
+    ~IRCHistory();
+
+    // Messages kept per channel in memory; the oldest are dropped first
+    void setCapacity(int entries);
+    int capacity() const { return m_capacity; }
+
+    // Moves history to segment files under directory, rotated at
+    // segmentBytes and deleted oldest first beyond retentionBytes per
+    // channel. An empty directory goes back to memory. Returns false if the
+    // directory is unusable, leaving history in memory.
+    bool setStorage(const QString& directory, qint64 segmentBytes, qint64 retentionBytes);
+    QString storage() const;
+    // Zero while history is kept in memory
+    IRCHistoryStats stats() const;
+
+    void append(const QString& channel, qint64 time, const QByteArray& prefix, const QByteArray& text);
+    // Whether this exact message is already stored, so replays can be skipped
+    bool contains(const QString& channel, qint64 time, const QByteArray& prefix, const QByteArray& text);
+    // Drops the in-memory history; stored segments are left alone
+    void clear();
+
+    // Pages in ascending time order, at most limit entries each.
+    // latest(): the newest entries, newer than after if after >= 0.
+    // before()/after(): the entries closest to time, excluding it.
+    QList<IRCHistoryEntry> latest(const QString& channel, qint64 after, int limit);
+    QList<IRCHistoryEntry> before(const QString& channel, qint64 time, int limit);
+    QList<IRCHistoryEntry> after(const QString& channel, qint64 time, int limit);
+
+private:
+    Q_DISABLE_COPY(IRCHistory)
+
+    QHash<QString, QList<IRCHistoryEntry>> m_channels;
+    int m_capacity;
+    IRCHistoryLog* m_log;
+};
+
+#endif // IRCHISTORY_H
@@ -0,0 +1,175 @@
+#include "irchistorycodec.h"
+#include <QDebug>
+#include <QFile>
+#include <QSaveFile>
+
+#ifdef LOGOS_IRC_HAS_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+#include <vector>
+#endif
+
+namespace {
+#ifdef LOGOS_IRC_HAS_ZSTD
+// Archives are written once and read many times; spend a little more on them
+constexpr int CompressionLevel = 6;
+
+// Plenty for short chat lines; larger dictionaries stop paying off
+constexpr size_t DictionaryCapacity = 16 * 1024;
+#endif
+}
+
+struct IRCHistoryCodec::Context
+{
+#ifdef LOGOS_IRC_HAS_ZSTD
+    ZSTD_CCtx* cctx = nullptr;
+    ZSTD_DCtx* dctx = nullptr;
+    ZSTD_CDict* cdict = nullptr;
+    ZSTD_DDict* ddict = nullptr;
+#endif
+    quint32 dictionaryId = 0;
+};
+
+IRCHistoryCodec::IRCHistoryCodec()
+    : d(new Context)
+{
+#ifdef LOGOS_IRC_HAS_ZSTD
+    d->cctx = ZSTD_createCCtx();
+    d->dctx = ZSTD_createDCtx();
+#endif
+}
+
+IRCHistoryCodec::~IRCHistoryCodec()
+{
+#ifdef LOGOS_IRC_HAS_ZSTD
+    ZSTD_freeCDict(d->cdict);
+    ZSTD_freeDDict(d->ddict);
+    ZSTD_freeCCtx(d->cctx);
+    ZSTD_freeDCtx(d->dctx);
+#endif
+    delete d;
+}
+
+bool IRCHistoryCodec::isAvailable()
+{
+#ifdef LOGOS_IRC_HAS_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+quint32 IRCHistoryCodec::dictionaryId() const
+{
+    return d->dictionaryId;
+}
+
+bool IRCHistoryCodec::loadDictionary(const QString& path)
+{
+#ifdef LOGOS_IRC_HAS_ZSTD
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    QByteArray dictionary = file.readAll();
+
+    quint32 id = ZDICT_getDictID(dictionary.constData(), dictionary.size());
+    ZSTD_CDict* cdict = ZSTD_createCDict(dictionary.constData(), dictionary.size(), CompressionLevel);
+    ZSTD_DDict* ddict = ZSTD_createDDict(dictionary.constData(), dictionary.size());
+    if (id == 0 || !cdict || !ddict) {
+        qWarning() << "IRCHistoryCodec: invalid dictionary" << path;
+        ZSTD_freeCDict(cdict);
+        ZSTD_freeDDict(ddict);
+        return false;
+    }
+
+    ZSTD_freeCDict(d->cdict);
+    ZSTD_freeDDict(d->ddict);
+    d->cdict = cdict;
+    d->ddict = ddict;
+    d->dictionaryId = id;
+    return true;
+#else
+    Q_UNUSED(path)
+    return false;
+#endif
+}
+
+bool IRCHistoryCodec::trainDictionary(const QList<QByteArrayView>& samples, const QString& path)
+{
+#ifdef LOGOS_IRC_HAS_ZSTD
+    // The trainer takes the samples back to back with a list of their sizes
+    QByteArray buffer;
+    std::vector<size_t> sizes;
+    sizes.reserve(samples.size());
+    for (QByteArrayView sample : samples) {
+        buffer.append(sample);
+        sizes.push_back(size_t(sample.size()));
+    }
+
+    QByteArray dictionary(qsizetype(DictionaryCapacity), Qt::Uninitialized);
+    size_t size = ZDICT_trainFromBuffer(dictionary.data(), DictionaryCapacity, buffer.constData(), sizes.data(), unsigned(sizes.size()));
+    if (ZDICT_isError(size)) {
+        qWarning() << "IRCHistoryCodec: dictionary training failed:" << ZDICT_getErrorName(size);
+        return false;
+    }
+    dictionary.truncate(qsizetype(size));
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly) || file.write(dictionary) != dictionary.size() || !file.commit()) {
+        qWarning() << "IRCHistoryCodec: cannot save dictionary to" << path << ":" << file.errorString();
+        return false;
+    }
+    return loadDictionary(path);
+#else
+    Q_UNUSED(samples)
+    Q_UNUSED(path)
+    return false;
+#endif
+}
+
+bool IRCHistoryCodec::compress(QByteArrayView raw, QByteArray& compressed)
+{
+#ifdef LOGOS_IRC_HAS_ZSTD
+    compressed.resize(qsizetype(ZSTD_compressBound(raw.size())));
+    size_t size = d->cdict
+        ? ZSTD_compress_usingCDict(d->cctx, compressed.data(), compressed.size(), raw.data(), raw.size(), d->cdict)
+        : ZSTD_compressCCtx(d->cctx, compressed.data(), compressed.size(), raw.data(), raw.size(), CompressionLevel);
+    if (ZSTD_isError(size)) {
+        qWarning() << "IRCHistoryCodec: compression failed:" << ZSTD_getErrorName(size);
+        return false;
+    }
+    compressed.truncate(qsizetype(size));
+    return true;
+#else
+    Q_UNUSED(raw)
+    Q_UNUSED(compressed)
+    return false;
+#endif
+}
+
+bool IRCHistoryCodec::decompress(QByteArrayView compressed, qint64 rawSize, QByteArray& raw)
+{
+#ifdef LOGOS_IRC_HAS_ZSTD
+    raw.resize(qsizetype(rawSize));
+    // Blocks archived before the dictionary was trained are decoded without it
+    bool useDictionary = ZSTD_getDictID_fromFrame(compressed.data(), compressed.size()) != 0;
+    if (useDictionary && !d->ddict) {
+        qWarning() << "IRCHistoryCodec: block needs a dictionary that is not loaded";
+        return false;
+    }
+    size_t size = useDictionary
+        ? ZSTD_decompress_usingDDict(d->dctx, raw.data(), raw.size(), compressed.data(), compressed.size(), d->ddict)
+        : ZSTD_decompressDCtx(d->dctx, raw.data(), raw.size(), compressed.data(), compressed.size());
+    if (ZSTD_isError(size) || qint64(size) != rawSize) {
+        qWarning() << "IRCHistoryCodec: decompression failed";
+        return false;
+    }
+    return true;
+#else
+    Q_UNUSED(compressed)
+    Q_UNUSED(rawSize)
+    Q_UNUSED(raw)
+    return false;
+#endif
+}
@@ -0,0 +1,41 @@
+#ifndef IRCHISTORYCODEC_H
+#define IRCHISTORYCODEC_H
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QList>
+#include <QString>
+
+// zstd compression for archived history blocks. Every block is compressed
+// on its own so any one of them can be decoded without the others. Chat
+// lines are short and repetitive, so a dictionary trained on the
+// deployment's own traffic does most of the work.
+//
+// Without zstd at build time the codec is unavailable and every call fails.
+class IRCHistoryCodec
+{
+public:
+    IRCHistoryCodec();
+    ~IRCHistoryCodec();
+
+    static bool isAvailable();
+
+    // Loads a dictionary saved by trainDictionary()
+    bool loadDictionary(const QString& path);
+    // Trains a dictionary from sample records and saves it to path
+    bool trainDictionary(const QList<QByteArrayView>& samples, const QString& path);
+    // ID of the loaded dictionary, 0 if there is none
+    quint32 dictionaryId() const;
+
+    bool compress(QByteArrayView raw, QByteArray& compressed);
+    // rawSize is the size recorded when the block was compressed
+    bool decompress(QByteArrayView compressed, qint64 rawSize, QByteArray& raw);
+
+private:
+    Q_DISABLE_COPY(IRCHistoryCodec)
+
+    struct Context;
+    Context* d;
+};
+
+#endif // IRCHISTORYCODEC_H
@@ -0,0 +1,759 @@
+#include "irchistorylog.h"
+#include "irchistorycodec.h"
+#include "ircmessage.h"
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QMap>
+#include <QSaveFile>
+#include <QThread>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+
+namespace {
+// Record layout, little endian:
+//   quint32 record size | qint64 time | quint64 seq | quint16 prefix size | prefix | text
+constexpr qint64 HeaderSize = 4 + 8 + 8 + 2;
+
+// Records covered by one sparse index entry, and the unit of compression
+constexpr int RecordsPerBlock = 64;
+
+// Raw segments kept besides the archives, counting the active one
+constexpr int HotSegments = 2;
+
+// Records needed before a dictionary is worth training
+constexpr int MinDictionarySamples = 1000;
+
+// Archive layout, little endian:
+//   ArchiveMagic | quint32 dictionary ID | compressed blocks |
+//   per block: qint64 offset | qint64 min time | qint64 max time |
+//              quint32 stored size | quint32 raw size | quint32 record count
+//   quint64 next sequence number | quint32 block count | IndexMagic
+constexpr char ArchiveMagic[] = "LIRCARC1";
+constexpr char IndexMagic[] = "LIRCIDX1";
+constexpr qint64 MagicSize = 8;
+constexpr qint64 ArchiveHeaderSize = MagicSize + 4;
+constexpr qint64 IndexEntrySize = 8 + 8 + 8 + 4 + 4 + 4;
+constexpr qint64 ArchiveTrailerSize = 8 + 4 + MagicSize;
+
+struct Record
+{
+    qint64 size;
+    qint64 time;
+    quint64 seq;
+    QByteArrayView prefix;
+    QByteArrayView text;
+};
+
+// Reads the record at offset; false if it is cut short or malformed
+bool readRecord(const uchar* data, qint64 available, qint64 offset, Record& record)
+{
+    if (available - offset < HeaderSize) {
+        return false;
+    }
+    const uchar* p = data + offset;
+    record.size = qFromLittleEndian<quint32>(p);
+    record.time = qFromLittleEndian<qint64>(p + 4);
+    record.seq = qFromLittleEndian<quint64>(p + 12);
+    qint64 prefixSize = qFromLittleEndian<quint16>(p + 20);
+    if (record.size < HeaderSize + prefixSize || record.size > available - offset) {
+        return false;
+    }
+
+    const char* body = reinterpret_cast<const char*>(p + HeaderSize);
+    record.prefix = QByteArrayView(body, prefixSize);
+    record.text = QByteArrayView(body + prefixSize, record.size - HeaderSize - prefixSize);
+    return true;
+}
+
+// Ordered by time, then by arrival
+bool precedes(const Record& a, const Record& b)
+{
+    return a.time < b.time || (a.time == b.time && a.seq < b.seq);
+}
+
+QString segmentName(quint64 firstSeq)
+{
+    return QString("%1.log").arg(firstSeq, 20, 10, QChar('0'));
+}
+
+QString archiveName(const QString& segmentPath)
+{
+    return segmentPath.chopped(4) + ".zst";
+}
+}
+
+IRCHistoryLog::IRCHistoryLog(const QString& directory, qint64 segmentBytes, qint64 retentionBytes)
+    : m_directory(directory)
+    , m_segmentBytes(qMax(segmentBytes, HeaderSize))
+    , m_retentionBytes(qMax(retentionBytes, m_segmentBytes))
+    , m_valid(QDir().mkpath(directory))
+    , m_codec(new IRCHistoryCodec)
+    , m_decodedBytes(0)
+    , m_decodeNsecs(0)
+    , m_archiver(nullptr)
+    , m_stopping(false)
+{
+    if (!m_valid) {
+        qWarning() << "IRCHistoryLog: cannot create" << directory;
+    }
+    if (IRCHistoryCodec::isAvailable() && QFile::exists(m_directory + "/history.dict")) {
+        m_codec->loadDictionary(m_directory + "/history.dict");
+    }
+    if (m_valid) {
+        foldChannelDirectories();
+    }
+}
+
+void IRCHistoryLog::foldChannelDirectories()
+{
+    // Channels used to be stored under whatever spelling they were created
+    // with; move them to their casemapped name, which is what callers pass
+    QDir root(m_directory);
+    const QStringList names = root.entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+    for (const QString& hexName : names) {
+        QByteArray name = QByteArray::fromHex(hexName.toLatin1());
+        QString folded = QString::fromLatin1(IRCMessage::foldCase(name).toHex());
+        if (folded == hexName) continue;
+
+        if (root.exists(folded)) {
+            qWarning() << "IRCHistoryLog: not merging" << QString::fromUtf8(name) << "into the history of" << QString::fromUtf8(IRCMessage::foldCase(name));
+        } else if (!root.rename(hexName, folded)) {
+            qWarning() << "IRCHistoryLog: cannot rename the history of" << QString::fromUtf8(name);
+        }
+    }
+}
+
+IRCHistoryLog::~IRCHistoryLog()
+{
+    // A job cut short leaves its raw segment; a written archive replaces it
+    // here or on the next load
+    if (m_archiver) {
+        {
+            QMutexLocker locker(&m_archiveMutex);
+            m_stopping.store(true, std::memory_order_release);
+            m_archiveWake.wakeAll();
+        }
+        m_archiver->wait();
+        delete m_archiver;
+        collectArchives();
+    }
+
+    for (Channel* channel : std::as_const(m_channels)) {
+        for (Segment* segment : std::as_const(channel->segments)) {
+            closeSegment(segment, false);
+        }
+        delete channel;
+    }
+    delete m_codec;
+}
+
+IRCHistoryLog::Channel* IRCHistoryLog::channel(const QString& name, bool create)
+{
+    if (Channel* channel = m_channels.value(name)) {
+        return channel;
+    }
+    if (!m_valid) {
+        return nullptr;
+    }
+
+    // Channel names may hold anything but spaces and commas; hex is safe on any filesystem
+    QDir dir(m_directory + '/' + QString::fromLatin1(name.toUtf8().toHex()));
+    if (!dir.exists() && (!create || !dir.mkpath("."))) {
+        return nullptr;
+    }
+
+    Channel* channel = new Channel{dir.path(), QList<Segment*>(), 0, 0};
+
+    // Zero-padded names list in sequence order. An archive replaces the raw
+    // segment it was made from; both exist only if archiving was cut short.
+    QMap<quint64, QString> files;
+    const QStringList names = dir.entryList(QStringList() << "*.log" << "*.zst", QDir::Files, QDir::Name);
+    for (const QString& fileName : names) {
+        bool ok = false;
+        quint64 firstSeq = QFileInfo(fileName).baseName().toULongLong(&ok);
+        if (!ok) continue;
+
+        if (files.contains(firstSeq)) {
+            QFile::remove(dir.filePath(files.value(firstSeq)));
+        }
+        files.insert(firstSeq, fileName);
+    }
+
+    for (auto it = files.cbegin(); it != files.cend(); ++it) {
+        quint64 firstSeq = it.key();
+        quint64 nextSeq = firstSeq;
+        Segment* segment = it.value().endsWith(".zst")
+            ? openArchive(dir.filePath(it.value()), firstSeq, nextSeq)
+            : openSegment(dir.filePath(it.value()), firstSeq, nextSeq);
+        if (segment) {
+            channel->segments.append(segment);
+            channel->bytes += segment->size;
+            channel->nextSeq = qMax(channel->nextSeq, nextSeq);
+        }
+    }
+    for (qsizetype i = 0; i + 1 < channel->segments.size(); ++i) {
+        releaseSegment(channel->segments[i]);
+    }
+
+    m_channels.insert(name, channel);
+    return channel;
+}
+
+IRCHistoryLog::Segment* IRCHistoryLog::openSegment(const QString& path, quint64 firstSeq, quint64& nextSeq)
+{
+    QFile* file = new QFile(path);
+    if (!file->open(QIODevice::ReadWrite | QIODevice::Unbuffered)) {
+        qWarning() << "IRCHistoryLog: cannot open" << path << ":" << file->errorString();
+        delete file;
+        return nullptr;
+    }
+
+    Segment* segment = new Segment{path, file, firstSeq, 0, nullptr, 0, QList<Block>(), false, false};
+
+    // Walk the records once to rebuild the index
+    qint64 size = file->size();
+    if (size > 0) {
+        uchar* data = file->map(0, size);
+        if (!data) {
+            qWarning() << "IRCHistoryLog: cannot map" << path << ":" << file->errorString();
+            delete segment;
+            delete file;
+            return nullptr;
+        }
+
+        qint64 offset = 0;
+        Record record;
+        while (readRecord(data, size, offset, record)) {
+            indexRecord(segment, offset, record.time);
+            nextSeq = record.seq + 1;
+            offset += record.size;
+        }
+        file->unmap(data);
+
+        if (offset < size) {
+            // A write cut short, e.g. by a crash; drop the partial record
+            qWarning() << "IRCHistoryLog: truncating" << path << "from" << size << "to" << offset << "bytes";
+            file->resize(offset);
+        }
+        segment->size = offset;
+    }
+    return segment;
+}
+
+IRCHistoryLog::Segment* IRCHistoryLog::openArchive(const QString& path, quint64 firstSeq, quint64& nextSeq)
+{
+    if (!IRCHistoryCodec::isAvailable()) {
+        qWarning() << "IRCHistoryLog: skipping" << path << ", built without zstd";
+        return nullptr;
+    }
+
+    QFile* file = new QFile(path);
+    uchar* data = nullptr;
+    qint64 size = 0;
+    if (file->open(QIODevice::ReadOnly)) {
+        size = file->size();
+        data = size >= ArchiveHeaderSize + ArchiveTrailerSize ? file->map(0, size) : nullptr;
+    }
+    if (!data) {
+        qWarning() << "IRCHistoryLog: cannot read" << path << ":" << file->errorString();
+        delete file;
+        return nullptr;
+    }
+
+    Segment* segment = new Segment{path, file, firstSeq, size, data, size, QList<Block>(), true, false};
+
+    const uchar* trailer = data + size - ArchiveTrailerSize;
+    quint32 blockCount = qFromLittleEndian<quint32>(trailer + 8);
+    qint64 indexStart = size - ArchiveTrailerSize - qint64(blockCount) * IndexEntrySize;
+    quint32 dictionaryId = qFromLittleEndian<quint32>(data + MagicSize);
+    bool valid = std::memcmp(data, ArchiveMagic, MagicSize) == 0
+        && std::memcmp(trailer + 12, IndexMagic, MagicSize) == 0
+        && indexStart >= ArchiveHeaderSize;
+    if (valid && dictionaryId != 0 && dictionaryId != m_codec->dictionaryId()) {
+        qWarning() << "IRCHistoryLog:" << path << "was compressed with dictionary" << dictionaryId << ", which is not loaded";
+        valid = false;
+    }
+    if (!valid) {
+        qWarning() << "IRCHistoryLog: skipping malformed archive" << path;
+        closeSegment(segment, false);
+        return nullptr;
+    }
+
+    segment->blocks.reserve(blockCount);
+    for (quint32 i = 0; i < blockCount; ++i) {
+        const uchar* p = data + indexStart + i * IndexEntrySize;
+        Block block{qFromLittleEndian<qint64>(p), qFromLittleEndian<qint64>(p + 8), qFromLittleEndian<qint64>(p + 16),
+                    int(qFromLittleEndian<quint32>(p + 32)), qFromLittleEndian<quint32>(p + 24), qFromLittleEndian<quint32>(p + 28)};
+        if (block.offset < ArchiveHeaderSize || block.offset + block.storedSize > indexStart) {
+            qWarning() << "IRCHistoryLog: skipping malformed archive" << path;
+            closeSegment(segment, false);
+            return nullptr;
+        }
+        segment->blocks.append(block);
+    }
+    nextSeq = qFromLittleEndian<quint64>(trailer);
+
+    // Archives never change; reads map them again as needed
+    releaseSegment(segment);
+    return segment;
+}
+
+void IRCHistoryLog::closeSegment(Segment* segment, bool remove)
+{
+    releaseSegment(segment);
+    if (remove) {
+        QFile::remove(segment->path);
+    }
+    delete segment;
+}
+
+void IRCHistoryLog::releaseSegment(Segment* segment)
+{
+    if (segment->data) {
+        segment->file->unmap(segment->data);
+    }
+    delete segment->file;
+    segment->file = nullptr;
+    segment->data = nullptr;
+    segment->mapped = 0;
+    m_openSegments.removeOne(segment);
+}
+
+void IRCHistoryLog::trimOpenSegments()
+{
+    while (m_openSegments.size() > MaxOpenSegments) {
+        releaseSegment(m_openSegments.first());
+    }
+}
+
+void IRCHistoryLog::indexRecord(Segment* segment, qint64 offset, qint64 time)
+{
+    if (segment->blocks.isEmpty() || segment->blocks.last().count == RecordsPerBlock) {
+        segment->blocks.append(Block{offset, time, time, 0, 0, 0});
+    }
+
+    Block& block = segment->blocks.last();
+    block.minTime = qMin(block.minTime, time);
+    block.maxTime = qMax(block.maxTime, time);
+    ++block.count;
+}
+
+const uchar* IRCHistoryLog::map(Segment* segment)
+{
+    if (!segment->file) {
+        QFile* file = new QFile(segment->path);
+        if (!file->open(QIODevice::ReadOnly)) {
+            qWarning() << "IRCHistoryLog: cannot open" << segment->path << ":" << file->errorString();
+            delete file;
+            return nullptr;
+        }
+        segment->file = file;
+        m_openSegments.append(segment);
+    } else if (m_openSegments.removeOne(segment)) {
+        m_openSegments.append(segment);
+    }
+
+    if (segment->mapped != segment->size) {
+        if (segment->data) {
+            segment->file->unmap(segment->data);
+        }
+        segment->data = segment->size > 0 ? segment->file->map(0, segment->size) : nullptr;
+        segment->mapped = segment->data ? segment->size : 0;
+    }
+    return segment->data;
+}
+
+const uchar* IRCHistoryLog::readBlock(Segment* segment, const Block& block, QByteArray& buffer, qint64& offset, qint64& available)
+{
+    const uchar* data = map(segment);
+    if (!data || !segment->archived) {
+        offset = block.offset;
+        available = segment->mapped;
+        return data;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    QByteArrayView compressed(reinterpret_cast<const char*>(data + block.offset), block.storedSize);
+    if (!m_codec->decompress(compressed, block.rawSize, buffer)) {
+        return nullptr;
+    }
+    m_decodedBytes += block.rawSize;
+    m_decodeNsecs += timer.nsecsElapsed();
+
+    offset = 0;
+    available = buffer.size();
+    return reinterpret_cast<const uchar*>(buffer.constData());
+}
+
+bool IRCHistoryLog::rotate(Channel* channel)
+{
+    quint64 nextSeq = channel->nextSeq;
+    Segment* segment = openSegment(channel->directory + '/' + segmentName(nextSeq), nextSeq, nextSeq);
+    if (!segment) {
+        return false;
+    }
+
+    // The sealed segment no longer changes; it is reopened read-only when a
+    // read reaches it
+    if (!channel->segments.isEmpty()) {
+        releaseSegment(channel->segments.last());
+    }
+    channel->segments.append(segment);
+    archiveColdSegments(channel);
+    enforceRetention(channel);
+    return true;
+}
+
+void IRCHistoryLog::archiveColdSegments(Channel* channel)
+{
+    if (!IRCHistoryCodec::isAvailable()) {
+        return;
+    }
+
+    QList<ArchiveJob> jobs;
+    for (qsizetype i = 0; i + HotSegments < channel->segments.size(); ++i) {
+        Segment* segment = channel->segments[i];
+        if (segment->archived || segment->archiving) continue;
+
+        segment->archiving = true;
+        jobs.append(ArchiveJob{channel, segment->path, segment->firstSeq, channel->segments[i + 1]->firstSeq,
+                               segment->size, segment->blocks, 0, false});
+    }
+    if (jobs.isEmpty()) {
+        return;
+    }
+
+    QMutexLocker locker(&m_archiveMutex);
+    m_archiveQueue.append(jobs);
+    m_archiveWake.wakeOne();
+    if (m_archiver) {
+        return;
+    }
+
+    // Compressing a segment takes long enough to stall the event loop, and
+    // training the dictionary longer still
+    m_archiver = QThread::create([this]() {
+        IRCHistoryCodec codec;
+        if (QFile::exists(m_directory + "/history.dict")) {
+            codec.loadDictionary(m_directory + "/history.dict");
+        }
+
+        QMutexLocker locker(&m_archiveMutex);
+        while (!m_stopping.load(std::memory_order_acquire)) {
+            if (m_archiveQueue.isEmpty()) {
+                m_archiveWake.wait(&m_archiveMutex);
+                continue;
+            }
+            ArchiveJob job = m_archiveQueue.takeFirst();
+            locker.unlock();
+            job.written = archive(codec, job);
+            locker.relock();
+            m_archived.append(job);
+        }
+    });
+    m_archiver->setObjectName("irc-history-archiver");
+    m_archiver->start();
+}
+
+void IRCHistoryLog::collectArchives()
+{
+    if (!m_archiver) {
+        return;
+    }
+    QList<ArchiveJob> jobs;
+    {
+        QMutexLocker locker(&m_archiveMutex);
+        jobs.swap(m_archived);
+    }
+
+    for (const ArchiveJob& job : std::as_const(jobs)) {
+        // The archiver trains the dictionary with its own codec
+        if (job.dictionaryId != 0 && job.dictionaryId != m_codec->dictionaryId()) {
+            m_codec->loadDictionary(m_directory + "/history.dict");
+        }
+
+        Channel* channel = job.channel;
+        const QString path = archiveName(job.path);
+        qsizetype i = 0;
+        while (i < channel->segments.size() && channel->segments[i]->firstSeq != job.firstSeq) {
+            ++i;
+        }
+        if (i == channel->segments.size()) {
+            // Expired while it was being archived
+            if (job.written) {
+                QFile::remove(path);
+            }
+            continue;
+        }
+
+        // On failure the raw segment stays; the next rotation tries again
+        Segment* segment = channel->segments[i];
+        segment->archiving = false;
+        if (!job.written) continue;
+
+        quint64 nextSeq = job.nextSeq;
+        Segment* archived = openArchive(path, job.firstSeq, nextSeq);
+        if (!archived) {
+            QFile::remove(path);
+            continue;
+        }
+        channel->bytes += archived->size - segment->size;
+        channel->segments[i] = archived;
+        closeSegment(segment, true);
+    }
+}
+
+bool IRCHistoryLog::archive(IRCHistoryCodec& codec, ArchiveJob& job)
+{
+    // A handle of its own, so the segment can expire or be remapped meanwhile
+    QFile segment(job.path);
+    const uchar* data = job.size > 0 && segment.open(QIODevice::ReadOnly) ? segment.map(0, job.size) : nullptr;
+    if (!data) {
+        qWarning() << "IRCHistoryLog: cannot read" << job.path << ":" << segment.errorString();
+        return false;
+    }
+    if (codec.dictionaryId() == 0) {
+        trainDictionary(codec, data, job.size);
+    }
+    job.dictionaryId = codec.dictionaryId();
+
+    const QString path = archiveName(job.path);
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qWarning() << "IRCHistoryLog: cannot create" << path << ":" << file.errorString();
+        return false;
+    }
+
+    QByteArray header(ArchiveMagic, MagicSize);
+    header.resize(ArchiveHeaderSize);
+    qToLittleEndian<quint32>(job.dictionaryId, header.data() + MagicSize);
+    file.write(header);
+
+    QByteArray index(job.blocks.size() * IndexEntrySize, Qt::Uninitialized);
+    uchar* entry = reinterpret_cast<uchar*>(index.data());
+    qint64 offset = ArchiveHeaderSize;
+    QByteArray compressed;
+    for (qsizetype i = 0; i < job.blocks.size(); ++i) {
+        const Block& block = job.blocks[i];
+        qint64 end = i + 1 < job.blocks.size() ? job.blocks[i + 1].offset : job.size;
+        QByteArrayView raw(reinterpret_cast<const char*>(data + block.offset), end - block.offset);
+        if (m_stopping.load(std::memory_order_acquire) || !codec.compress(raw, compressed) || file.write(compressed) != compressed.size()) {
+            file.cancelWriting();
+            return false;
+        }
+
+        qToLittleEndian<qint64>(offset, entry);
+        qToLittleEndian<qint64>(block.minTime, entry + 8);
+        qToLittleEndian<qint64>(block.maxTime, entry + 16);
+        qToLittleEndian<quint32>(quint32(compressed.size()), entry + 24);
+        qToLittleEndian<quint32>(quint32(raw.size()), entry + 28);
+        qToLittleEndian<quint32>(quint32(block.count), entry + 32);
+        entry += IndexEntrySize;
+        offset += compressed.size();
+    }
+
+    QByteArray trailer(ArchiveTrailerSize, Qt::Uninitialized);
+    qToLittleEndian<quint64>(job.nextSeq, trailer.data());
+    qToLittleEndian<quint32>(quint32(job.blocks.size()), trailer.data() + 8);
+    std::memcpy(trailer.data() + 12, IndexMagic, MagicSize);
+    file.write(index);
+    file.write(trailer);
+    if (!file.commit()) {
+        qWarning() << "IRCHistoryLog: cannot write" << path << ":" << file.errorString();
+        return false;
+    }
+    return true;
+}
+
+void IRCHistoryLog::trainDictionary(IRCHistoryCodec& codec, const uchar* data, qint64 size)
+{
+    // Whole records make the samples; the nicks, prefixes and common words
+    // repeat across them
+    QList<QByteArrayView> samples;
+    qint64 offset = 0;
+    Record record;
+    while (readRecord(data, size, offset, record)) {
+        samples.append(QByteArrayView(reinterpret_cast<const char*>(data + offset), record.size));
+        offset += record.size;
+    }
+    if (samples.size() < MinDictionarySamples) {
+        return;
+    }
+
+    if (codec.trainDictionary(samples, m_directory + "/history.dict")) {
+        qDebug() << "IRCHistoryLog: trained a dictionary from" << samples.size() << "records";
+    }
+}
+
+void IRCHistoryLog::enforceRetention(Channel* channel)
+{
+    // The active segment is kept whatever its size
+    while (channel->bytes > m_retentionBytes && channel->segments.size() > 1) {
+        Segment* oldest = channel->segments.takeFirst();
+        channel->bytes -= oldest->size;
+        closeSegment(oldest, true);
+    }
+}
+
+bool IRCHistoryLog::append(const QString& name, const IRCHistoryEntry& entry)
+{
+    collectArchives();
+    Channel* channel = this->channel(name, true);
+    if (!channel) {
+        return false;
+    }
+    // An archive is last only if the active segment went missing
+    const bool full = channel->segments.isEmpty() || channel->segments.last()->archived
+        || channel->segments.last()->size >= m_segmentBytes;
+    if (full && !rotate(channel)) {
+        return false;
+    }
+    Segment* segment = channel->segments.last();
+
+    const qint64 prefixSize = qMin<qint64>(entry.prefix.size(), 0xffff);
+    const qint64 size = HeaderSize + prefixSize + entry.text.size();
+
+    QByteArray record(size, Qt::Uninitialized);
+    uchar* p = reinterpret_cast<uchar*>(record.data());
+    qToLittleEndian<quint32>(quint32(size), p);
+    qToLittleEndian<qint64>(entry.time, p + 4);
+    qToLittleEndian<quint64>(channel->nextSeq, p + 12);
+    qToLittleEndian<quint16>(quint16(prefixSize), p + 20);
+    std::memcpy(p + HeaderSize, entry.prefix.constData(), prefixSize);
+    std::memcpy(p + HeaderSize + prefixSize, entry.text.constData(), entry.text.size());
+
+    // One write per record; a record cut short is dropped on the next load
+    if (!segment->file->seek(segment->size) || segment->file->write(record) != size) {
+        qWarning() << "IRCHistoryLog: write failed:" << segment->file->errorString();
+        segment->file->resize(segment->size);
+        return false;
+    }
+
+    indexRecord(segment, segment->size, entry.time);
+    segment->size += size;
+    channel->bytes += size;
+    ++channel->nextSeq;
+    return true;
+}
+
+bool IRCHistoryLog::contains(const QString& name, const IRCHistoryEntry& entry)
+{
+    collectArchives();
+    Channel* channel = this->channel(name, false);
+    if (!channel) {
+        return false;
+    }
+
+    bool found = false;
+    QByteArray buffer;
+    for (qsizetype i = 0; i < channel->segments.size() && !found; ++i) {
+        Segment* segment = channel->segments[i];
+        for (qsizetype j = 0; j < segment->blocks.size() && !found; ++j) {
+            const Block& block = segment->blocks[j];
+            if (entry.time < block.minTime || entry.time > block.maxTime) continue;
+
+            qint64 offset = 0;
+            qint64 available = 0;
+            const uchar* data = readBlock(segment, block, buffer, offset, available);
+            if (!data) continue;
+
+            Record record;
+            for (int k = 0; k < block.count && !found && readRecord(data, available, offset, record); ++k) {
+                offset += record.size;
+                found = record.time == entry.time && record.text == QByteArrayView(entry.text) && record.prefix == QByteArrayView(entry.prefix);
+            }
+        }
+    }
+    trimOpenSegments();
+    return found;
+}
+
+QList<IRCHistoryEntry> IRCHistoryLog::select(const QString& name, qint64 low, qint64 high, int limit, bool newest)
+{
+    collectArchives();
+    Channel* channel = this->channel(name, false);
+    if (!channel || limit <= 0) {
+        return QList<IRCHistoryEntry>();
+    }
+
+    // A heap of the best candidates so far, the one to drop first on top.
+    // Records only refer to the mappings, which stay put during the scan,
+    // or to decoded blocks, which are kept until the end.
+    auto better = [newest](const Record& a, const Record& b) {
+        return newest ? precedes(b, a) : precedes(a, b);
+    };
+    QList<Record> heap;
+    heap.reserve(limit);
+    QList<QByteArray> decoded;
+
+    // Scan from the end the query favours so the index prunes the most blocks
+    const qsizetype segmentCount = channel->segments.size();
+    for (qsizetype i = 0; i < segmentCount; ++i) {
+        Segment* segment = channel->segments[newest ? segmentCount - 1 - i : i];
+        const qsizetype blockCount = segment->blocks.size();
+        for (qsizetype j = 0; j < blockCount; ++j) {
+            const Block& block = segment->blocks[newest ? blockCount - 1 - j : j];
+            if (block.maxTime <= low || block.minTime >= high) continue;
+            if (heap.size() == limit) {
+                qint64 worst = heap.first().time;
+                if (newest ? block.maxTime < worst : block.minTime > worst) continue;
+            }
+
+            QByteArray buffer;
+            qint64 offset = 0;
+            qint64 available = 0;
+            const uchar* data = readBlock(segment, block, buffer, offset, available);
+            if (!data) continue;
+            if (segment->archived) {
+                decoded.append(buffer);
+            }
+
+            Record record;
+            for (int k = 0; k < block.count && readRecord(data, available, offset, record); ++k) {
+                offset += record.size;
+                if (record.time <= low || record.time >= high) continue;
+
+                if (heap.size() < limit) {
+                    heap.append(record);
+                    std::push_heap(heap.begin(), heap.end(), better);
+                } else if (better(record, heap.first())) {
+                    std::pop_heap(heap.begin(), heap.end(), better);
+                    heap.last() = record;
+                    std::push_heap(heap.begin(), heap.end(), better);
+                }
+            }
+        }
+    }
+
+    std::sort(heap.begin(), heap.end(), precedes);
+
+    QList<IRCHistoryEntry> entries;
+    entries.reserve(heap.size());
+    for (const Record& record : std::as_const(heap)) {
+        entries.append(IRCHistoryEntry{record.time, record.prefix.toByteArray(), record.text.toByteArray()});
+    }
+    trimOpenSegments();
+    return entries;
+}
+
+IRCHistoryStats IRCHistoryLog::stats() const
+{
+    IRCHistoryStats stats;
+    for (const Channel* channel : m_channels) {
+        for (const Segment* segment : channel->segments) {
+            if (!segment->archived) continue;
+            stats.archivedBytes += segment->size;
+            for (const Block& block : segment->blocks) {
+                stats.archivedRawBytes += block.rawSize;
+            }
+        }
+    }
+    stats.decodedBytes = m_decodedBytes;
+    stats.decodeNsecs = m_decodeNsecs;
+    return stats;
+}
@@ -0,0 +1,155 @@
+#ifndef IRCHISTORYLOG_H
+#define IRCHISTORYLOG_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QWaitCondition>
+#include <atomic>
+#include "irchistory.h"
+
+class QFile;
+class QThread;
+class IRCHistoryCodec;
+
+// Append-only on-disk history. Every channel gets a directory of segment
+// files, each named after the sequence number of its first record. The
+// active segment is sealed once it reaches the rotation size, and the oldest
+// segments are deleted once a channel's segments exceed the retention size.
+//
+// Reads go through memory maps, guided by a sparse index with the time range
+// of every block of records. The index is rebuilt from the segments the
+// first time a channel is touched. Only the active segment of each channel
+// is held open; sealed segments and archives are opened when a read reaches
+// them, and the least recently read are closed again once more than
+// MaxOpenSegments are open.
+//
+// When built with zstd, sealed segments past the newest few are archived:
+// every block is compressed on its own, with a dictionary trained on the
+// first archived segment, and the block index is stored at the end of the
+// archive. Reads decode only the blocks they touch. Compression and training
+// run on a background thread, which reads its own copy of the raw segment;
+// the archive takes the segment's place at the next call after it is written.
+class IRCHistoryLog
+{
+public:
+    static constexpr qint64 DefaultSegmentBytes = 4 * 1024 * 1024;
+    static constexpr qint64 DefaultRetentionBytes = 256 * 1024 * 1024;
+    static constexpr int MaxOpenSegments = 64;
+
+    IRCHistoryLog(const QString& directory, qint64 segmentBytes, qint64 retentionBytes);
+    ~IRCHistoryLog();
+
+    // False if the directory could not be created
+    bool isValid() const { return m_valid; }
+    const QString& directory() const { return m_directory; }
+
+    bool append(const QString& channel, const IRCHistoryEntry& entry);
+    bool contains(const QString& channel, const IRCHistoryEntry& entry);
+
+    // Up to limit entries with low < time < high, either the newest or the
+    // oldest of them, returned in ascending time order
+    QList<IRCHistoryEntry> select(const QString& channel, qint64 low, qint64 high, int limit, bool newest);
+
+    // Totals over the channels loaded so far
+    IRCHistoryStats stats() const;
+
+private:
+    // RecordsPerBlock consecutive records and the times they span. In an
+    // archive, offset and storedSize locate the compressed block.
+    struct Block
+    {
+        qint64 offset;
+        qint64 minTime;
+        qint64 maxTime;
+        int count;
+        quint32 storedSize;
+        quint32 rawSize;
+    };
+
+    struct Segment
+    {
+        QString path;
+        QFile* file;        // Null while a sealed segment is closed
+        quint64 firstSeq;
+        qint64 size;
+        uchar* data;        // Maps the first mapped bytes, or null
+        qint64 mapped;
+        QList<Block> blocks;
+        bool archived;
+        bool archiving;     // Queued for, or being written by, the archiver thread
+    };
+
+    struct Channel
+    {
+        QString directory;
+        QList<Segment*> segments;   // Oldest first
+        quint64 nextSeq;
+        qint64 bytes;
+    };
+
+    // A sealed segment for the archiver thread to compress, and the outcome
+    struct ArchiveJob
+    {
+        Channel* channel;   // Only touched on the log's own thread
+        QString path;
+        quint64 firstSeq;
+        quint64 nextSeq;
+        qint64 size;
+        QList<Block> blocks;
+        quint32 dictionaryId;
+        bool written;
+    };
+
+    Q_DISABLE_COPY(IRCHistoryLog)
+
+    // Loads the channel's segments on first use. Reads never create the
+    // channel directory.
+    Channel* channel(const QString& name, bool create);
+    void foldChannelDirectories();
+    Segment* openSegment(const QString& path, quint64 firstSeq, quint64& nextSeq);
+    Segment* openArchive(const QString& path, quint64 firstSeq, quint64& nextSeq);
+    void closeSegment(Segment* segment, bool remove);
+    // Unmaps and closes a sealed segment until a read needs it again
+    void releaseSegment(Segment* segment);
+    // Closes the least recently read segments over MaxOpenSegments. Only
+    // called between scans, which rely on their mappings staying put.
+    void trimOpenSegments();
+    void indexRecord(Segment* segment, qint64 offset, qint64 time);
+    // Maps the segment up to its current size, remapping if it has grown.
+    // Opens a closed segment.
+    const uchar* map(Segment* segment);
+    // The records of one block, and the range of them in the returned data.
+    // Archived blocks are decoded into buffer.
+    const uchar* readBlock(Segment* segment, const Block& block, QByteArray& buffer, qint64& offset, qint64& available);
+    bool rotate(Channel* channel);
+    void enforceRetention(Channel* channel);
+    void archiveColdSegments(Channel* channel);
+    // Swaps in the archives the archiver thread has written since the last call
+    void collectArchives();
+    // Archiver thread: writes the archive of one raw segment
+    bool archive(IRCHistoryCodec& codec, ArchiveJob& job);
+    void trainDictionary(IRCHistoryCodec& codec, const uchar* data, qint64 size);
+
+    QString m_directory;
+    qint64 m_segmentBytes;
+    qint64 m_retentionBytes;
+    bool m_valid;
+    QHash<QString, Channel*> m_channels;
+    QList<Segment*> m_openSegments;     // Sealed and open, least recently read first
+    IRCHistoryCodec* m_codec;
+    qint64 m_decodedBytes;
+    qint64 m_decodeNsecs;
+
+    // Started with the first job; the queues are guarded by the mutex
+    QThread* m_archiver;
+    QMutex m_archiveMutex;
+    QWaitCondition m_archiveWake;
+    QList<ArchiveJob> m_archiveQueue;
+    QList<ArchiveJob> m_archived;
+    std::atomic<bool> m_stopping;
+};
+
+#endif // IRCHISTORYLOG_H
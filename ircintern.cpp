@@ -0,0 +1,141 @@
+#include "ircintern.h"
+#include "ircmessage.h"
+
+IRCName& IRCName::operator=(const IRCName& other)
+{
+    // Taken first, so assigning a handle to itself keeps the entry alive
+    if (other.d) {
+        ++other.d->refs;
+    }
+    if (d) {
+        release();
+    }
+    d = other.d;
+    return *this;
+}
+
+IRCName& IRCName::operator=(IRCName&& other) noexcept
+{
+    if (this != &other) {
+        if (d) {
+            release();
+        }
+        d = other.d;
+        other.d = nullptr;
+    }
+    return *this;
+}
+
+const QString& IRCName::toString() const
+{
+    static const QString empty;
+    return d ? d->text : empty;
+}
+
+const QByteArray& IRCName::utf8() const
+{
+    static const QByteArray empty;
+    return d ? d->utf8 : empty;
+}
+
+const QByteArray& IRCName::foldedUtf8() const
+{
+    static const QByteArray empty;
+    return d ? d->folded->utf8 : empty;
+}
+
+const QString& IRCName::foldedString() const
+{
+    static const QString empty;
+    return d ? d->folded->text : empty;
+}
+
+void IRCName::release()
+{
+    if (--d->refs == 0) {
+        d->table->remove(d);
+    }
+}
+
+IRCName IRCStringTable::intern(QByteArrayView utf8)
+{
+    if (IRCInternedString* entry = lookup(utf8)) {
+        return IRCName(entry);
+    }
+    return IRCName(insert(QString::fromUtf8(utf8), utf8.toByteArray()));
+}
+
+IRCName IRCStringTable::intern(const QString& text)
+{
+    QByteArray utf8 = text.toUtf8();
+    if (IRCInternedString* entry = lookup(utf8)) {
+        return IRCName(entry);
+    }
+    return IRCName(insert(text, utf8));
+}
+
+IRCName IRCStringTable::find(QByteArrayView utf8) const
+{
+    return IRCName(lookup(utf8));
+}
+
+IRCName IRCStringTable::findFolded(QByteArrayView utf8) const
+{
+    // Usually the name arrives spelled the way it was interned, and the
+    // lookup does not allocate; otherwise fold it and look again. Every
+    // entry keeps its folded entry interned, so that lookup is conclusive.
+    if (IRCInternedString* entry = lookup(utf8)) {
+        return IRCName(entry->folded);
+    }
+    return IRCName(lookup(IRCMessage::foldCase(utf8)));
+}
+
+qint64 IRCStringTable::memoryBytes() const
+{
+    qint64 bytes = m_entries.reservedBytes();
+    for (const IRCInternedString* entry : m_index) {
+        bytes += entry->text.capacity() * qint64(sizeof(QChar)) + entry->utf8.capacity();
+    }
+    return bytes;
+}
+
+IRCInternedString* IRCStringTable::lookup(QByteArrayView utf8) const
+{
+    // A raw-data key only borrows the bytes for the lookup
+    return m_index.value(QByteArray::fromRawData(utf8.data(), utf8.size()));
+}
+
+IRCInternedString* IRCStringTable::insert(const QString& text, const QByteArray& utf8)
+{
+    IRCInternedString* entry = m_entries.create();
+    entry->table = this;
+    entry->refs = 0;
+    entry->text = text;
+    entry->utf8 = utf8;
+    entry->folded = entry;
+    m_index.insert(entry->utf8, entry);
+
+    // Casemapping only touches ASCII, so the folded bytes are valid UTF-8 too
+    QByteArray folded = IRCMessage::foldCase(utf8);
+    if (folded != utf8) {
+        IRCInternedString* foldedEntry = lookup(folded);
+        if (!foldedEntry) {
+            foldedEntry = insert(QString::fromUtf8(folded), folded);
+        }
+        ++foldedEntry->refs;
+        entry->folded = foldedEntry;
+    }
+    return entry;
+}
+
+void IRCStringTable::remove(IRCInternedString* entry)
+{
+    m_index.remove(entry->utf8);
+    IRCInternedString* folded = entry->folded;
+    m_entries.destroy(entry);
+
+    // Entries whose casemapped form this was held it interned
+    if (folded != entry && --folded->refs == 0) {
+        remove(folded);
+    }
+}
@@ -0,0 +1,98 @@
+#ifndef IRCINTERN_H
+#define IRCINTERN_H
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QHash>
+#include <QString>
+#include "ircpool.h"
+
+class IRCStringTable;
+
+// One distinct string in an IRCStringTable, in both encodings
+struct IRCInternedString
+{
+    IRCStringTable* table;
+    IRCInternedString* folded;  // The casemapped form's entry, itself if already casemapped
+    quint32 refs;
+    QString text;
+    QByteArray utf8;
+};
+
+// Handle to an interned string. A table holds each distinct string once, so
+// two handles from the same table are equal exactly when their strings are,
+// and equal under IRC casemapping exactly when their folded entries are: both
+// are pointer compares. Copying a handle bumps a count, and the string leaves
+// the table with its last handle. A null handle stands for the empty string.
+// Handles belong to the thread of their table.
+class IRCName
+{
+public:
+    IRCName() : d(nullptr) {}
+    IRCName(const IRCName& other) : d(other.d) { if (d) ++d->refs; }
+    IRCName(IRCName&& other) noexcept : d(other.d) { other.d = nullptr; }
+    ~IRCName() { if (d) release(); }
+    IRCName& operator=(const IRCName& other);
+    IRCName& operator=(IRCName&& other) noexcept;
+
+    bool isNull() const { return !d; }
+    bool isEmpty() const { return !d || d->utf8.isEmpty(); }
+    const QString& toString() const;
+    const QByteArray& utf8() const;
+    // Casemapped form, see IRCMessage::foldCase
+    const QByteArray& foldedUtf8() const;
+    const QString& foldedString() const;
+    // Identifies the string up to casemapping, for hash keys; null for a null handle
+    const IRCInternedString* foldedKey() const { return d ? d->folded : nullptr; }
+
+    bool operator==(const IRCName& other) const { return d == other.d; }
+    bool operator!=(const IRCName& other) const { return d != other.d; }
+    // Equal under IRC casemapping
+    bool matches(const IRCName& other) const { return foldedKey() == other.foldedKey(); }
+
+private:
+    friend class IRCStringTable;
+
+    // Takes a new reference to entry
+    explicit IRCName(IRCInternedString* entry) : d(entry) { if (d) ++d->refs; }
+    void release();
+
+    IRCInternedString* d;
+};
+
+// Interns the names a server holds many copies of: nicks, usernames, hosts
+// and channel names. Each is stored once, with its UTF-8 form and a link to
+// its casemapped form, however many clients or memberships refer to it.
+// Entries come from a slab pool and are removed with their last handle.
+// Not thread-safe; every handle must be gone before the table is.
+class IRCStringTable
+{
+public:
+    IRCStringTable() = default;
+    Q_DISABLE_COPY(IRCStringTable)
+
+    IRCName intern(QByteArrayView utf8);
+    IRCName intern(const QString& text);
+
+    // Lookups that never add a string, so unknown names cost nothing to
+    // keep. find() matches exactly; findFolded() returns the casemapped
+    // entry of any interned string that matches under casemapping.
+    IRCName find(QByteArrayView utf8) const;
+    IRCName findFolded(QByteArrayView utf8) const;
+
+    qsizetype size() const { return m_index.size(); }
+    // Entry records plus the text they hold
+    qint64 memoryBytes() const;
+
+private:
+    friend class IRCName;
+
+    IRCInternedString* lookup(QByteArrayView utf8) const;
+    IRCInternedString* insert(const QString& text, const QByteArray& utf8);
+    void remove(IRCInternedString* entry);
+
+    QHash<QByteArray, IRCInternedString*> m_index;   // Keys share the entries' UTF-8
+    IRCSlabPool<IRCInternedString> m_entries;
+};
+
+#endif // IRCINTERN_H
@@ -0,0 +1,114 @@
+#include "irclinebuffer.h"
+#include <cstring>
+
+namespace {
+// Most connections only ever send short lines; start small and grow on demand.
+constexpr qsizetype InitialSize = 1024;
+}
+
+IRCLineBuffer::IRCLineBuffer(qsizetype maxLineLength, qsizetype capacity)
+    : m_head(0)
+    , m_scan(0)
+    , m_tail(0)
+    , m_maxLineLength(maxLineLength)
+    , m_capacity(qMax(capacity, maxLineLength + 2))
+    , m_discarding(false)
+{
+}
+
+void IRCLineBuffer::reserve()
+{
+    if (m_head == m_tail) {
+        m_head = m_scan = m_tail = 0;
+    }
+    if (m_tail < m_data.size()) {
+        return;
+    }
+
+    // Only the trailing partial line is left after draining, so this moves
+    // at most one line's worth of bytes.
+    if (m_head > 0) {
+        char* data = m_data.data();
+        std::memmove(data, data + m_head, m_tail - m_head);
+        m_scan -= m_head;
+        m_tail -= m_head;
+        m_head = 0;
+        if (m_tail < m_data.size()) {
+            return;
+        }
+    }
+
+    if (m_data.size() < m_capacity) {
+        m_data.resize(qMin(m_capacity, qMax(InitialSize, m_data.size() * 2)));
+    }
+}
+
+void IRCLineBuffer::squeeze()
+{
+    if (m_head == m_tail) {
+        m_data = QByteArray();
+        m_head = m_scan = m_tail = 0;
+    }
+}
+
+char* IRCLineBuffer::writePointer()
+{
+    reserve();
+    return m_data.data() + m_tail;
+}
+
+qsizetype IRCLineBuffer::writableBytes() const
+{
+    return m_data.size() - m_tail;
+}
+
+void IRCLineBuffer::commit(qsizetype bytes)
+{
+    m_tail = qMin(m_tail + bytes, m_data.size());
+}
+
+IRCLineBuffer::Status IRCLineBuffer::nextLine(QByteArrayView& line)
+{
+    const char* data = m_data.constData();
+
+    while (m_scan < m_tail) {
+        const void* newline = std::memchr(data + m_scan, '\n', m_tail - m_scan);
+        if (!newline) {
+            m_scan = m_tail;
+            break;
+        }
+
+        const qsizetype start = m_head;
+        const qsizetype end = static_cast<const char*>(newline) - data;
+        m_head = m_scan = end + 1;
+
+        if (m_discarding) {
+            // Tail of a line we already reported as too long
+            m_discarding = false;
+            continue;
+        }
+
+        qsizetype length = end - start;
+        if (length > 0 && data[start + length - 1] == '\r') {
+            --length;
+        }
+        if (length > m_maxLineLength) {
+            return Overflow;
+        }
+
+        line = QByteArrayView(data + start, length);
+        return Line;
+    }
+
+    // No line end buffered. Bound what a client that never sends one can make
+    // us hold: drop the partial line once it can no longer be valid.
+    const qsizetype pending = m_tail - m_head;
+    if (m_discarding) {
+        m_head = m_scan = m_tail;
+    } else if (pending > m_maxLineLength + 1) {
+        m_discarding = true;
+        m_head = m_scan = m_tail;
+        return Overflow;
+    }
+    return NeedMore;
+}
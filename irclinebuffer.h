@@ -0,0 +1,60 @@
+#ifndef IRCLINEBUFFER_H
+#define IRCLINEBUFFER_H
+
+#include <QByteArray>
+#include <QByteArrayView>
+
+// Byte-level receive buffer that frames CR/LF terminated IRC lines.
+//
+// Socket data is read straight into the buffer and complete lines are handed
+// out as views into it, so nothing is copied or decoded until a handler needs
+// the text. Each byte is scanned for a line end exactly once. Consumed bytes
+// are dropped by moving only the trailing partial line to the front, and the
+// storage never grows beyond the configured capacity.
+class IRCLineBuffer
+{
+public:
+    enum Status {
+        Line,       // a complete line was returned
+        NeedMore,   // no complete line buffered yet
+        Overflow    // a line exceeded the maximum length and was discarded
+    };
+
+    static constexpr qsizetype DefaultMaxLineLength = 4096;
+    static constexpr qsizetype DefaultCapacity = 16384;
+
+    explicit IRCLineBuffer(qsizetype maxLineLength = DefaultMaxLineLength,
+                           qsizetype capacity = DefaultCapacity);
+
+    // Space to read into; call commit() with the number of bytes written.
+    char* writePointer();
+    qsizetype writableBytes() const;
+    void commit(qsizetype bytes);
+
+    // Returns the next line without its CR/LF terminator. The view stays valid
+    // until the next call to writePointer().
+    Status nextLine(QByteArrayView& line);
+
+    // Frees the storage if nothing is buffered, for connections that sit idle
+    // between reads; the next writePointer() allocates it again
+    void squeeze();
+
+    qsizetype bufferedBytes() const { return m_tail - m_head; }
+    qsizetype maxLineLength() const { return m_maxLineLength; }
+    qsizetype capacity() const { return m_capacity; }
+    // Storage currently allocated, 0 after squeeze()
+    qsizetype allocatedBytes() const { return m_data.capacity(); }
+
+private:
+    void reserve();
+
+    QByteArray m_data;
+    qsizetype m_head;       // first unconsumed byte
+    qsizetype m_scan;       // first byte not yet searched for '\n'
+    qsizetype m_tail;       // end of valid data
+    qsizetype m_maxLineLength;
+    qsizetype m_capacity;
+    bool m_discarding;      // dropping the rest of an oversized line
+};
+
+#endif // IRCLINEBUFFER_H
@@ -0,0 +1,361 @@
+#include "irclog.h"
+#include <QDateTime>
+#include <QDebug>
+#include <QList>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThread>
+#include <QWaitCondition>
+
+std::atomic<int> IRCLog::s_levels[IRCLog::ComponentCount] = {
+    {IRCLog::Info}, {IRCLog::Info}, {IRCLog::Info}, {IRCLog::Info}, {IRCLog::Info}
+};
+
+namespace {
+const char* const LevelNames[] = {"trace", "debug", "info", "warning", "error", "off"};
+const char* const ComponentNames[] = {"server", "client", "channel", "bridge", "history"};
+
+// How often the writer thread wakes up to drain the rings
+constexpr int FlushIntervalMs = 50;
+
+struct Record
+{
+    qint64 time;
+    IRCLog::Level level;
+    IRCLog::Component component;
+    const char* event;
+    QString fields;
+};
+
+// Single-producer / single-consumer ring: the owning thread writes, the
+// writer thread reads
+struct Ring
+{
+    static constexpr quint32 Capacity = 1024;    // A power of two
+
+    Record records[Capacity];
+    std::atomic<quint32> head { 0 };      // Next slot the owner fills
+    std::atomic<quint32> tail { 0 };      // Next slot the writer empties
+    std::atomic<quint64> dropped { 0 };
+    std::atomic<bool> closed { false };   // The owning thread exited
+};
+
+// Per component, the one-second window rate limits are counted in
+struct RateWindow
+{
+    std::atomic<int> limit { 0 };
+    std::atomic<qint64> second { 0 };
+    std::atomic<int> count { 0 };
+    std::atomic<quint64> suppressed { 0 };
+};
+
+struct Registry
+{
+    QMutex mutex;
+    QWaitCondition wake;
+    QList<Ring*> rings;
+    QThread* writer = nullptr;
+    // Written under the mutex, read without it on every log call
+    std::atomic<bool> running { false };
+};
+
+Registry& registry()
+{
+    static Registry instance;
+    return instance;
+}
+
+RateWindow s_rates[IRCLog::ComponentCount];
+
+// Marks the thread's ring closed on thread exit; the writer deletes it once drained
+struct RingOwner
+{
+    Ring* ring = nullptr;
+    ~RingOwner()
+    {
+        if (ring) {
+            ring->closed.store(true, std::memory_order_release);
+        }
+    }
+};
+
+thread_local RingOwner t_ring;
+
+Ring* threadRing()
+{
+    if (!t_ring.ring) {
+        Ring* ring = new Ring;
+        QMutexLocker locker(&registry().mutex);
+        registry().rings.append(ring);
+        t_ring.ring = ring;
+    }
+    return t_ring.ring;
+}
+
+void emitLine(IRCLog::Level level, const QString& line)
+{
+    if (level >= IRCLog::Warning) {
+        qWarning().noquote() << line;
+    } else if (level == IRCLog::Info) {
+        qInfo().noquote() << line;
+    } else {
+        qDebug().noquote() << line;
+    }
+}
+
+void emitRecord(const Record& record)
+{
+    QString line = QString("ts=%1 level=%2 component=%3 event=%4")
+        .arg(QDateTime::fromMSecsSinceEpoch(record.time).toUTC().toString(Qt::ISODateWithMs),
+             QLatin1String(LevelNames[record.level]),
+             QLatin1String(ComponentNames[record.component]),
+             QLatin1String(record.event));
+    if (!record.fields.isEmpty()) {
+        line += ' ';
+        line += record.fields;
+    }
+    emitLine(record.level, line);
+}
+
+// Called from the writer thread, or from stop() once it has exited, so
+// there is one consumer at a time. The registry is only locked to copy the
+// ring list and to drop closed rings; a thread registering its first ring
+// never waits for records to be formatted and emitted.
+void drainRings()
+{
+    Registry& reg = registry();
+    QList<Ring*> rings;
+    {
+        QMutexLocker locker(&reg.mutex);
+        rings = reg.rings;
+    }
+
+    QList<Ring*> finished;
+    for (Ring* ring : std::as_const(rings)) {
+        bool closed = ring->closed.load(std::memory_order_acquire);
+
+        quint32 tail = ring->tail.load(std::memory_order_relaxed);
+        quint32 head = ring->head.load(std::memory_order_acquire);
+        for (; tail != head; ++tail) {
+            Record& record = ring->records[tail & (Ring::Capacity - 1)];
+            emitRecord(record);
+            record.fields.clear();
+        }
+        ring->tail.store(tail, std::memory_order_release);
+
+        if (quint64 dropped = ring->dropped.exchange(0, std::memory_order_relaxed)) {
+            emitLine(IRCLog::Warning, QString("level=warning component=log event=dropped records=%1").arg(dropped));
+        }
+
+        if (closed) {
+            finished.append(ring);
+        }
+    }
+
+    if (!finished.isEmpty()) {
+        {
+            QMutexLocker locker(&reg.mutex);
+            reg.rings.removeIf([&finished](Ring* ring) { return finished.contains(ring); });
+        }
+        qDeleteAll(finished);
+    }
+
+    for (int component = 0; component < IRCLog::ComponentCount; ++component) {
+        if (quint64 suppressed = s_rates[component].suppressed.exchange(0, std::memory_order_relaxed)) {
+            emitLine(IRCLog::Warning, QString("level=warning component=%1 event=rate_limited records=%2")
+                .arg(QLatin1String(ComponentNames[component])).arg(suppressed));
+        }
+    }
+}
+
+bool allowedByRate(IRCLog::Component component, qint64 now)
+{
+    RateWindow& window = s_rates[component];
+    int limit = window.limit.load(std::memory_order_relaxed);
+    if (limit <= 0) {
+        return true;
+    }
+
+    // Approximate under contention, which is fine for a log limit
+    qint64 second = now / 1000;
+    if (window.second.exchange(second, std::memory_order_relaxed) != second) {
+        window.count.store(0, std::memory_order_relaxed);
+    }
+    if (window.count.fetch_add(1, std::memory_order_relaxed) < limit) {
+        return true;
+    }
+    window.suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+}
+
+void IRCLog::start()
+{
+    Registry& reg = registry();
+    QMutexLocker locker(&reg.mutex);
+    if (reg.running.load(std::memory_order_relaxed)) {
+        return;
+    }
+
+    QString spec = qEnvironmentVariable("LOGOS_IRC_LOG");
+    if (!spec.isEmpty() && !setLevels(spec)) {
+        qWarning() << "IRCLog: invalid LOGOS_IRC_LOG" << spec;
+    }
+
+    reg.running.store(true, std::memory_order_release);
+    reg.writer = QThread::create([&reg]() {
+        while (reg.running.load(std::memory_order_acquire)) {
+            {
+                QMutexLocker locker(&reg.mutex);
+                if (reg.running.load(std::memory_order_relaxed)) {
+                    reg.wake.wait(&reg.mutex, FlushIntervalMs);
+                }
+            }
+            drainRings();
+        }
+    });
+    reg.writer->setObjectName("irc-log");
+    reg.writer->start();
+}
+
+void IRCLog::stop()
+{
+    Registry& reg = registry();
+    {
+        QMutexLocker locker(&reg.mutex);
+        if (!reg.running.load(std::memory_order_relaxed)) {
+            return;
+        }
+        reg.running.store(false, std::memory_order_release);
+        reg.wake.wakeAll();
+    }
+    reg.writer->wait();
+    delete reg.writer;
+    reg.writer = nullptr;
+
+    // Whatever was logged after the last pass
+    drainRings();
+}
+
+void IRCLog::setLevel(Component component, Level level)
+{
+    s_levels[component].store(level, std::memory_order_relaxed);
+}
+
+bool IRCLog::setLevels(const QString& spec)
+{
+    auto parseLevel = [](const QString& name, Level& level) {
+        for (int i = Trace; i <= Off; ++i) {
+            if (name.compare(QLatin1String(LevelNames[i]), Qt::CaseInsensitive) == 0) {
+                level = Level(i);
+                return true;
+            }
+        }
+        return false;
+    };
+    // "level" or "level/N"; rate is -1 without the limit
+    auto parseSetting = [&parseLevel](const QString& text, Level& level, int& rate) {
+        qsizetype slash = text.indexOf('/');
+        rate = -1;
+        if (slash >= 0) {
+            bool ok = false;
+            rate = text.mid(slash + 1).trimmed().toInt(&ok);
+            if (!ok || rate < 0) {
+                return false;
+            }
+        }
+        return parseLevel(text.left(slash).trimmed(), level);
+    };
+    auto apply = [](Component component, Level level, int rate) {
+        setLevel(component, level);
+        if (rate >= 0) {
+            setRateLimit(component, rate);
+        }
+    };
+
+    bool ok = true;
+    const QStringList parts = spec.split(',', Qt::SkipEmptyParts);
+    for (const QString& part : parts) {
+        QString item = part.trimmed();
+        qsizetype equals = item.indexOf('=');
+        Level level;
+        int rate;
+
+        if (equals < 0) {
+            // A bare level applies to every component
+            if (!parseSetting(item, level, rate)) {
+                ok = false;
+                continue;
+            }
+            for (int component = 0; component < ComponentCount; ++component) {
+                apply(Component(component), level, rate);
+            }
+            continue;
+        }
+
+        QString name = item.left(equals).trimmed();
+        int component = 0;
+        while (component < ComponentCount && name.compare(QLatin1String(ComponentNames[component]), Qt::CaseInsensitive) != 0) {
+            ++component;
+        }
+        if (component == ComponentCount || !parseSetting(item.mid(equals + 1).trimmed(), level, rate)) {
+            ok = false;
+            continue;
+        }
+        apply(Component(component), level, rate);
+    }
+    return ok;
+}
+
+void IRCLog::setRateLimit(Component component, int perSecond)
+{
+    s_rates[component].limit.store(qMax(0, perSecond), std::memory_order_relaxed);
+}
+
+void IRCLog::write(Level level, Component component, const char* event, QString&& fields)
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    if (level < Warning && !allowedByRate(component, now)) {
+        return;
+    }
+
+    Registry& reg = registry();
+    if (!reg.running.load(std::memory_order_acquire)) {
+        emitRecord(Record{now, level, component, event, std::move(fields)});
+        return;
+    }
+
+    Ring* ring = threadRing();
+    quint32 head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) >= Ring::Capacity) {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    Record& record = ring->records[head & (Ring::Capacity - 1)];
+    record.time = now;
+    record.level = level;
+    record.component = component;
+    record.event = event;
+    record.fields = std::move(fields);
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+QString IRCLog::quoted(QStringView value)
+{
+    if (!value.isEmpty() && !value.contains(' ') && !value.contains('"') && !value.contains('=')) {
+        return value.toString();
+    }
+
+    QString result;
+    result.reserve(value.size() + 2);
+    result += '"';
+    for (QChar c : value) {
+        if (c == '"' || c == '\\') {
+            result += '\\';
+        }
+        result += c;
+    }
+    result += '"';
+    return result;
+}
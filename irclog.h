@@ -0,0 +1,90 @@
+#ifndef IRCLOG_H
+#define IRCLOG_H
+
+#include <QString>
+#include <QStringView>
+#include <atomic>
+
+// Levels below this are compiled out entirely, e.g. -DIRC_LOG_MIN_LEVEL=2
+// keeps Info and above (see IRCLog::Level)
+#ifndef IRC_LOG_MIN_LEVEL
+#define IRC_LOG_MIN_LEVEL 0
+#endif
+
+// Structured logging for the per-message paths. Records are logfmt-style
+// "event key=value ..." lines tagged with a level and a component.
+//
+// A disabled record costs one relaxed atomic load; its fields are never
+// formatted. Enabled records go into a lock-free ring owned by the calling
+// thread and are written out by a background thread, so logging never
+// blocks traffic. A full ring drops records and reports how many.
+//
+// Levels are set per component at runtime, e.g. from the LOGOS_IRC_LOG
+// environment variable: "info,server=debug,bridge=trace". Components can
+// also be rate limited, which suppresses Trace to Info records beyond a
+// number per second: "bridge=trace/200" keeps 200 a second, "/0" lifts the
+// limit.
+class IRCLog
+{
+public:
+    enum Level {
+        Trace,
+        Debug,
+        Info,
+        Warning,
+        Error,
+        Off
+    };
+
+    enum Component {
+        Server,
+        Client,
+        Channel,
+        Bridge,
+        History,
+        ComponentCount
+    };
+
+    // Starts the writer thread and applies LOGOS_IRC_LOG. Until then records
+    // are written synchronously.
+    static void start();
+    // Writes out what is pending and stops the writer thread
+    static void stop();
+
+    static void setLevel(Component component, Level level);
+    static Level level(Component component) { return Level(s_levels[component].load(std::memory_order_relaxed)); }
+    // Applies a spec like "warning,server=debug,bridge=trace/200"; false if
+    // it has errors. Rate limits not given are left as they are.
+    static bool setLevels(const QString& spec);
+    // Records per second for the component, 0 for no limit
+    static void setRateLimit(Component component, int perSecond);
+
+    static bool isEnabled(Level level, Component component)
+    {
+        return level >= s_levels[component].load(std::memory_order_relaxed);
+    }
+
+    // Use the IRC_LOG macros, which skip formatting fields for disabled levels
+    static void write(Level level, Component component, const char* event, QString&& fields);
+
+    // Quotes a value for a key=value field if it has spaces or quotes
+    static QString quoted(QStringView value);
+
+private:
+    static std::atomic<int> s_levels[ComponentCount];
+};
+
+#define IRC_LOG(level, component, event, fields) \
+    do { \
+        if (IRCLog::level >= IRC_LOG_MIN_LEVEL && IRCLog::isEnabled(IRCLog::level, IRCLog::component)) { \
+            IRCLog::write(IRCLog::level, IRCLog::component, event, fields); \
+        } \
+    } while (false)
+
+#define IRC_TRACE(component, event, fields) IRC_LOG(Trace, component, event, fields)
+#define IRC_DEBUG(component, event, fields) IRC_LOG(Debug, component, event, fields)
+#define IRC_INFO(component, event, fields) IRC_LOG(Info, component, event, fields)
+#define IRC_WARNING(component, event, fields) IRC_LOG(Warning, component, event, fields)
+#define IRC_ERROR(component, event, fields) IRC_LOG(Error, component, event, fields)
+
+#endif // IRCLOG_H
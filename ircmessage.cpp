@@ -0,0 +1,263 @@
+#include "ircmessage.h"
+#include <cstring>
+
+namespace {
+// Longest command name that still fits the packed representation
+constexpr int MaxPackedCommand = 8;
+
+constexpr quint64 packCommand(const char* name)
+{
+    quint64 code = 0;
+    for (int i = 0; name[i] != '\0' && i < MaxPackedCommand; ++i) {
+        code = (code << 8) | quint8(name[i]);
+    }
+    return code;
+}
+
+const char* skipSpaces(const char* p, const char* end)
+{
+    while (p < end && *p == ' ') {
+        ++p;
+    }
+    return p;
+}
+
+const char* findSpace(const char* p, const char* end)
+{
+    if (p == end) {
+        return end;
+    }
+    const char* space = static_cast<const char*>(std::memchr(p, ' ', end - p));
+    return space ? space : end;
+}
+}
+
+bool IRCMessage::parse(QByteArrayView line, IRCParsedMessage& message)
+{
+    const char* p = line.data();
+    const char* end = p + line.size();
+    message.tags = QByteArrayView();
+    message.prefix = QByteArrayView();
+    message.paramCount = 0;
+
+    p = skipSpaces(p, end);
+    if (p < end && *p == '@') {
+        const char* tagsEnd = findSpace(p, end);
+        message.tags = QByteArrayView(p + 1, tagsEnd - p - 1);
+        p = skipSpaces(tagsEnd, end);
+    }
+    if (p < end && *p == ':') {
+        const char* prefixEnd = findSpace(p, end);
+        message.prefix = QByteArrayView(p + 1, prefixEnd - p - 1);
+        p = skipSpaces(prefixEnd, end);
+    }
+
+    const char* commandEnd = findSpace(p, end);
+    message.command = QByteArrayView(p, commandEnd - p);
+    if (message.command.isEmpty()) {
+        return false;
+    }
+    p = commandEnd;
+
+    while (true) {
+        p = skipSpaces(p, end);
+        if (p == end) {
+            break;
+        }
+        // A ':' starts the trailing parameter, which runs to the end of the
+        // line and may contain spaces; so does the last one the RFC allows
+        if (*p == ':' || message.paramCount == IRCParsedMessage::MaxParams - 1) {
+            if (*p == ':') {
+                ++p;
+            }
+            message.params[message.paramCount++] = QByteArrayView(p, end - p);
+            break;
+        }
+        const char* paramEnd = findSpace(p, end);
+        message.params[message.paramCount++] = QByteArrayView(p, paramEnd - p);
+        p = paramEnd;
+    }
+    return true;
+}
+
+IRCMessage::Command IRCMessage::command(QByteArrayView name)
+{
+    if (name.isEmpty()) {
+        return Unknown;
+    }
+    if (name.size() > MaxPackedCommand) {
+        // The few longer names are compared directly
+        if (qstrnicmp(name.data(), name.size(), "CHATHISTORY") == 0) {
+            return ChatHistory;
+        }
+        return Unknown;
+    }
+
+    quint64 code = 0;
+    for (char c : name) {
+        if (c >= 'a' && c <= 'z') {
+            c -= 'a' - 'A';
+        }
+        code = (code << 8) | quint8(c);
+    }
+
+    switch (code) {
+    case packCommand("NICK"):    return Nick;
+    case packCommand("USER"):    return User;
+    case packCommand("PING"):    return Ping;
+    case packCommand("JOIN"):    return Join;
+    case packCommand("PART"):    return Part;
+    case packCommand("PRIVMSG"): return Privmsg;
+    case packCommand("NOTICE"):  return Notice;
+    case packCommand("WHO"):     return Who;
+    case packCommand("MODE"):    return Mode;
+    case packCommand("MOTD"):    return Motd;
+    case packCommand("QUIT"):    return Quit;
+    case packCommand("CAP"):     return Cap;
+    case packCommand("OPER"):    return Oper;
+    case packCommand("STATS"):   return Stats;
+    case packCommand("PONG"):    return Pong;
+    default:                     return Unknown;
+    }
+}
+
+const char* IRCMessage::commandName(Command command)
+{
+    // Indexed by Command
+    static const char* const names[CommandCount] = {
+        "UNKNOWN", "NICK", "USER", "PING", "JOIN", "PART", "PRIVMSG", "NOTICE",
+        "WHO", "MODE", "MOTD", "QUIT", "CAP", "CHATHISTORY", "OPER", "STATS",
+        "PONG"
+    };
+    return names[command];
+}
+
+QByteArray IRCMessage::foldCase(QByteArrayView name)
+{
+    QByteArray folded(name.data(), name.size());
+    for (char& c : folded) {
+        // 'A'..'^' covers A-Z followed by [\]^
+        if (c >= 'A' && c <= '^') {
+            c += 'a' - 'A';
+        }
+    }
+    return folded;
+}
+
+QString IRCMessage::stripLineBreaks(const QString& text)
+{
+    auto isBreak = [](QChar c) {
+        return c == QLatin1Char('\r') || c == QLatin1Char('\n') || c.unicode() == 0;
+    };
+
+    // Most text is clean and is returned without a copy
+    qsizetype i = 0;
+    while (i < text.size() && !isBreak(text[i])) {
+        ++i;
+    }
+    if (i == text.size()) {
+        return text;
+    }
+
+    QString clean = text;
+    for (; i < clean.size(); ++i) {
+        if (isBreak(clean[i])) {
+            clean[i] = QLatin1Char(' ');
+        }
+    }
+    return clean;
+}
+
+QByteArray IRCMessage::format(const QString& prefix, const QString& command, const QString& params)
+{
+    QByteArray line;
+    line.reserve((prefix.size() + command.size() + params.size()) * 3 + 6);
+    if (!prefix.isEmpty()) {
+        line += ':';
+        line += prefix.toUtf8();
+        line += ' ';
+    }
+    line += command.toUtf8();
+    if (!params.isEmpty()) {
+        line += ' ';
+        line += params.toUtf8();
+    }
+    line += "\r\n";
+    return line;
+}
+
+QByteArray IRCMessage::format(const QString& line)
+{
+    QByteArray encoded = line.toUtf8();
+    encoded += "\r\n";
+    return encoded;
+}
+
+QByteArray IRCMessage::format(QByteArrayView prefix, QByteArrayView command, QByteArrayView target, QByteArrayView trailing)
+{
+    QByteArray line;
+    line.reserve(prefix.size() + command.size() + target.size() + trailing.size() + 7);
+    if (!prefix.isEmpty()) {
+        line += ':';
+        line.append(prefix);
+        line += ' ';
+    }
+    line.append(command);
+    if (!target.isEmpty()) {
+        line += ' ';
+        line.append(target);
+    }
+    line += " :";
+    line.append(trailing);
+    line += "\r\n";
+    return line;
+}
+
+IRCReplyTemplate::IRCReplyTemplate()
+{
+}
+
+void IRCReplyTemplate::addLine(QByteArrayView prefix, QByteArrayView command, QByteArrayView params)
+{
+    m_text += ':';
+    m_text.append(prefix);
+    m_text += ' ';
+    m_text.append(command);
+    m_text += ' ';
+    m_slots.append(m_text.size());
+    if (!params.isEmpty()) {
+        m_text += ' ';
+        m_text.append(params);
+    }
+    m_text += "\r\n";
+}
+
+void IRCReplyTemplate::append(const IRCReplyTemplate& other)
+{
+    const qsizetype offset = m_text.size();
+    m_text += other.m_text;
+    for (qsizetype slot : other.m_slots) {
+        m_slots.append(offset + slot);
+    }
+}
+
+void IRCReplyTemplate::clear()
+{
+    m_text.clear();
+    m_slots.clear();
+}
+
+QByteArray IRCReplyTemplate::render(QByteArrayView nick) const
+{
+    QByteArray rendered;
+    rendered.reserve(m_text.size() + m_slots.size() * nick.size());
+
+    qsizetype from = 0;
+    for (qsizetype slot : m_slots) {
+        rendered.append(m_text.constData() + from, slot - from);
+        rendered.append(nick);
+        from = slot;
+    }
+    rendered.append(m_text.constData() + from, m_text.size() - from);
+    return rendered;
+}
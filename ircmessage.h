@@ -0,0 +1,101 @@
+#ifndef IRCMESSAGE_H
+#define IRCMESSAGE_H
+
+#include <QByteArray>
+#include <QByteArrayView>
+#include <QList>
+#include <QString>
+
+// A received line split into its parts. Every field is a view into the line
+// that was parsed, so it is only valid for as long as that buffer is.
+struct IRCParsedMessage
+{
+    // RFC 1459: at most 14 middle parameters plus the trailing one
+    static constexpr int MaxParams = 15;
+
+    QByteArrayView tags;        // IRCv3 message tags, without the leading '@'
+    QByteArrayView prefix;      // without the leading ':'
+    QByteArrayView command;
+    QByteArrayView params[MaxParams];
+    int paramCount = 0;
+
+    QByteArrayView param(int index) const { return index < paramCount ? params[index] : QByteArrayView(); }
+};
+
+class IRCMessage
+{
+public:
+    // Commands the server dispatches on; anything else maps to Unknown
+    enum Command {
+        Unknown,
+        Nick,
+        User,
+        Ping,
+        Join,
+        Part,
+        Privmsg,
+        Notice,
+        Who,
+        Mode,
+        Motd,
+        Quit,
+        Cap,
+        ChatHistory,
+        Oper,
+        Stats,
+        Pong,
+        CommandCount
+    };
+
+    // Splits "[@tags] [:prefix] COMMAND [params] [:trailing]" without copying
+    // or decoding anything. Returns false if the line has no command.
+    static bool parse(QByteArrayView line, IRCParsedMessage& message);
+
+    // Case-insensitive command lookup, a switch on the name packed into an integer
+    static Command command(QByteArrayView name);
+    // Upper case name of a known command, "UNKNOWN" for Unknown
+    static const char* commandName(Command command);
+
+    // Folds a nick with rfc1459 casemapping (A-Z and []\^ to a-z and {}|~), so
+    // names that differ only in case compare equal
+    static QByteArray foldCase(QByteArrayView name);
+
+    // Replaces CR, LF and NUL with spaces, so text from outside IRC cannot
+    // end a line early and smuggle in one of its own
+    static QString stripLineBreaks(const QString& text);
+
+    // Serializes ":prefix COMMAND params\r\n" to UTF-8 in a single buffer.
+    // The result is implicitly shared, so one formatted line can be queued on
+    // any number of sockets without being rebuilt or re-encoded.
+    static QByteArray format(const QString& prefix, const QString& command, const QString& params = QString());
+
+    // Serializes an already composed line and appends the terminator
+    static QByteArray format(const QString& line);
+
+    // Serializes ":prefix COMMAND target :trailing\r\n" from bytes that are
+    // already UTF-8, e.g. parameters taken straight from a parsed message
+    static QByteArray format(QByteArrayView prefix, QByteArrayView command, QByteArrayView target, QByteArrayView trailing);
+};
+
+// A run of numeric replies rendered once, with a slot for the recipient's
+// nick in every line. Rendering copies the static text and patches in the
+// nick, giving the whole run as one buffer for a single write.
+class IRCReplyTemplate
+{
+public:
+    IRCReplyTemplate();
+
+    // Appends ":prefix command <nick> params\r\n"
+    void addLine(QByteArrayView prefix, QByteArrayView command, QByteArrayView params);
+    void append(const IRCReplyTemplate& other);
+    void clear();
+    bool isEmpty() const { return m_text.isEmpty(); }
+
+    QByteArray render(QByteArrayView nick) const;
+
+private:
+    QByteArray m_text;
+    QList<qsizetype> m_slots;   // Offsets in m_text where the nick goes
+};
+
+#endif // IRCMESSAGE_H
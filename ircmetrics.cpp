@@ -0,0 +1,170 @@
+#include "ircmetrics.h"
+#include <QMutexLocker>
+#include <QtAlgorithms>
+#include <chrono>
+
+IRCHistogram::IRCHistogram()
+    : m_count(0)
+    , m_sum(0)
+    , m_max(0)
+{
+    for (std::atomic<quint64>& bucket : m_buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+}
+
+int IRCHistogram::bucketIndex(quint64 value)
+{
+    if (value < SubBuckets) {
+        return int(value);
+    }
+    int exponent = 63 - qCountLeadingZeroBits(value);
+    if (exponent > MaxExponent) {
+        return BucketCount - 1;
+    }
+    // The bits right below the leading one pick the sub-bucket
+    int sub = int(value >> (exponent - SubBucketBits)) & (SubBuckets - 1);
+    return SubBuckets + (exponent - SubBucketBits) * SubBuckets + sub;
+}
+
+quint64 IRCHistogram::bucketLimit(int index)
+{
+    if (index < SubBuckets) {
+        return quint64(index);
+    }
+    int shift = (index - SubBuckets) / SubBuckets;
+    quint64 sub = quint64((index - SubBuckets) % SubBuckets);
+    return ((SubBuckets + sub + 1) << shift) - 1;
+}
+
+void IRCHistogram::record(quint64 value)
+{
+    m_buckets[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+
+    quint64 max = m_max.load(std::memory_order_relaxed);
+    while (value > max && !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+quint64 IRCHistogram::percentile(double fraction) const
+{
+    // Read while writers keep recording; the total is taken from the
+    // buckets themselves so the walk always ends inside them
+    quint64 counts[BucketCount];
+    quint64 total = 0;
+    for (int i = 0; i < BucketCount; ++i) {
+        counts[i] = m_buckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    quint64 rank = qMax<quint64>(1, quint64(fraction * double(total) + 0.5));
+    quint64 seen = 0;
+    for (int i = 0; i < BucketCount; ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return qMin(bucketLimit(i), max());
+        }
+    }
+    return max();
+}
+
+QJsonObject IRCHistogram::toJson() const
+{
+    quint64 n = count();
+    QJsonObject json;
+    json["count"] = qint64(n);
+    json["mean"] = n > 0 ? double(sum()) / double(n) : 0.0;
+    json["p50"] = qint64(percentile(0.50));
+    json["p90"] = qint64(percentile(0.90));
+    json["p99"] = qint64(percentile(0.99));
+    json["max"] = qint64(max());
+    return json;
+}
+
+IRCMetrics::IRCMetrics()
+{
+}
+
+IRCMetrics::~IRCMetrics()
+{
+    qDeleteAll(m_counters);
+    qDeleteAll(m_histograms);
+}
+
+IRCCounter* IRCMetrics::counter(const QString& name)
+{
+    QMutexLocker locker(&m_mutex);
+    IRCCounter*& counter = m_counters[name];
+    if (!counter) {
+        counter = new IRCCounter;
+    }
+    return counter;
+}
+
+IRCHistogram* IRCMetrics::histogram(const QString& name)
+{
+    QMutexLocker locker(&m_mutex);
+    IRCHistogram*& histogram = m_histograms[name];
+    if (!histogram) {
+        histogram = new IRCHistogram;
+    }
+    return histogram;
+}
+
+QJsonObject IRCMetrics::toJson() const
+{
+    QMutexLocker locker(&m_mutex);
+
+    QJsonObject counters;
+    for (auto it = m_counters.cbegin(); it != m_counters.cend(); ++it) {
+        counters[it.key()] = qint64(it.value()->value());
+    }
+    QJsonObject histograms;
+    for (auto it = m_histograms.cbegin(); it != m_histograms.cend(); ++it) {
+        histograms[it.key()] = it.value()->toJson();
+    }
+
+    QJsonObject json;
+    json["counters"] = counters;
+    json["histograms"] = histograms;
+    return json;
+}
+
+QList<QByteArray> IRCMetrics::report(qint64 uptimeSecs) const
+{
+    QMutexLocker locker(&m_mutex);
+
+    QList<QByteArray> lines;
+    lines.reserve(m_counters.size() + m_histograms.size());
+    for (auto it = m_counters.cbegin(); it != m_counters.cend(); ++it) {
+        quint64 value = it.value()->value();
+        QByteArray line = it.key().toUtf8() + ' ' + QByteArray::number(value);
+        if (uptimeSecs > 0) {
+            line += " (" + QByteArray::number(double(value) / double(uptimeSecs), 'f', 2) + "/s)";
+        }
+        lines.append(line);
+    }
+    for (auto it = m_histograms.cbegin(); it != m_histograms.cend(); ++it) {
+        const IRCHistogram* histogram = it.value();
+        if (histogram->count() == 0) {
+            continue;
+        }
+        lines.append(it.key().toUtf8()
+                     + " count=" + QByteArray::number(histogram->count())
+                     + " p50=" + QByteArray::number(histogram->percentile(0.50))
+                     + " p90=" + QByteArray::number(histogram->percentile(0.90))
+                     + " p99=" + QByteArray::number(histogram->percentile(0.99))
+                     + " max=" + QByteArray::number(histogram->max()));
+    }
+    return lines;
+}
+
+qint64 IRCMetrics::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
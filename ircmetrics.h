@@ -0,0 +1,89 @@
+#ifndef IRCMETRICS_H
+#define IRCMETRICS_H
+
+#include <QByteArray>
+#include <QJsonObject>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QString>
+#include <atomic>
+
+// Monotonic counter, safe to bump from any thread
+class IRCCounter
+{
+public:
+    void add(quint64 n = 1) { m_value.fetch_add(n, std::memory_order_relaxed); }
+    quint64 value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<quint64> m_value { 0 };
+};
+
+// Log-linear histogram in the style of HdrHistogram: values below 16 get
+// a bucket each, larger ones 16 buckets per power of two, so every reading
+// is within 1/16 (about 6%) of the recorded value. Values past 2^41 share
+// the last bucket. Recording is a few relaxed atomic adds from any thread.
+class IRCHistogram
+{
+public:
+    IRCHistogram();
+
+    void record(quint64 value);
+
+    quint64 count() const { return m_count.load(std::memory_order_relaxed); }
+    quint64 sum() const { return m_sum.load(std::memory_order_relaxed); }
+    quint64 max() const { return m_max.load(std::memory_order_relaxed); }
+    // Upper bound of the bucket holding the given fraction (0..1) of values
+    quint64 percentile(double fraction) const;
+
+    // count, mean, p50, p90, p99 and max
+    QJsonObject toJson() const;
+
+private:
+    static constexpr int SubBucketBits = 4;
+    static constexpr int SubBuckets = 1 << SubBucketBits;
+    static constexpr int MaxExponent = 40;
+    static constexpr int BucketCount = SubBuckets + (MaxExponent - SubBucketBits + 1) * SubBuckets;
+
+    static int bucketIndex(quint64 value);
+    static quint64 bucketLimit(int index);
+
+    std::atomic<quint64> m_buckets[BucketCount];
+    std::atomic<quint64> m_count;
+    std::atomic<quint64> m_sum;
+    std::atomic<quint64> m_max;
+};
+
+// Named counters and histograms for capacity planning. Metrics are created
+// on first lookup and live as long as the registry; callers look them up
+// once and keep the pointer, so the hot paths never touch the registry.
+//
+// By convention latency histograms end in "_ns" and record nanoseconds.
+class IRCMetrics
+{
+public:
+    IRCMetrics();
+    ~IRCMetrics();
+
+    IRCCounter* counter(const QString& name);
+    IRCHistogram* histogram(const QString& name);
+
+    // {"counters": {name: value}, "histograms": {name: {...}}}
+    QJsonObject toJson() const;
+    // One line per metric, "name value" or "name count=... p50=..." for
+    // histograms; counters also show their rate over uptimeSecs
+    QList<QByteArray> report(qint64 uptimeSecs) const;
+
+    // Monotonic clock in nanoseconds, for latencies measured across threads
+    static qint64 now();
+
+private:
+    Q_DISABLE_COPY(IRCMetrics)
+
+    mutable QMutex m_mutex;
+    QMap<QString, IRCCounter*> m_counters;
+    QMap<QString, IRCHistogram*> m_histograms;
+};
+
+#endif // IRCMETRICS_H
@@ -0,0 +1,126 @@
+#include "ircmotd.h"
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QFileSystemWatcher>
+#include <cstring>
+
+namespace {
+// The shipped motd.txt, compiled in as a resource
+const char DefaultMotdResource[] = ":/logos-irc-module/motd.txt";
+
+// Splits on LF, dropping a CR before it
+QList<QByteArray> splitLines(const char* p, qint64 size)
+{
+    QList<QByteArray> lines;
+    const char* end = p + size;
+    while (p < end) {
+        const char* newline = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        const char* lineEnd = newline ? newline : end;
+        qsizetype length = lineEnd - p;
+        if (length > 0 && p[length - 1] == '\r') {
+            --length;
+        }
+        lines.append(QByteArray(p, length));
+        p = lineEnd + 1;
+    }
+    return lines;
+}
+}
+
+IRCMotd::IRCMotd(QObject* parent)
+    : QObject(parent)
+    , m_watcher(new QFileSystemWatcher(this))
+    , m_size(-1)
+{
+    connect(m_watcher, &QFileSystemWatcher::fileChanged, this, &IRCMotd::onFileChanged);
+    loadDefault();
+}
+
+void IRCMotd::setFile(const QString& path)
+{
+    if (!m_path.isEmpty()) {
+        m_watcher->removePath(m_path);
+    }
+    m_path = path;
+    m_size = -1;
+
+    if (m_path.isEmpty()) {
+        loadDefault();
+        emit changed();
+        return;
+    }
+
+    m_watcher->addPath(m_path);
+    load();
+}
+
+void IRCMotd::refresh()
+{
+    if (m_path.isEmpty()) {
+        return;
+    }
+
+    QFileInfo info(m_path);
+    if (info.size() != m_size || info.lastModified() != m_lastModified) {
+        load();
+    }
+}
+
+void IRCMotd::onFileChanged(const QString& path)
+{
+    Q_UNUSED(path)
+
+    // Editors that save by replacing the file drop it from the watcher
+    if (!m_watcher->files().contains(m_path) && QFile::exists(m_path)) {
+        m_watcher->addPath(m_path);
+    }
+    load();
+}
+
+void IRCMotd::load()
+{
+    QFile file(m_path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "IRCMotd: cannot open" << m_path << ":" << file.errorString();
+        return;
+    }
+
+    QFileInfo info(file);
+    m_size = info.size();
+    m_lastModified = info.lastModified();
+
+    QList<QByteArray> lines;
+    if (m_size > 0) {
+        // Lines are copied straight out of the mapping; the file is never
+        // read into an intermediate buffer
+        uchar* data = file.map(0, m_size);
+        if (!data) {
+            qWarning() << "IRCMotd: cannot map" << m_path << ":" << file.errorString();
+            return;
+        }
+
+        lines = splitLines(reinterpret_cast<const char*>(data), m_size);
+        file.unmap(data);
+    }
+
+    m_lines = lines;
+    qDebug() << "IRCMotd: loaded" << m_lines.size() << "lines from" << m_path;
+    emit changed();
+}
+
+void IRCMotd::loadDefault()
+{
+    // Resources may be compressed, so this one is read rather than mapped
+    QFile file(DefaultMotdResource);
+    if (file.open(QIODevice::ReadOnly)) {
+        QByteArray text = file.readAll();
+        m_lines = splitLines(text.constData(), text.size());
+        return;
+    }
+
+    // Builds without the resource, like the benchmarks
+    m_lines.clear();
+    m_lines.append("Welcome to the Logos IRC Server");
+    m_lines.append("This is a simple IRC server implementation");
+}
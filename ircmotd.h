@@ -0,0 +1,49 @@
+#ifndef IRCMOTD_H
+#define IRCMOTD_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QDateTime>
+#include <QList>
+#include <QString>
+
+class QFileSystemWatcher;
+
+// Message of the day, read from a memory-mapped file and reloaded when the
+// file changes. Without a file the motd.txt built into the plugin is served.
+class IRCMotd : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit IRCMotd(QObject* parent = nullptr);
+
+    // An empty path restores the built-in MOTD
+    void setFile(const QString& path);
+    QString file() const { return m_path; }
+
+    // Reloads the file if its size or modification time changed; for when
+    // the watcher missed an update
+    void refresh();
+
+    // Encoded MOTD lines, without terminators
+    const QList<QByteArray>& lines() const { return m_lines; }
+
+signals:
+    void changed();
+
+private slots:
+    void onFileChanged(const QString& path);
+
+private:
+    void load();
+    void loadDefault();
+
+    QString m_path;
+    QFileSystemWatcher* m_watcher;
+    QList<QByteArray> m_lines;
+    QDateTime m_lastModified;
+    qint64 m_size;
+};
+
+#endif // IRCMOTD_H
@@ -0,0 +1,102 @@
+#ifndef IRCPOOL_H
+#define IRCPOOL_H
+
+#include <QList>
+#include <QtGlobal>
+#include <new>
+#include <utility>
+
+// Fixed-size records of type T carved out of slabs of SlabRecords each, for
+// objects that come and go by the thousand, like per-connection state.
+// Allocation pops a free list and only touches the heap once per slab, so a
+// burst of connects costs a few large allocations instead of one per record,
+// and records that are used together end up next to each other.
+//
+// Freed records go back on the free list, most recently freed first so the
+// next allocation reuses memory that is still in cache. Slabs are kept until
+// the pool is destroyed; a reconnect storm reuses them. Every record must be
+// freed before that. Not thread-safe.
+template<typename T, int SlabRecords = 256>
+class IRCSlabPool
+{
+public:
+    IRCSlabPool()
+        : m_free(nullptr)
+        , m_live(0)
+    {
+    }
+
+    ~IRCSlabPool()
+    {
+        Q_ASSERT(m_live == 0);
+        for (Slot* slab : std::as_const(m_slabs)) {
+            delete[] slab;
+        }
+    }
+
+    IRCSlabPool(const IRCSlabPool&) = delete;
+    IRCSlabPool& operator=(const IRCSlabPool&) = delete;
+
+    // Uninitialized storage for one T; construct it with placement new
+    void* allocate()
+    {
+        if (!m_free) {
+            grow();
+        }
+        Slot* slot = m_free;
+        m_free = slot->next;
+        ++m_live;
+        return slot->storage;
+    }
+
+    // Storage from allocate(), after the T in it was destroyed
+    void deallocate(void* record)
+    {
+        Slot* slot = reinterpret_cast<Slot*>(record);
+        slot->next = m_free;
+        m_free = slot;
+        --m_live;
+    }
+
+    template<typename... Args>
+    T* create(Args&&... args)
+    {
+        return new (allocate()) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T* record)
+    {
+        record->~T();
+        deallocate(record);
+    }
+
+    static constexpr qsizetype recordBytes() { return sizeof(Slot); }
+    qsizetype liveRecords() const { return m_live; }
+    qsizetype slabCount() const { return m_slabs.size(); }
+    // Everything the pool holds, live or free
+    qsizetype reservedBytes() const { return m_slabs.size() * SlabRecords * recordBytes(); }
+
+private:
+    union Slot
+    {
+        Slot* next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    void grow()
+    {
+        Slot* slab = new Slot[SlabRecords];
+        m_slabs.append(slab);
+        // Thread the new slab in address order, so a burst fills it front to back
+        for (int i = SlabRecords - 1; i >= 0; --i) {
+            slab[i].next = m_free;
+            m_free = &slab[i];
+        }
+    }
+
+    QList<Slot*> m_slabs;
+    Slot* m_free;
+    qsizetype m_live;
+};
+
+#endif // IRCPOOL_H
@@ -0,0 +1,84 @@
+#ifndef IRCQUEUE_H
+#define IRCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+// Unbounded lock-free multi-producer / single-consumer queue used to hand
+// work between the server thread and its worker shards.
+//
+// push() may be called from any thread; pop() and beginDrain() only from the
+// consuming thread. push() reports whether the consumer was idle, so each
+// burst of work posts a single wakeup to the consumer's event loop:
+//
+//     if (queue.push(item))
+//         QMetaObject::invokeMethod(consumer, &Consumer::drain, Qt::QueuedConnection);
+//
+//     void Consumer::drain() { queue.beginDrain(); while (queue.pop(item)) ... }
+template<typename T>
+class IRCMpscQueue
+{
+public:
+    IRCMpscQueue()
+        : m_head(new Node)
+        , m_tail(m_head.load(std::memory_order_relaxed))
+        , m_idle(true)
+    {
+    }
+
+    ~IRCMpscQueue()
+    {
+        T value;
+        while (pop(value)) {
+        }
+        delete m_tail;
+    }
+
+    IRCMpscQueue(const IRCMpscQueue&) = delete;
+    IRCMpscQueue& operator=(const IRCMpscQueue&) = delete;
+
+    // Returns true if the consumer has to be woken up
+    bool push(T value)
+    {
+        Node* node = new Node;
+        node->value = std::move(value);
+        Node* previous = m_head.exchange(node, std::memory_order_acq_rel);
+        previous->next.store(node, std::memory_order_release);
+        // Only checked once the node is linked, so a drain that already
+        // cleared the flag is guaranteed to see it
+        return m_idle.exchange(false, std::memory_order_seq_cst);
+    }
+
+    // Re-arms the wakeup; call before popping
+    void beginDrain()
+    {
+        m_idle.store(true, std::memory_order_seq_cst);
+    }
+
+    bool pop(T& value)
+    {
+        Node* tail = m_tail;
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (!next) {
+            return false;
+        }
+        value = std::move(next->value);
+        next->value = T();
+        m_tail = next;
+        delete tail;
+        return true;
+    }
+
+private:
+    struct Node
+    {
+        std::atomic<Node*> next { nullptr };
+        T value;
+    };
+
+    std::atomic<Node*> m_head;  // most recently pushed node
+    Node* m_tail;               // consumer side: node before the next value
+    std::atomic<bool> m_idle;
+};
+
+#endif // IRCQUEUE_H
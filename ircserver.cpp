@@ -1,20 +1,173 @@
 #include "ircserver.h"
+#include "ircmessage.h"
+#include "irclog.h"
 #include <QDebug>
+#include <QElapsedTimer>
 #include <QTcpSocket>
+#include <QThread>
+#include <QTimer>
 #include <QDateTime>
+#include <functional>
+#include <cstring>
+
+namespace {
+// Hands accepted descriptors to the server before any QTcpSocket exists, so
+// the socket can be created on whichever thread is going to serve it
+class IRCListener : public QTcpServer
+{
+public:
+    explicit IRCListener(std::function<void(qintptr)> handler, QObject* parent = nullptr)
+        : QTcpServer(parent)
+        , m_handler(std::move(handler))
+    {
+    }
+
+protected:
+    void incomingConnection(qintptr descriptor) override
+    {
+        m_handler(descriptor);
+    }
+
+private:
+    std::function<void(qintptr)> m_handler;
+};
+
+// Bound the work done per event loop pass so the listener is not starved
+constexpr int MaxShardEventsPerDrain = 1024;
+
+// Largest CHATHISTORY page, advertised in RPL_ISUPPORT
+constexpr int MaxChatHistoryLimit = 100;
+
+// How often held lines are retried while any client has some
+constexpr int FloodDrainInterval = 50;     // ms
+
+// The timer wheel's tick, and how many ticks a closed link may take to go
+// away gracefully before it is aborted
+constexpr int TimerTick = 1000;     // ms
+constexpr int CloseGrace = 10;
+
+// What each command costs before its fan-out, in thousandths of a token,
+// indexed by IRCMessage::Command. Commands that answer with a burst of
+// lines cost more; keepalives and capability negotiation cost little.
+constexpr qint64 CommandCosts[IRCMessage::CommandCount] = {
+    1000,   // Unknown
+    1000,   // Nick
+    1000,   // User
+    250,    // Ping
+    2000,   // Join: topic, names and a fan-out
+    1000,   // Part
+    1000,   // Privmsg
+    1000,   // Notice
+    2000,   // Who: a line per member
+    1000,   // Mode
+    2000,   // Motd
+    250,    // Quit
+    250,    // Cap
+    3000,   // ChatHistory: a page of up to MaxChatHistoryLimit lines
+    1000,   // Oper
+    2000,   // Stats
+    250     // Pong
+};
+
+struct CapabilityName
+{
+    IRCClient::Capability capability;
+    const char* name;
+};
+
+// Offered in CAP LS, in the order they are listed
+constexpr CapabilityName Capabilities[] = {
+    {IRCClient::Batch, "batch"},
+    {IRCClient::ChatHistory, "draft/chathistory"},
+    {IRCClient::ServerTime, "server-time"}
+};
+
+QByteArray capabilityList(uint capabilities)
+{
+    QByteArray list;
+    for (const CapabilityName& entry : Capabilities) {
+        if (capabilities & entry.capability) {
+            if (!list.isEmpty()) {
+                list += ' ';
+            }
+            list += entry.name;
+        }
+    }
+    return list;
+}
+
+uint capabilityByName(const QByteArray& name)
+{
+    for (const CapabilityName& entry : Capabilities) {
+        if (name == entry.name) {
+            return entry.capability;
+        }
+    }
+    return 0;
+}
+}
 
 IRCServer::IRCServer(QObject* parent)
     : QObject(parent)
-    , m_server(new QTcpServer(this))
+    , m_server(new IRCListener([this](qintptr descriptor) { onIncomingConnection(descriptor); }, this))
+    , m_epoll(nullptr)
+    , m_backend(QtSockets)
+    , m_releaseScheduled(false)
+    , m_channels(&m_strings)
     , m_serverName("logos-irc-server")
+    , m_encodedServerName(m_serverName.toUtf8())
+    , m_created(QDateTime::currentDateTime())
+    , m_motd(new IRCMotd(this))
     , m_wakuBridge(nullptr)
+    , m_bridgeFlushScheduled(false)
+    , m_nextBatch(0)
+    , m_floodTimer(new QTimer(this))
+    , m_wheelTimer(new QTimer(this))
+    , m_registrationTimeout(60)
+    , m_pingInterval(120)
+    , m_pingTimeout(60)
+    , m_sendQueueLimit(IRCConnection::DefaultSendQueueLimit)
+    , m_sendQueuePolicy(IRCConnection::Disconnect)
+    , m_workerThreads(0)
+    , m_nextShard(0)
+    , m_fanoutMark(0)
 {
-    connect(m_server, &QTcpServer::newConnection, this, &IRCServer::onNewConnection);
+    connect(m_motd, &IRCMotd::changed, this, &IRCServer::renderReplies);
+    renderReplies();
+    
+    m_floodTimer->setInterval(FloodDrainInterval);
+    connect(m_floodTimer, &QTimer::timeout, this, &IRCServer::drainHeldLines);
+    m_clock.start();
+    
+    m_pingLine = "PING :" + m_encodedServerName + "\r\n";
+    m_wheelTimer->setTimerType(Qt::CoarseTimer);
+    m_wheelTimer->setInterval(TimerTick);
+    connect(m_wheelTimer, &QTimer::timeout, this, &IRCServer::advanceTimers);
+    
+    m_linesIn = m_metrics.counter("lines_in");
+    m_bytesIn = m_metrics.counter("bytes_in");
+    m_linesTooLong = m_metrics.counter("lines_too_long");
+    m_connectionsAccepted = m_metrics.counter("connections_accepted");
+    m_connectionsClosed = m_metrics.counter("connections_closed");
+    m_sendQueueOverflows = m_metrics.counter("sendq_overflows");
+    m_bridgeInjected = m_metrics.counter("bridge.injected");
+    m_linesHeld = m_metrics.counter("flood.lines_held");
+    m_excessFloods = m_metrics.counter("flood.excess_disconnects");
+    m_pingsSent = m_metrics.counter("pings_sent");
+    m_registrationTimeouts = m_metrics.counter("timeouts.registration");
+    m_pingTimeouts = m_metrics.counter("timeouts.ping");
+    m_parseLatency = m_metrics.histogram("parse_ns");
+    m_fanoutSize = m_metrics.histogram("fanout_recipients");
+    // Unknown commands are timed too; they still cost a parse and a lookup
+    for (int command = 0; command < IRCMessage::CommandCount; ++command) {
+        m_commandLatency[command] = m_metrics.histogram(QString("command_ns.") + IRCMessage::commandName(IRCMessage::Command(command)));
+    }
 }
 
 IRCServer::~IRCServer()
 {
     stop();
+    freeReleasedClients();
 }
 
 bool IRCServer::start(const QString& host, quint16 port)
@@ -26,15 +179,42 @@ bool IRCServer::start(const QString& host, quint16 port)
         address = QHostAddress(host);
     }
 
-    if (!m_server->listen(address, port)) {
+    bool epoll = m_backend == Epoll && IRCEpollServer::isSupported();
+    if (m_backend == Epoll && !epoll) {
+        qWarning() << "IRCServer: the epoll backend is not available here, serving with QTcpSocket";
+    }
+    
+    if (epoll) {
+        m_epoll = new IRCEpollServer(this, this);
+        m_epoll->setSendQueueLimit(m_sendQueueLimit, m_sendQueuePolicy);
+        if (!m_epoll->listen(address, port)) {
+            qDebug() << "Failed to start IRC server:" << m_epoll->errorString();
+            delete m_epoll;
+            m_epoll = nullptr;
+            return false;
+        }
+    } else if (!m_server->listen(address, port)) {
         qDebug() << "Failed to start IRC server:" << m_server->errorString();
         return false;
     }
 
+    m_created = QDateTime::currentDateTime();
+    renderReplies();
+    
+    // The epoll backend serves every connection on this thread
+    if (!m_epoll) {
+        startShards();
+    }
+    m_wheelTimer->start();
+
     // Create the waku_bridge bot
     createWakuBridge();
 
-    qDebug() << "IRC server started on" << host << ":" << port;
+    if (m_epoll) {
+        qDebug() << "IRC server started on" << host << ":" << port << "with the epoll backend";
+    } else {
+        qDebug() << "IRC server started on" << host << ":" << port << "with" << m_workerThreads << "worker threads";
+    }
     return true;
 }
 
@@ -44,376 +224,855 @@ void IRCServer::stop()
         m_server->close();
     }
 
-    // Disconnect all clients
-    for (auto it = m_clients.begin(); it != m_clients.end(); ++it) {
-        IRCClient* client = it.value();
-        client->socket()->disconnectFromHost();
-        client->deleteLater();
-    }
+    // Disconnect all clients. Closing a socket can report the disconnect
+    // synchronously, so iterate over a detached copy.
+    const QMap<const void*, IRCClient*> clients = m_clients;
     m_clients.clear();
+    for (IRCClient* client : clients) {
+        m_timers.cancel(&client->timer());
+        if (client->connection() && !client->shard()) {
+            client->disconnectFromHost();
+        }
+        releaseClient(client);
+    }
+    
+    // The epoll backend closes its connections with it
+    delete m_epoll;
+    m_epoll = nullptr;
     m_channels.clear();
+    m_nicks.clear();
+    m_bridgeBacklog.clear();
+    m_floodHeld.clear();
+    m_floodTimer->stop();
+    m_wheelTimer->stop();
+
+    // Worker shards close their own sockets
+    stopShards();
 
     // Clean up waku bridge
     if (m_wakuBridge) {
-        m_wakuBridge->deleteLater();
+        releaseClient(m_wakuBridge);
         m_wakuBridge = nullptr;
     }
 
     qDebug() << "IRC server stopped";
 }
 
-void IRCServer::onNewConnection()
+void IRCServer::setWorkerThreads(int count)
+{
+    if (m_server->isListening()) {
+        qWarning() << "IRCServer: worker thread count only takes effect on the next start()";
+    }
+    m_workerThreads = qMax(0, count);
+}
+
+void IRCServer::setBackend(Backend backend)
+{
+    if (m_server->isListening() || m_epoll) {
+        qWarning() << "IRCServer: the connection backend only changes on the next start()";
+    }
+    m_backend = backend;
+}
+
+void IRCServer::startShards()
+{
+    for (int i = 0; i < m_workerThreads; ++i) {
+        QThread* thread = new QThread(this);
+        thread->setObjectName(QString("irc-shard-%1").arg(i));
+
+        IRCShard* shard = new IRCShard(i, this);
+        shard->configure(m_sendQueueLimit, m_sendQueuePolicy);
+        shard->moveToThread(thread);
+        thread->start();
+
+        m_shards.append(shard);
+        m_shardThreads.append(thread);
+    }
+    m_fanoutTargets.resize(m_shards.size());
+}
+
+void IRCServer::stopShards()
+{
+    for (int i = 0; i < m_shards.size(); ++i) {
+        QMetaObject::invokeMethod(m_shards[i], "shutdown", Qt::BlockingQueuedConnection);
+        m_shardThreads[i]->quit();
+        m_shardThreads[i]->wait();
+        delete m_shards[i];
+        delete m_shardThreads[i];
+    }
+    m_shards.clear();
+    m_shardThreads.clear();
+    m_fanoutTargets.clear();
+
+    // Whatever the shards posted before shutting down refers to deleted connections
+    m_shardEvents.beginDrain();
+    IRCShardEvent event;
+    while (m_shardEvents.pop(event)) {
+    }
+}
+
+void IRCServer::onIncomingConnection(qintptr descriptor)
+{
+    if (!m_shards.isEmpty()) {
+        // Spread connections round-robin; the shard adopts the descriptor on
+        // its own thread and reports back with a Connected event
+        m_shards[m_nextShard]->accept(descriptor);
+        m_nextShard = (m_nextShard + 1) % m_shards.size();
+        return;
+    }
+
+    QTcpSocket* socket = new QTcpSocket;
+    if (!socket->setSocketDescriptor(descriptor)) {
+        qWarning() << "Failed to accept client connection:" << socket->errorString();
+        delete socket;
+        return;
+    }
+
+    IRCConnection* connection = new IRCConnection(socket);
+    IRCClient* client = clientConnected(connection, nullptr, connection->peerAddress());
+    
+    connect(connection, &IRCConnection::lineReceived, this, [this, client](QByteArrayView line) {
+        processLine(client, line);
+    });
+    connect(connection, &IRCConnection::lineTooLong, this, [this, client]() {
+        clientLineTooLong(client);
+    });
+    connect(connection, &IRCConnection::sendQueueExceeded, this, [this, client]() {
+        clientSendQueueExceeded(client);
+    });
+    connect(connection, &IRCConnection::disconnected, this, [this, client]() {
+        clientDisconnected(client);
+    });
+}
+
+IRCClient* IRCServer::clientConnected(IRCConnection* connection, IRCShard* shard, const QString& hostAddress)
+{
+    if (!shard) {
+        connection->setSendQueueLimit(m_sendQueueLimit, m_sendQueuePolicy);
+    }
+    
+    return addClient(m_clientPool.create(connection, shard, m_strings.intern(hostAddress)));
+}
+
+IRCClient* IRCServer::addClient(IRCClient* client)
+{
+    m_clients[client->connectionKey()] = client;
+    client->setLastActivity(m_clock.elapsed());
+    m_timers.arm(&client->timer(), currentTick() + m_registrationTimeout);
+    
+    m_connectionsAccepted->add();
+    IRC_INFO(Client, "connected", "host=" + client->hostAddress());
+    return client;
+}
+
+void IRCServer::epollConnected(IRCEpollConnection* connection, const QString& peerAddress)
+{
+    connection->client = addClient(m_clientPool.create(connection, m_strings.intern(peerAddress)));
+}
+
+void IRCServer::epollLineReceived(IRCEpollConnection* connection, QByteArrayView line)
+{
+    processLine(connection->client, line);
+}
+
+void IRCServer::epollLineTooLong(IRCEpollConnection* connection)
+{
+    clientLineTooLong(connection->client);
+}
+
+void IRCServer::epollSendQueueExceeded(IRCEpollConnection* connection)
+{
+    clientSendQueueExceeded(connection->client);
+}
+
+void IRCServer::epollDisconnected(IRCEpollConnection* connection)
+{
+    clientDisconnected(connection->client);
+}
+
+void IRCServer::postShardEvent(IRCShardEvent&& event)
 {
-    while (m_server->hasPendingConnections()) {
-        QTcpSocket* socket = m_server->nextPendingConnection();
-        IRCClient* client = new IRCClient(socket, this);
+    if (m_shardEvents.push(std::move(event))) {
+        QMetaObject::invokeMethod(this, &IRCServer::drainShardEvents, Qt::QueuedConnection);
+    }
+}
+
+void IRCServer::drainShardEvents()
+{
+    m_shardEvents.beginDrain();
+    
+    IRCShardEvent event;
+    for (int handled = 0; handled < MaxShardEventsPerDrain; ++handled) {
+        if (!m_shardEvents.pop(event)) {
+            return;
+        }
         
-        m_clients[socket] = client;
+        if (event.type == IRCShardEvent::Connected) {
+            clientConnected(event.connection, event.shard, QString::fromUtf8(event.data));
+            continue;
+        }
         
-        connect(client, &IRCClient::messageReceived, this, &IRCServer::onClientMessage);
-        connect(client, &IRCClient::disconnected, this, &IRCServer::onClientDisconnected);
+        IRCClient* client = m_clients.value(event.connection);
+        if (!client) continue;
         
-        qDebug() << "New client connected from" << socket->peerAddress().toString();
+        switch (event.type) {
+        case IRCShardEvent::Lines: {
+            const char* data = event.data.constData();
+            const char* end = data + event.data.size();
+            while (data < end) {
+                const char* newline = static_cast<const char*>(std::memchr(data, '\n', end - data));
+                processLine(client, QByteArrayView(data, newline - data));
+                data = newline + 1;
+            }
+            break;
+        }
+        case IRCShardEvent::LineTooLong:
+            clientLineTooLong(client);
+            break;
+        case IRCShardEvent::SendQueueExceeded:
+            clientSendQueueExceeded(client);
+            break;
+        case IRCShardEvent::Disconnected:
+            clientDisconnected(client);
+            break;
+        default:
+            break;
+        }
     }
+    
+    // More work left; continue on the next pass
+    QMetaObject::invokeMethod(this, &IRCServer::drainShardEvents, Qt::QueuedConnection);
 }
 
-void IRCServer::onClientMessage(const QString& message)
+void IRCServer::processLine(IRCClient* client, QByteArrayView line)
 {
-    IRCClient* client = qobject_cast<IRCClient*>(sender());
-    if (!client) return;
+    // E.g. the rest of a read that ended in "Excess Flood"
+    if (client->isClosing()) return;
+    
+    IRC_TRACE(Client, "received", "host=" + client->hostAddress() + " line=" + IRCLog::quoted(QString::fromUtf8(line)));
+    // Only a store; the keepalive timer sees it when it next fires
+    client->setLastActivity(m_clock.elapsed());
+    m_linesIn->add();
+    m_bytesIn->add(quint64(line.size()));
+    
+    // The parsed message only refers to the line; handlers decode the
+    // parameters they need once the line is complete
+    QElapsedTimer timer;
+    timer.start();
+    IRCParsedMessage message;
+    bool parsed = IRCMessage::parse(line, message);
+    m_parseLatency->record(quint64(timer.nsecsElapsed()));
+    if (!parsed) return;
     
+    // Once a line is held, everything after it waits too, so commands never
+    // run out of order
+    IRCFloodControl& flood = client->flood();
+    if (flood.isHolding() || !flood.take(m_floodLimits, commandCost(client, message), m_clock.elapsed())) {
+        holdLine(client, line);
+        return;
+    }
     handleClientMessage(client, message);
 }
 
-void IRCServer::onClientDisconnected()
+qint64 IRCServer::commandCost(IRCClient* client, const IRCParsedMessage& message) const
 {
-    IRCClient* client = qobject_cast<IRCClient*>(sender());
-    if (!client) return;
+    IRCMessage::Command command = IRCMessage::command(message.command);
     
-    QTcpSocket* socket = client->socket();
+    // Fan-out is paid per recipient, which is what bounds how many lines
+    // one client can make the server write per second
+    qint64 recipients = 0;
+    switch (command) {
+    case IRCMessage::Privmsg:
+    case IRCMessage::Notice:
+    case IRCMessage::Part:
+        if (message.param(0).startsWith('#')) {
+            if (const IRCChannel* channel = m_channels.find(message.param(0))) {
+                recipients = channel->members().size();
+            }
+        }
+        break;
+    case IRCMessage::Nick:
+        for (const IRCMembership& membership : client->memberships()) {
+            recipients += m_channels.channel(membership.channel)->members().size();
+        }
+        break;
+    default:
+        break;
+    }
     
-    qDebug() << "Client disconnected:" << client->nick() << "from" << client->hostAddress();
+    return CommandCosts[command] + recipients * IRCFloodControl::Unit / qMax(1, m_floodLimits.fanoutPerToken);
+}
+
+void IRCServer::holdLine(IRCClient* client, QByteArrayView line)
+{
+    IRCFloodControl& flood = client->flood();
+    bool first = !flood.isHolding();
+    if (!flood.hold(line, m_floodLimits.queueLines)) {
+        clientExcessFlood(client);
+        return;
+    }
+    
+    m_linesHeld->add();
+    if (first) {
+        m_floodHeld.append(client);
+        if (!m_floodTimer->isActive()) {
+            m_floodTimer->start();
+        }
+        IRC_DEBUG(Client, "flood_held", "nick=" + client->nick() + " host=" + client->hostAddress());
+    }
+}
+
+void IRCServer::drainHeldLines()
+{
+    // One line per client per round, so a client with a long queue cannot
+    // starve the others; stop once no held client can pay for its next line
+    const qint64 now = m_clock.elapsed();
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        // A handler may disconnect a client, which takes it off m_floodHeld
+        const QList<IRCClient*> held = m_floodHeld;
+        for (IRCClient* client : held) {
+            IRCFloodControl& flood = client->flood();
+            if (!flood.isHolding()) continue;
+            
+            QByteArray line = flood.nextLine();
+            IRCParsedMessage message;
+            IRCMessage::parse(line, message);
+            if (!flood.take(m_floodLimits, commandCost(client, message), now)) continue;
+            
+            flood.dropNextLine();
+            handleClientMessage(client, message);
+            progress = true;
+        }
+    }
     
-    // Remove client from all channels
-    removeClientFromChannels(client);
+    m_floodHeld.removeIf([](IRCClient* client) { return !client->flood().isHolding(); });
+    if (m_floodHeld.isEmpty()) {
+        m_floodTimer->stop();
+    }
+}
+
+void IRCServer::clientExcessFlood(IRCClient* client)
+{
+    m_excessFloods->add();
+    IRC_WARNING(Client, "excess_flood", "nick=" + client->nick() + " host=" + client->hostAddress());
+    closeLink(client, "Excess Flood");
+}
+
+quint64 IRCServer::currentTick() const
+{
+    return quint64(m_clock.elapsed() / TimerTick);
+}
+
+void IRCServer::advanceTimers()
+{
+    m_timers.advance(currentTick(), [this](IRCTimer* timer) {
+        timerExpired(static_cast<IRCClient*>(timer->data));
+    });
+}
+
+void IRCServer::timerExpired(IRCClient* client)
+{
+    if (client->isClosing()) {
+        // The graceful close did not finish, e.g. the peer stopped reading
+        IRC_DEBUG(Client, "close_aborted", "nick=" + client->nick() + " host=" + client->hostAddress());
+        client->abort();
+        return;
+    }
+    
+    if (!client->isRegistered()) {
+        m_registrationTimeouts->add();
+        closeLink(client, "Registration timed out");
+        return;
+    }
+    
+    const qint64 now = m_clock.elapsed();
+    if (client->isAwaitingPong()) {
+        m_pingTimeouts->add();
+        closeLink(client, QString("Ping timeout: %1 seconds").arg((now - client->lastActivity()) / 1000));
+        return;
+    }
+    
+    // Activity does not move the timer, it only records the time; if the
+    // client spoke since this was armed, wait out the rest of the interval
+    const qint64 due = client->lastActivity() + qint64(m_pingInterval) * 1000;
+    if (now < due) {
+        m_timers.arm(&client->timer(), quint64((due + TimerTick - 1) / TimerTick));
+        return;
+    }
+    
+    m_pingsSent->add();
+    client->sendLine(m_pingLine);
+    client->setAwaitingPong(true);
+    m_timers.arm(&client->timer(), currentTick() + m_pingTimeout);
+}
+
+void IRCServer::closeLink(IRCClient* client, const QString& reason)
+{
+    IRC_INFO(Client, "close_link", "nick=" + client->nick() + " host=" + client->hostAddress() + " reason=" + IRCLog::quoted(reason));
+    
+    client->setClosing(true);
+    client->flood().clear();
+    m_floodHeld.removeOne(client);
+    quitChannels(client, reason);
+    unregisterNick(client);
+    
+    // A peer that stopped reading would hold a graceful close open forever
+    m_timers.arm(&client->timer(), currentTick() + CloseGrace);
+    client->sendMessage("ERROR :Closing Link: " + client->hostAddress() + " (" + reason + ")");
+    client->disconnectFromHost();
+}
+
+void IRCServer::setTimeouts(int registration, int pingInterval, int pingTimeout)
+{
+    // Armed timers keep their deadlines; new values apply from the next arm
+    m_registrationTimeout = qMax(1, registration);
+    m_pingInterval = qMax(1, pingInterval);
+    m_pingTimeout = qMax(1, pingTimeout);
+}
+
+void IRCServer::setFloodLimits(const IRCFloodLimits& limits)
+{
+    // Held lines drain at the new rate, or all at once if flood control is now off
+    m_floodLimits = limits;
+    m_floodLimits.burst = qMax(1, limits.burst);
+    m_floodLimits.queueLines = qMax(0, limits.queueLines);
+}
+
+void IRCServer::clientLineTooLong(IRCClient* client)
+{
+    m_linesTooLong->add();
+    // ERR_INPUTTOOLONG
+    client->sendMessage(m_serverName, "417", (client->nick().isEmpty() ? "*" : client->nick()) + " :Input line was too long");
+}
+
+void IRCServer::clientSendQueueExceeded(IRCClient* client)
+{
+    m_sendQueueOverflows->add();
+    if (m_sendQueuePolicy != IRCConnection::Disconnect) {
+        IRC_DEBUG(Client, "lagging", "nick=" + client->nick() + " queued=" + QString::number(client->sendQueueBytes()));
+        return;
+    }
+    
+    IRC_WARNING(Client, "sendq_exceeded", "nick=" + client->nick());
+    quitChannels(client, "SendQ exceeded");
+    
+    // A peer that stopped reading will not drain a graceful close either
+    client->abort();
+}
+
+void IRCServer::setSendQueueLimit(qint64 bytes, IRCConnection::SendQueuePolicy policy)
+{
+    m_sendQueueLimit = bytes;
+    m_sendQueuePolicy = policy;
+    for (IRCShard* shard : std::as_const(m_shards)) {
+        shard->configure(bytes, policy);
+    }
+    for (IRCClient* client : std::as_const(m_clients)) {
+        if (client->connection() && !client->shard()) {
+            client->connection()->setSendQueueLimit(bytes, policy);
+        }
+    }
+    if (m_epoll) {
+        m_epoll->setSendQueueLimit(bytes, policy);
+    }
+}
+
+QMap<QString, qint64> IRCServer::sendQueueDepths() const
+{
+    QMap<QString, qint64> depths;
+    for (IRCClient* client : m_clients) {
+        depths.insert(client->nick().isEmpty() ? client->hostAddress() : client->nick(), client->sendQueueBytes());
+    }
+    return depths;
+}
+
+void IRCServer::clientDisconnected(IRCClient* client)
+{
+    m_connectionsClosed->add();
+    IRC_INFO(Client, "disconnected", "nick=" + client->nick() + " host=" + client->hostAddress());
+    
+    // Tell the channels, unless the client already quit
+    quitChannels(client, "Connection closed");
+    unregisterNick(client);
     
     // Remove from clients map
-    m_clients.remove(socket);
+    m_clients.remove(client->connectionKey());
+    
+    // Lines still held back and pending timeouts go with the client
+    if (client->flood().isHolding()) {
+        client->flood().clear();
+        m_floodHeld.removeOne(client);
+    }
+    m_timers.cancel(&client->timer());
     
-    // Delete the client object
-    client->deleteLater();
+    // A shard or the epoll backend keeps the connection until we confirm
+    // nothing refers to it anymore
+    if (client->shard()) {
+        client->shard()->release(client->connection());
+    } else if (IRCEpollConnection* connection = client->epollConnection()) {
+        connection->owner->release(connection);
+    }
+    
+    releaseClient(client);
 }
 
-void IRCServer::handleClientMessage(IRCClient* client, const QString& message)
+void IRCServer::releaseClient(IRCClient* client)
 {
-    qDebug() << "Received from" << client->hostAddress() << ":" << message;
+    // Closing a socket in stop() can report the disconnect again
+    if (client->isReleased()) {
+        return;
+    }
+    client->setReleased();
     
-    QStringList parts = message.split(' ', Qt::SkipEmptyParts);
-    if (parts.isEmpty()) return;
+    // The caller, or a connection signal further up the stack, may still be
+    // using the client; free it once control is back in the event loop
+    m_releasedClients.append(client);
+    if (!m_releaseScheduled) {
+        m_releaseScheduled = true;
+        QMetaObject::invokeMethod(this, &IRCServer::freeReleasedClients, Qt::QueuedConnection);
+    }
+}
+
+void IRCServer::freeReleasedClients()
+{
+    m_releaseScheduled = false;
+    for (IRCClient* client : std::as_const(m_releasedClients)) {
+        m_clientPool.destroy(client);
+    }
+    m_releasedClients.clear();
+}
+
+void IRCServer::handleClientMessage(IRCClient* client, const IRCParsedMessage& message)
+{
+    using Handler = void (IRCServer::*)(IRCClient*, const IRCParsedMessage&);
     
-    QString command = parts[0].toUpper();
-    QStringList args = parts.mid(1);
+    // Indexed by IRCMessage::Command
+    static constexpr Handler handlers[IRCMessage::CommandCount] = {
+        nullptr,                    // Unknown
+        &IRCServer::handleNick,
+        &IRCServer::handleUser,
+        &IRCServer::handlePing,
+        &IRCServer::handleJoin,
+        &IRCServer::handlePart,
+        &IRCServer::handlePrivmsg,
+        &IRCServer::handleNotice,
+        &IRCServer::handleWho,
+        &IRCServer::handleMode,
+        &IRCServer::handleMotd,
+        &IRCServer::handleQuit,
+        &IRCServer::handleCap,
+        &IRCServer::handleChatHistory,
+        &IRCServer::handleOper,
+        &IRCServer::handleStats,
+        nullptr                     // Pong: any line counts as activity
+    };
     
-    if (command == "NICK") {
-        handleNick(client, args);
-    } else if (command == "USER") {
-        handleUser(client, args);
-    } else if (command == "PING") {
-        handlePing(client, args);
-    } else if (command == "JOIN") {
-        handleJoin(client, args);
-    } else if (command == "PART") {
-        handlePart(client, args);
-    } else if (command == "PRIVMSG") {
-        handlePrivmsg(client, args);
-    } else if (command == "WHO") {
-        handleWho(client, args);
-    } else if (command == "MODE") {
-        handleMode(client, args);
-    } else if (command == "MOTD") {
-        handleMotd(client, args);
-    } else if (command == "QUIT") {
-        handleQuit(client, args);
+    QElapsedTimer timer;
+    timer.start();
+    IRCMessage::Command command = IRCMessage::command(message.command);
+    if (Handler handler = handlers[command]) {
+        (this->*handler)(client, message);
     }
+    m_commandLatency[command]->record(quint64(timer.nsecsElapsed()));
     
     // Check if client should be registered
-    if (!client->isRegistered() && !client->nick().isEmpty() && !client->user().isEmpty()) {
+    if (!client->isRegistered() && !client->isNegotiatingCaps() && !client->nick().isEmpty() && !client->user().isEmpty()) {
         client->setRegistered(true);
         sendWelcome(client);
+        // From here on the timer is the keepalive
+        m_timers.arm(&client->timer(), currentTick() + m_pingInterval);
     }
 }
 
 void IRCServer::sendWelcome(IRCClient* client)
 {
-    client->sendMessage(m_serverName, "001", client->nick() + " :Welcome to Logos IRC Server");
-    client->sendMessage(m_serverName, "002", client->nick() + " :Your host is " + m_serverName);
-    client->sendMessage(m_serverName, "003", client->nick() + " :This server was created " + QDateTime::currentDateTime().toString());
-    client->sendMessage(m_serverName, "004", client->nick() + " " + m_serverName + " v1.0 o o");
-
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@#=........._.....=%@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@#=........................=#@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@*..........:=#@@@@#=:......_...*@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@#:..........-%@@@@@@@@@@@@#-..........-#@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@#......._....-@@@@@@@@@@@@@@@@@%:.........._.#@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@#..........._+@@@@@@@@@@@@@@@@@@@@+............:#@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@%:............_=@@@@@@@@@@@@@@@@@@@@@@=._..._........@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@#..............@@@@@@@@@@@@@@@@@@@@@@@%........._.._.#@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@+.........._...-@@@@@@@@@@@@@@@@@@@@@@@@:............._+@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@-._.............-@@@@@@@@@@@@@@@@@@@@@@@@-..............@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@:..............@@@@@@@@@@@@@@@@@@@@@@@@._._._.........-@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@*.............*@@@@@@@@@@@@@@@@@@@@@@+.............*@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@%-.........._.#@@@@@@@@@@@@@@@@@@@@#.............-@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@#.._.........*@@@@@@@@@@@@@@@@@@+....._....._#@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@@#:........._:*@@@@@@@@@@@@@@*:..........:#@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@+...........:#%@@@@@@%#:........._+@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@*:............_........._...:*@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@+-:................:-+@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@%%#*+====+*#%%@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-....._.........._................................_..............@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-..........................:‒=++=-:._............................@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-...................=*%@@@@@@@@@@@@@@@@@@%*=.....................@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-..............._%@@@@@@@@@@@@@@@@@@@@@@@@@@@@%-..............-..@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-............=%@@@@@@@@@@@@#=-:...:-*@@@@@@@@@@@@%=..............@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-..._......:#@@@@@@@@@@@@%:............+@@@@@@@@@@@@#:...........@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-........:%@@@@@@@@@@@@%:.........._.....+@@@@@@@@@@@@%-.........@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-......_.#@@@@@@@@@@@@@*..._................-@@@@@@@@@@@@@#......@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-.....=@@@@@@@@@@@@@@#..........._.........._+@@@@@@@@@@@@@@=....@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-...*@@@@@@@@@@@@@@@=......._.................@@@@@@@@@@@@@@@#...@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-._.#@@@@@@@@@@@@@@@@:............_........._#@@@@@@@@@@@@@@@#...@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-._.*@@@@@@@@@@@@@@@@:........................#@@@@@@@@@@@@@@@*..@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-....=@@@@@@@@@@@@@@@+._._......._._..._....:@@@@@@@@@@@@@@@=....@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-.....:%@@@@@@@@@@@@@%:....._..............*@@@@@@@@@@@@@%:.._...@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-...._..=@@@@@@@@@@@@@%._.................+@@@@@@@@@@@@@=........@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-........_+@@@@@@@@@@@@@=..._...........:#@@@@@@@@@@@@+..........@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-........_.=@@@@@@@@@@@@@=......_...._:%@@@@@@@@@@@@=............@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-............_+@@@@@@@@@@@@@%*=---+#%@@@@@@@@@@@@+:..............@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-._...._........_.=#@@@@@@@@@@@@@@@@@@@@@@@@@@#=._._.._..........@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-.....................=#@@@@@@@@@@@@@@@@#=:..........._..........@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-........._...._..............::........_......._.............-..@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@-................................_.................._.....-......@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-    client->sendMessage(m_serverName, "372", client->nick() + "@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@@");
-
-    // Send MOTD
-    client->sendMessage(m_serverName, "375", client->nick() + " :- " + m_serverName + " Message of the day -");
-    client->sendMessage(m_serverName, "372", client->nick() + " :- Welcome to the Logos IRC Server");
-    client->sendMessage(m_serverName, "372", client->nick() + " :- This is a simple IRC server implementation");
-    client->sendMessage(m_serverName, "376", client->nick() + " :End of /MOTD command");
-}
-
-void IRCServer::broadcastToChannel(const QString& channel, IRCClient* sender, const QString& message)
-{
-    if (!m_channels.contains(channel)) return;
-    
-    QSet<IRCClient*> clients = m_channels[channel];
-    for (IRCClient* client : clients) {
-        if (client != sender) {
-            QString prefix = sender->nick() + "!" + sender->user() + "@" + sender->hostAddress();
-            client->sendMessage(prefix, "PRIVMSG", channel + " :" + message);
+    // 001-004 and the MOTD leave in one write
+    client->sendLine(m_welcomeReply.render(client->encodedNick()));
+}
+
+void IRCServer::renderReplies()
+{
+    m_motdReply.clear();
+    m_motdReply.addLine(m_encodedServerName, "375", ":- " + m_encodedServerName + " Message of the day -");
+    for (const QByteArray& line : m_motd->lines()) {
+        m_motdReply.addLine(m_encodedServerName, "372", ":- " + line);
+    }
+    m_motdReply.addLine(m_encodedServerName, "376", ":End of /MOTD command");
+    
+    m_welcomeReply.clear();
+    m_welcomeReply.addLine(m_encodedServerName, "001", ":Welcome to Logos IRC Server");
+    m_welcomeReply.addLine(m_encodedServerName, "002", ":Your host is " + m_encodedServerName);
+    m_welcomeReply.addLine(m_encodedServerName, "003", ":This server was created " + m_created.toString().toUtf8());
+    m_welcomeReply.addLine(m_encodedServerName, "004", m_encodedServerName + " v1.0 o o");
+    m_welcomeReply.addLine(m_encodedServerName, "005", "CASEMAPPING=rfc1459 CHATHISTORY=" + QByteArray::number(MaxChatHistoryLimit) + " :are supported by this server");
+    m_welcomeReply.append(m_motdReply);
+}
+
+void IRCServer::sendToChannel(const IRCChannel* channel, const QByteArray& line, IRCClient* except)
+{
+    // The line is formatted and encoded once by the caller; every member
+    // queues the same shared buffer
+    quint64 recipients = 0;
+    for (const IRCMember& member : channel->members()) {
+        if (member.client != except && member.client->isRegistered()) {
+            addRecipient(member.client, line);
+            ++recipients;
         }
     }
+    flushRecipients(line);
+    m_fanoutSize->record(recipients);
 }
 
-void IRCServer::removeClientFromChannels(IRCClient* client)
+void IRCServer::sendToNeighbours(IRCClient* client, const QByteArray& line)
 {
-    for (auto it = m_channels.begin(); it != m_channels.end();) {
-        it.value().remove(client);
-        // Don't remove channels that still have the bot or other users
-        if (it.value().isEmpty()) {
-            it = m_channels.erase(it);
-        } else {
-            ++it;
+    // Everyone sharing at least one channel with the client gets the line
+    // once. Marking recipients with a fresh value replaces a per-event set.
+    const quint32 mark = nextFanoutMark();
+    client->setFanoutMark(mark);
+    
+    quint64 recipients = 0;
+    for (const IRCMembership& membership : client->memberships()) {
+        for (const IRCMember& member : m_channels.channel(membership.channel)->members()) {
+            if (member.client->fanoutMark() != mark) {
+                member.client->setFanoutMark(mark);
+                addRecipient(member.client, line);
+                ++recipients;
+            }
+        }
+    }
+    flushRecipients(line);
+    m_fanoutSize->record(recipients);
+}
+
+void IRCServer::addRecipient(IRCClient* client, const QByteArray& line)
+{
+    // Members served by worker shards are grouped so each shard receives the
+    // whole fan-out as a single queue entry
+    if (client->shard()) {
+        m_fanoutTargets[client->shard()->index()].append(client->connection());
+    } else {
+        client->sendLine(line);
+    }
+}
+
+void IRCServer::flushRecipients(const QByteArray& line)
+{
+    for (int i = 0; i < m_fanoutTargets.size(); ++i) {
+        if (!m_fanoutTargets[i].isEmpty()) {
+            m_shards[i]->sendToMany(std::move(m_fanoutTargets[i]), line);
+            m_fanoutTargets[i].clear();
+        }
+    }
+}
+
+quint32 IRCServer::nextFanoutMark()
+{
+    if (++m_fanoutMark == 0) {
+        // Wrapped around; clear old marks so none can match a reused value
+        for (IRCClient* client : std::as_const(m_clients)) {
+            client->setFanoutMark(0);
+        }
+        if (m_wakuBridge) {
+            m_wakuBridge->setFanoutMark(0);
         }
+        m_fanoutMark = 1;
+    }
+    return m_fanoutMark;
+}
+
+void IRCServer::unregisterNick(IRCClient* client)
+{
+    auto it = m_nicks.find(client->nickKey());
+    if (it != m_nicks.end() && it.value() == client) {
+        m_nicks.erase(it);
     }
 }
 
-void IRCServer::handleNick(IRCClient* client, const QStringList& args)
+void IRCServer::handleNick(IRCClient* client, const IRCParsedMessage& message)
 {
-    if (args.isEmpty()) return;
+    if (message.param(0).isEmpty()) return;
     
     QString oldNick = client->nick();
-    QString newNick = args[0];
+    IRCName nick = m_strings.intern(message.param(0));
+    const QString& newNick = nick.toString();
     
-    // Check if nick is already in use (simple check)
-    for (auto it = m_clients.begin(); it != m_clients.end(); ++it) {
-        IRCClient* otherClient = it.value();
-        if (otherClient != client && otherClient->nick().toLower() == newNick.toLower()) {
-            client->sendMessage(m_serverName, "433", client->nick().isEmpty() ? "*" : client->nick() + " " + newNick + " :Nickname is already in use");
-            return;
-        }
+    // Check if nick is already in use
+    IRCClient* owner = m_nicks.value(nick.foldedKey());
+    if (owner && owner != client) {
+        client->sendMessage(m_serverName, "433", (oldNick.isEmpty() ? "*" : oldNick) + " " + newNick + " :Nickname is already in use");
+        return;
     }
     
     // If client is registered, send nick change notification to all channels
     if (client->isRegistered() && !oldNick.isEmpty()) {
-        QString prefix = oldNick + "!" + client->user() + "@" + client->hostAddress();
+        QByteArray line = IRCMessage::format(client->prefix(), "NICK", ":" + newNick);
         
         // Send nick change notification to the client itself first
-        client->sendMessage(prefix, "NICK", ":" + newNick);
+        client->sendLine(line);
         
         // Notify all users in channels where this client is present
-        QSet<IRCClient*> notifiedClients;
-        notifiedClients.insert(client); // Don't notify the client twice
-        
-        for (const QString& channel : client->channels()) {
-            if (m_channels.contains(channel)) {
-                for (IRCClient* channelClient : m_channels[channel]) {
-                    if (!notifiedClients.contains(channelClient)) {
-                        channelClient->sendMessage(prefix, "NICK", ":" + newNick);
-                        notifiedClients.insert(channelClient);
-                    }
-                }
-            }
-        }
+        sendToNeighbours(client, line);
     }
     
-    client->setNick(newNick);
-    qDebug() << "Client" << client->hostAddress() << "changed nick from" << oldNick << "to" << newNick;
+    unregisterNick(client);
+    client->setNick(nick);
+    m_nicks.insert(client->nickKey(), client);
+    IRC_DEBUG(Client, "nick", "host=" + client->hostAddress() + " old=" + oldNick + " new=" + newNick);
 }
 
-void IRCServer::handleUser(IRCClient* client, const QStringList& args)
+void IRCServer::handleUser(IRCClient* client, const IRCParsedMessage& message)
 {
-    if (args.size() < 4) return;
+    if (message.paramCount < 4) return;
     
-    QString username = args[0];
-    client->setUser(username);
-    qDebug() << "Client" << client->hostAddress() << "set user to" << username;
+    client->setUser(m_strings.intern(message.param(0)));
+    IRC_DEBUG(Client, "user", "host=" + client->hostAddress() + " user=" + client->user());
 }
 
-void IRCServer::handlePing(IRCClient* client, const QStringList& args)
+void IRCServer::handlePing(IRCClient* client, const IRCParsedMessage& message)
 {
-    QString token = args.isEmpty() ? "ping" : args[0];
-    client->sendMessage("PONG", ":" + token);
+    // The token is echoed back as received, without decoding it
+    QByteArrayView token = message.paramCount > 0 ? message.param(0) : QByteArrayView("ping");
+    client->sendLine(IRCMessage::format(m_encodedServerName, "PONG", m_encodedServerName, token));
 }
 
-void IRCServer::handleJoin(IRCClient* client, const QStringList& args)
+void IRCServer::handleJoin(IRCClient* client, const IRCParsedMessage& message)
 {
-    if (args.isEmpty()) return;
+    if (message.paramCount < 1) return;
     if (!client->isRegistered()) return;
     
-    QString channel = args[0];
-    if (!channel.startsWith("#")) {
-        channel = "#" + channel;
+    QString channelName = QString::fromUtf8(message.param(0));
+    if (!channelName.startsWith("#")) {
+        channelName = "#" + channelName;
     }
     
-    // Add client to channel
-    client->joinChannel(channel);
-    m_channels[channel].insert(client);
+    // Add client to channel; joining a channel twice is a no-op
+    IRCChannel* channel = m_channels.findOrCreate(channelName);
+    if (!m_channels.join(channel, client)) return;
+    const QString& name = channel->name();
     
     // Send JOIN confirmation to the client
-    QString prefix = client->nick() + "!" + client->user() + "@" + client->hostAddress();
-    client->sendMessage(prefix, "JOIN", ":" + channel);
+    QByteArray joinLine = IRCMessage::format(client->prefix(), "JOIN", ":" + name);
+    client->sendLine(joinLine);
     
     // Send channel topic (if any)
-    client->sendMessage(m_serverName, "332", client->nick() + " " + channel + " :Welcome to " + channel);
+    client->sendMessage(m_serverName, "332", client->nick() + " " + name + " :Welcome to " + name);
     
     // Send names list (who's in the channel)
     QStringList names;
-    for (IRCClient* channelClient : m_channels[channel]) {
-        if (channelClient->isRegistered()) {
-            names << channelClient->nick();
+    for (const IRCMember& member : channel->members()) {
+        if (member.client->isRegistered()) {
+            names << member.client->nick();
         }
     }
     
     if (!names.isEmpty()) {
         QString namesList = names.join(" ");
-        client->sendMessage(m_serverName, "353", client->nick() + " = " + channel + " :" + namesList);
+        client->sendMessage(m_serverName, "353", client->nick() + " = " + name + " :" + namesList);
     }
-    client->sendMessage(m_serverName, "366", client->nick() + " " + channel + " :End of /NAMES list");
+    client->sendMessage(m_serverName, "366", client->nick() + " " + name + " :End of /NAMES list");
     
     // Notify other users in the channel that this user joined
-    for (IRCClient* channelClient : m_channels[channel]) {
-        if (channelClient != client && channelClient->isRegistered()) {
-            channelClient->sendMessage(prefix, "JOIN", ":" + channel);
-        }
-    }
+    sendToChannel(channel, joinLine, client);
     
-    qDebug() << "Client" << client->nick() << "joined channel" << channel;
+    IRC_DEBUG(Channel, "join", "nick=" + client->nick() + " channel=" + name);
     
     // Emit signal to notify that a channel was joined
-    emit channelJoined(channel);
+    emit channelJoined(name);
+}
+
+void IRCServer::handlePrivmsg(IRCClient* client, const IRCParsedMessage& message)
+{
+    relayMessage(client, message, false);
+}
+
+void IRCServer::handleNotice(IRCClient* client, const IRCParsedMessage& message)
+{
+    relayMessage(client, message, true);
 }
 
-void IRCServer::handlePrivmsg(IRCClient* client, const QStringList& args)
+void IRCServer::relayMessage(IRCClient* client, const IRCParsedMessage& message, bool notice)
 {
-    if (args.size() < 2) return;
+    if (message.paramCount < 2) return;
+    if (!client->isRegistered()) return;
     
-    QString target = args[0];
-    QString message = args.mid(1).join(" ");
-    if (message.startsWith(":")) {
-        message = message.mid(1);
-    }
+    QByteArrayView command = notice ? QByteArrayView("NOTICE") : QByteArrayView("PRIVMSG");
+    QByteArrayView target = message.param(0);
+    QByteArrayView text = message.param(1);
     
-    if (target.startsWith("#")) {
+    if (target.startsWith('#')) {
         // Channel message
-        if (client->isInChannel(target)) {
-            broadcastToChannel(target, client, message);
-            qDebug() << "Broadcasting message from" << client->nick() << "to channel" << target << ":" << message;
+        IRCChannel* channel = m_channels.find(target);
+        if (channel && client->isInChannel(channel)) {
+            // Relayed as received; the text is only decoded for the bridge
+            sendToChannel(channel, IRCMessage::format(client->encodedPrefix(), command, target, text), client);
+            if (notice) return;
+            
+            m_history.append(channel->foldedName(), QDateTime::currentMSecsSinceEpoch(), client->encodedPrefix(), text.toByteArray());
+            
+            QString decoded = QString::fromUtf8(text);
+            IRC_TRACE(Channel, "privmsg", "nick=" + client->nick() + " channel=" + channel->name() + " text=" + IRCLog::quoted(decoded));
             
             // Emit signal to notify that a message was sent (for chat bridge)
-            emit messageSent(target, client->nick(), message);
+            emit messageSent(channel->name(), client->nick(), decoded);
             
             // Trigger waku_bridge response if it's in the channel
-            wakuBridgeResponse(target, client, message);
+            wakuBridgeResponse(channel, client, decoded);
         }
-    } else {
-        // Private message (not implemented in this simple version)
-        qDebug() << "Private message from" << client->nick() << "to" << target << ":" << message;
+        return;
+    }
+    
+    // Private message, resolved through the nick index. The index also holds
+    // nicks still registering, which are not reachable yet.
+    IRCClient* recipient = m_nicks.value(m_strings.findFolded(target).foldedKey());
+    if (!recipient || !recipient->isRegistered()) {
+        // NOTICE must never trigger an automatic reply
+        if (!notice) {
+            client->sendMessage(m_serverName, "401", client->nick() + " " + QString::fromUtf8(target) + " :No such nick/channel");
+        }
+        return;
     }
+    recipient->sendLine(IRCMessage::format(client->encodedPrefix(), command, target, text));
+    IRC_TRACE(Client, "privmsg", "nick=" + client->nick() + " to=" + recipient->nick());
 }
 
-void IRCServer::handlePart(IRCClient* client, const QStringList& args)
+void IRCServer::handlePart(IRCClient* client, const IRCParsedMessage& message)
 {
-    if (args.isEmpty()) return;
+    if (message.paramCount < 1) return;
     if (!client->isRegistered()) return;
     
-    QString channel = args[0];
-    if (!channel.startsWith("#")) {
-        channel = "#" + channel;
+    QString channelName = QString::fromUtf8(message.param(0));
+    if (!channelName.startsWith("#")) {
+        channelName = "#" + channelName;
     }
     
-    QString reason = args.size() > 1 ? args.mid(1).join(" ") : "Leaving";
-    if (reason.startsWith(":")) {
-        reason = reason.mid(1);
-    }
+    QString reason = message.paramCount > 1 ? QString::fromUtf8(message.param(1)) : "Leaving";
     
-    if (client->isInChannel(channel) && m_channels.contains(channel)) {
-        QString prefix = client->nick() + "!" + client->user() + "@" + client->hostAddress();
-        
+    IRCChannel* channel = m_channels.find(channelName);
+    if (channel && client->isInChannel(channel)) {
         // Notify all users in the channel that this user left
-        for (IRCClient* channelClient : m_channels[channel]) {
-            if (channelClient->isRegistered()) {
-                channelClient->sendMessage(prefix, "PART", channel + " :" + reason);
-            }
-        }
+        sendToChannel(channel, IRCMessage::format(client->prefix(), "PART", channelName + " :" + reason));
         
-        // Remove client from channel
-        client->leaveChannel(channel);
-        m_channels[channel].remove(client);
+        // Remove client from channel; empty channels are removed with it
+        m_channels.part(channel, client);
         
-        // Remove empty channels
-        if (m_channels[channel].isEmpty()) {
-            m_channels.remove(channel);
-        }
-        
-        qDebug() << "Client" << client->nick() << "left channel" << channel << ":" << reason;
+        IRC_DEBUG(Channel, "part", "nick=" + client->nick() + " channel=" + channelName + " reason=" + IRCLog::quoted(reason));
     }
 }
 
-void IRCServer::handleWho(IRCClient* client, const QStringList& args)
+void IRCServer::handleWho(IRCClient* client, const IRCParsedMessage& message)
 {
-    if (args.isEmpty()) return;
+    if (message.paramCount < 1) return;
     if (!client->isRegistered()) return;
     
-    QString target = args[0];
+    QString target = QString::fromUtf8(message.param(0));
     
     if (target.startsWith("#")) {
         // WHO for channel
-        if (m_channels.contains(target)) {
-            for (IRCClient* channelClient : m_channels[target]) {
+        if (const IRCChannel* channel = m_channels.find(target)) {
+            for (const IRCMember& member : channel->members()) {
+                IRCClient* channelClient = member.client;
                 if (channelClient->isRegistered()) {
                     QString response = QString("%1 %2 %3 %4 %5 H :0 %6")
                         .arg(channelClient->nick())
@@ -430,123 +1089,425 @@ void IRCServer::handleWho(IRCClient* client, const QStringList& args)
     }
 }
 
-void IRCServer::handleMode(IRCClient* client, const QStringList& args)
+void IRCServer::handleMode(IRCClient* client, const IRCParsedMessage& message)
 {
-    if (args.isEmpty()) return;
+    if (message.paramCount < 1) return;
     if (!client->isRegistered()) return;
     
-    QString target = args[0];
+    QString target = QString::fromUtf8(message.param(0));
     
     if (target == client->nick()) {
         // User mode query
-        if (args.size() == 1) {
+        if (message.paramCount == 1) {
             client->sendMessage(m_serverName, "221", client->nick() + " +");
         }
     } else if (target.startsWith("#")) {
         // Channel mode query
-        if (args.size() == 1) {
+        if (message.paramCount == 1) {
             client->sendMessage(m_serverName, "324", client->nick() + " " + target + " +");
             client->sendMessage(m_serverName, "329", client->nick() + " " + target + " " + QString::number(QDateTime::currentSecsSinceEpoch()));
         }
     }
 }
 
-void IRCServer::handleMotd(IRCClient* client, const QStringList& args)
+void IRCServer::handleMotd(IRCClient* client, const IRCParsedMessage& message)
 {
-    Q_UNUSED(args)
+    Q_UNUSED(message)
     if (!client->isRegistered()) return;
     
-    client->sendMessage(m_serverName, "375", client->nick() + " :- " + m_serverName + " Message of the day -");
+    // Picks up edits the file watcher may have missed; re-renders on change
+    m_motd->refresh();
+    client->sendLine(m_motdReply.render(client->encodedNick()));
+}
 
-    client->sendMessage(m_serverName, "372", client->nick() + " :- Welcome to the Logos IRC Proxy Server");
-    client->sendMessage(m_serverName, "376", client->nick() + " :End of /MOTD command");
+void IRCServer::setMotdFile(const QString& path)
+{
+    m_motd->setFile(path);
 }
 
 void IRCServer::createWakuBridge()
 {
     // Create a bot client without a socket
-    m_wakuBridge = new IRCClient(nullptr, this);
-    m_wakuBridge->setNick("waku_bridge");
-    m_wakuBridge->setUser("waku");
+    m_wakuBridge = m_clientPool.create(nullptr, nullptr, m_strings.intern(QByteArrayView("bot.localhost")));
+    m_wakuBridge->setNick(m_strings.intern(QByteArrayView("waku_bridge")));
+    m_wakuBridge->setUser(m_strings.intern(QByteArrayView("waku")));
     m_wakuBridge->setRegistered(true);
+    m_nicks.insert(m_wakuBridge->nickKey(), m_wakuBridge);
     
     // Add the bot to #general channel
-    QString generalChannel = "#general";
-    m_wakuBridge->joinChannel(generalChannel);
-    m_channels[generalChannel].insert(m_wakuBridge);
+    m_channels.join(m_channels.findOrCreate("#general"), m_wakuBridge);
     
     qDebug() << "Created waku_bridge bot and added to #general";
 }
 
-void IRCServer::wakuBridgeResponse(const QString& channel, IRCClient* sender, const QString& message)
+void IRCServer::wakuBridgeResponse(const IRCChannel* channel, IRCClient* sender, const QString& message)
 {
     Q_UNUSED(message)
     
     // Only respond in #general channel and not to the bot itself
-    if (channel == "#general" && sender != m_wakuBridge) {
-        // Send the response from waku_bridge
-        QString prefix = m_wakuBridge->nick() + "!" + m_wakuBridge->user() + "@" + m_wakuBridge->hostAddress();
+    if (channel->name() == "#general" && sender != m_wakuBridge) {
+        // Broadcast the response from waku_bridge to all users in the channel
+        sendToChannel(channel, IRCMessage::format(m_wakuBridge->encodedPrefix(), "PRIVMSG", channel->encodedName(), "hello back!"), m_wakuBridge);
+        m_history.append(channel->foldedName(), QDateTime::currentMSecsSinceEpoch(), m_wakuBridge->encodedPrefix(), "hello back!");
         
-        // Broadcast the response to all users in the channel
-        if (m_channels.contains(channel)) {
-            for (IRCClient* channelClient : m_channels[channel]) {
-                if (channelClient != m_wakuBridge && channelClient->isRegistered()) {
-                    channelClient->sendMessage(prefix, "PRIVMSG", channel + " :hello back!");
-                }
+        IRC_TRACE(Bridge, "bot_reply", "nick=" + sender->nick() + " channel=" + channel->name());
+    }
+}
+
+void IRCServer::handleQuit(IRCClient* client, const IRCParsedMessage& message)
+{
+    QString reason = message.paramCount > 0 ? QString::fromUtf8(message.param(0)) : "Client quit";
+    
+    quitChannels(client, reason);
+    
+    // The nick is free again right away, even if the socket takes a while to close
+    unregisterNick(client);
+    
+    IRC_DEBUG(Client, "quit", "nick=" + client->nick() + " reason=" + IRCLog::quoted(reason));
+    client->setClosing(true);
+    client->flood().clear();
+    m_timers.arm(&client->timer(), currentTick() + CloseGrace);
+    client->disconnectFromHost();
+}
+
+void IRCServer::handleCap(IRCClient* client, const IRCParsedMessage& message)
+{
+    if (message.paramCount < 1) return;
+    
+    QByteArray nick = client->nick().isEmpty() ? QByteArray("*") : client->encodedNick();
+    QByteArray subcommand = message.param(0).toByteArray().toUpper();
+    
+    if (subcommand == "LS" || subcommand == "LIST") {
+        // CAP LS before registration holds the welcome back until CAP END
+        if (subcommand == "LS" && !client->isRegistered()) {
+            client->setNegotiatingCaps(true);
+        }
+        uint offered = subcommand == "LS" ? ~0u : client->capabilities();
+        client->sendLine(IRCMessage::format(m_encodedServerName, "CAP", nick + " " + subcommand, capabilityList(offered)));
+    } else if (subcommand == "REQ") {
+        if (!client->isRegistered()) {
+            client->setNegotiatingCaps(true);
+        }
+        
+        // A request is applied whole or not at all
+        QByteArray requested = message.param(1).toByteArray();
+        uint enabled = client->capabilities();
+        bool known = true;
+        for (const QByteArray& name : requested.split(' ')) {
+            if (name.isEmpty()) continue;
+            bool disable = name.startsWith('-');
+            uint capability = capabilityByName(disable ? name.mid(1) : name);
+            if (!capability) {
+                known = false;
+                break;
             }
+            enabled = disable ? enabled & ~capability : enabled | capability;
         }
         
-        qDebug() << "waku_bridge responded to message from" << sender->nick() << "in" << channel;
+        if (known) {
+            client->setCapabilities(enabled);
+        }
+        client->sendLine(IRCMessage::format(m_encodedServerName, "CAP", nick + (known ? " ACK" : " NAK"), requested));
+    } else if (subcommand == "END") {
+        client->setNegotiatingCaps(false);
+    } else {
+        // ERR_INVALIDCAPCMD
+        client->sendLine(IRCMessage::format(m_encodedServerName, "410", nick + " " + message.param(0).toByteArray(), "Invalid CAP command"));
     }
 }
 
-void IRCServer::handleQuit(IRCClient* client, const QStringList& args)
+void IRCServer::handleChatHistory(IRCClient* client, const IRCParsedMessage& message)
 {
-    QString reason = args.isEmpty() ? "Client quit" : args.join(" ");
-    if (reason.startsWith(":")) {
-        reason = reason.mid(1);
+    if (!client->isRegistered()) return;
+    
+    // CHATHISTORY <LATEST|BEFORE|AFTER> <target> <* | timestamp=...> <limit>
+    if (message.paramCount < 4) {
+        client->sendLine(IRCMessage::format(m_encodedServerName, "FAIL", "CHATHISTORY NEED_MORE_PARAMS", "Missing parameters"));
+        return;
     }
     
-    // Notify all users in channels where this client is present
-    if (client->isRegistered()) {
-        QString prefix = client->nick() + "!" + client->user() + "@" + client->hostAddress();
-        QSet<IRCClient*> notifiedClients;
-        
-        for (const QString& channel : client->channels()) {
-            if (m_channels.contains(channel)) {
-                for (IRCClient* channelClient : m_channels[channel]) {
-                    if (channelClient != client && !notifiedClients.contains(channelClient)) {
-                        channelClient->sendMessage(prefix, "QUIT", ":" + reason);
-                        notifiedClients.insert(channelClient);
-                    }
-                }
+    QByteArray subcommand = message.param(0).toByteArray().toUpper();
+    QByteArrayView target = message.param(1);
+    QByteArray reference = message.param(2).toByteArray();
+    
+    if (subcommand != "LATEST" && subcommand != "BEFORE" && subcommand != "AFTER") {
+        client->sendLine(IRCMessage::format(m_encodedServerName, "FAIL", "CHATHISTORY INVALID_PARAMS " + subcommand, "Unknown subcommand"));
+        return;
+    }
+    
+    // Only members may read a channel's history
+    const IRCChannel* channel = m_channels.find(target);
+    if (!channel || !client->isInChannel(channel)) {
+        client->sendLine(IRCMessage::format(m_encodedServerName, "FAIL", "CHATHISTORY INVALID_TARGET " + subcommand + " " + target.toByteArray(), "Messages could not be retrieved"));
+        return;
+    }
+    
+    qint64 time = -1;
+    if (reference.startsWith("timestamp=")) {
+        QDateTime timestamp = QDateTime::fromString(QString::fromUtf8(reference.mid(10)), Qt::ISODateWithMs);
+        if (timestamp.isValid()) {
+            time = timestamp.toMSecsSinceEpoch();
+        }
+    }
+    if (time < 0 && !(subcommand == "LATEST" && reference == "*")) {
+        client->sendLine(IRCMessage::format(m_encodedServerName, "FAIL", "CHATHISTORY INVALID_PARAMS " + subcommand + " " + reference, "Invalid message reference"));
+        return;
+    }
+    
+    bool ok = false;
+    int limit = message.param(3).toByteArray().toInt(&ok);
+    if (!ok || limit <= 0) {
+        client->sendLine(IRCMessage::format(m_encodedServerName, "FAIL", "CHATHISTORY INVALID_PARAMS " + subcommand, "Invalid limit"));
+        return;
+    }
+    limit = qMin(limit, MaxChatHistoryLimit);
+    
+    QList<IRCHistoryEntry> entries;
+    if (subcommand == "LATEST") {
+        entries = m_history.latest(channel->foldedName(), time, limit);
+    } else if (subcommand == "BEFORE") {
+        entries = m_history.before(channel->foldedName(), time, limit);
+    } else {
+        entries = m_history.after(channel->foldedName(), time, limit);
+    }
+    
+    // The page goes out as one write, wrapped in a batch for clients that
+    // asked for it and stamped with the original time for server-time
+    QByteArray reply;
+    QByteArray batchTag;
+    if (client->hasCapability(IRCClient::Batch)) {
+        QByteArray batch = QByteArray::number(++m_nextBatch, 36);
+        reply += IRCMessage::format(m_encodedServerName, "BATCH", "+" + batch + " chathistory", channel->encodedName());
+        batchTag = "batch=" + batch;
+    }
+    
+    bool serverTime = client->hasCapability(IRCClient::ServerTime);
+    for (const IRCHistoryEntry& entry : std::as_const(entries)) {
+        QByteArray tags = batchTag;
+        if (serverTime) {
+            if (!tags.isEmpty()) {
+                tags += ';';
             }
+            tags += "time=" + QDateTime::fromMSecsSinceEpoch(entry.time).toUTC().toString(Qt::ISODateWithMs).toUtf8();
         }
+        if (!tags.isEmpty()) {
+            reply += '@';
+            reply += tags;
+            reply += ' ';
+        }
+        reply += IRCMessage::format(entry.prefix, "PRIVMSG", channel->encodedName(), entry.text);
     }
     
-    qDebug() << "Client" << client->nick() << "quit:" << reason;
-    if (client->socket()) {
-        client->socket()->disconnectFromHost();
+    if (!batchTag.isEmpty()) {
+        reply += ":" + m_encodedServerName + " BATCH -" + batchTag.mid(6) + "\r\n";
+    }
+    if (!reply.isEmpty()) {
+        client->sendLine(reply);
     }
 }
 
-void IRCServer::injectBridgeMessage(const QString& channel, const QString& nick, const QString& message)
+void IRCServer::handleOper(IRCClient* client, const IRCParsedMessage& message)
 {
-    if (!m_channels.contains(channel)) {
-        qDebug() << "IRCServer::injectBridgeMessage: Channel" << channel << "does not exist";
+    if (!client->isRegistered()) return;
+    
+    if (message.paramCount < 2) {
+        client->sendMessage(m_serverName, "461", client->nick() + " OPER :Not enough parameters");
+        return;
+    }
+    if (m_operName.isEmpty()) {
+        client->sendMessage(m_serverName, "491", client->nick() + " :No O-lines for your host");
+        return;
+    }
+    if (QString::fromUtf8(message.param(0)) != m_operName || QString::fromUtf8(message.param(1)) != m_operPassword) {
+        client->sendMessage(m_serverName, "464", client->nick() + " :Password incorrect");
         return;
     }
     
-    // Create a bridge user prefix
-    QString prefix = nick + "!bridge@waku.bridge";
+    client->setOper(true);
+    client->sendMessage(m_serverName, "381", client->nick() + " :You are now an IRC operator");
+    IRC_INFO(Client, "oper", "nick=" + client->nick() + " host=" + client->hostAddress());
+}
+
+void IRCServer::handleStats(IRCClient* client, const IRCParsedMessage& message)
+{
+    if (!client->isRegistered()) return;
     
-    // Send the message to all users in the channel
-    QSet<IRCClient*> clients = m_channels[channel];
-    for (IRCClient* client : clients) {
-        if (client->isRegistered()) {
-            client->sendMessage(prefix, "PRIVMSG", channel + " :" + message);
+    if (!client->isOper()) {
+        client->sendMessage(m_serverName, "481", client->nick() + " :Permission Denied- You're not an IRC operator");
+        return;
+    }
+    
+    // STATS m: commands seen; u: uptime; p (the default): every metric
+    QString query = message.paramCount > 0 ? QString::fromUtf8(message.param(0)).left(1) : QString("p");
+    qint64 uptime = m_created.secsTo(QDateTime::currentDateTime());
+    
+    if (query == "m") {
+        for (int command = IRCMessage::Unknown + 1; command < IRCMessage::CommandCount; ++command) {
+            if (quint64 count = m_commandLatency[command]->count()) {
+                client->sendMessage(m_serverName, "212", client->nick() + " " + IRCMessage::commandName(IRCMessage::Command(command)) + " " + QString::number(count) + " 0 0");
+            }
+        }
+    } else if (query == "u") {
+        client->sendMessage(m_serverName, "242", client->nick() + QString(" :Server Up %1 days %2:%3:%4")
+            .arg(uptime / 86400)
+            .arg(uptime % 86400 / 3600, 2, 10, QChar('0'))
+            .arg(uptime % 3600 / 60, 2, 10, QChar('0'))
+            .arg(uptime % 60, 2, 10, QChar('0')));
+    } else if (query == "p") {
+        // One write for the whole report, it runs to a few dozen lines
+        QByteArray reply;
+        QByteArray start = ":" + m_encodedServerName + " 249 " + client->encodedNick() + " p :";
+        const QJsonObject gauges = metricsSnapshot().value("gauges").toObject();
+        for (auto it = gauges.constBegin(); it != gauges.constEnd(); ++it) {
+            reply += start + it.key().toUtf8() + ' ' + QByteArray::number(it.value().toDouble(), 'g', 15) + "\r\n";
+        }
+        for (const QByteArray& line : m_metrics.report(uptime)) {
+            reply += start + line + "\r\n";
         }
+        client->sendLine(reply);
     }
     
-    qDebug() << "IRCServer: Injected bridge message from" << nick << "to channel" << channel << ":" << message;
+    client->sendMessage(m_serverName, "219", client->nick() + " " + (query.isEmpty() ? QString("*") : query) + " :End of /STATS report");
+}
+
+void IRCServer::setOperator(const QString& name, const QString& password)
+{
+    m_operName = name;
+    m_operPassword = password;
+}
+
+QJsonObject IRCServer::metricsSnapshot() const
+{
+    qint64 sendQueueTotal = 0;
+    qint64 sendQueueMax = 0;
+    int lagging = 0;
+    qint64 clientHeap = 0;
+    for (IRCClient* client : m_clients) {
+        qint64 depth = client->sendQueueBytes();
+        sendQueueTotal += depth;
+        sendQueueMax = qMax(sendQueueMax, depth);
+        lagging += client->isLagging() ? 1 : 0;
+        clientHeap += client->heapBytes();
+    }
+    
+    // Memory per client: pool records, owned strings, interned names and,
+    // with the epoll backend, its connection records and buffers. A
+    // QTcpSocket's own allocations are not visible here; compare RSS for those.
+    qint64 connectionBytes = m_epoll ? m_epoll->memoryBytes() : 0;
+    qint64 stringBytes = m_strings.memoryBytes();
+    qint64 clientBytes = m_clientPool.reservedBytes() + clientHeap + stringBytes + connectionBytes;
+    
+    QJsonObject gauges;
+    gauges["uptime_seconds"] = m_created.secsTo(QDateTime::currentDateTime());
+    gauges["clients"] = int(m_clients.size());
+    gauges["nicks"] = int(m_nicks.size());
+    gauges["channels"] = int(m_channels.size());
+    gauges["worker_threads"] = int(m_shards.size());
+    gauges["epoll_backend"] = m_epoll ? 1 : 0;
+    gauges["sendq_bytes_total"] = sendQueueTotal;
+    gauges["sendq_bytes_max"] = sendQueueMax;
+    gauges["lagging_clients"] = lagging;
+    gauges["bridge.backlog_channels"] = int(m_bridgeBacklog.size());
+    gauges["flood.held_clients"] = int(m_floodHeld.size());
+    gauges["memory.client_record_bytes"] = qint64(IRCClientPool::recordBytes());
+    gauges["memory.client_slabs"] = int(m_clientPool.slabCount());
+    gauges["memory.client_pool_bytes"] = qint64(m_clientPool.reservedBytes());
+    gauges["memory.client_heap_bytes"] = clientHeap;
+    gauges["memory.string_bytes"] = stringBytes;
+    gauges["strings.interned"] = int(m_strings.size());
+    gauges["memory.connection_bytes"] = connectionBytes;
+    gauges["memory.bytes_per_client"] = m_clients.isEmpty() ? 0 : clientBytes / m_clients.size();
+    
+    QJsonObject snapshot = m_metrics.toJson();
+    snapshot["gauges"] = gauges;
+    return snapshot;
+}
+
+void IRCServer::quitChannels(IRCClient* client, const QString& reason)
+{
+    // Leaving right away means a later disconnect has nothing left to announce
+    if (client->isRegistered() && !client->memberships().isEmpty()) {
+        sendToNeighbours(client, IRCMessage::format(client->prefix(), "QUIT", ":" + reason));
+    }
+    m_channels.partAll(client);
+}
+
+void IRCServer::setHistoryCapacity(int entries)
+{
+    m_history.setCapacity(entries);
+}
+
+bool IRCServer::setHistoryStorage(const QString& directory, qint64 segmentBytes, qint64 retentionBytes)
+{
+    if (!m_history.setStorage(directory, segmentBytes, retentionBytes)) {
+        qWarning() << "IRCServer: cannot keep history in" << directory << ", keeping it in memory";
+        return false;
+    }
+    return true;
+}
+
+void IRCServer::injectBridgeMessage(const QString& channel, const QString& nick, const QString& message, qint64 time)
+{
+    // Chat text goes into a shared line and onto disk as is; a line break in
+    // it would forge IRC lines for every member and every later reader
+    const QString text = IRCMessage::stripLineBreaks(message);
+    
+    // Create a bridge user prefix
+    QString prefix = IRCMessage::stripLineBreaks(nick) + "!bridge@waku.bridge";
+    
+    // Stored under the casemapped name even while the channel has no members;
+    // chat will not replay what arrived meanwhile
+    const IRCChannel* target = m_channels.find(channel);
+    const QString key = target ? target->foldedName() : QString::fromUtf8(IRCMessage::foldCase(channel.toUtf8()));
+    m_history.append(key, time > 0 ? time : QDateTime::currentMSecsSinceEpoch(), prefix.toUtf8(), text.toUtf8());
+    if (!target) {
+        IRC_DEBUG(Bridge, "inject_no_channel", "channel=" + channel);
+        return;
+    }
+    
+    m_bridgeInjected->add();
+    
+    // Queue the message; a burst for one channel becomes a single fan-out,
+    // whatever spelling chat used, and members see the channel's own name
+    m_bridgeBacklog[target->foldedName()] += IRCMessage::format(prefix, "PRIVMSG", target->name() + " :" + text);
+    if (!m_bridgeFlushScheduled) {
+        m_bridgeFlushScheduled = true;
+        QMetaObject::invokeMethod(this, &IRCServer::flushBridgeMessages, Qt::QueuedConnection);
+    }
+    
+    IRC_TRACE(Bridge, "injected", "nick=" + IRCLog::quoted(nick) + " channel=" + channel + " text=" + IRCLog::quoted(text));
+}
+
+void IRCServer::recordBridgeHistory(const QString& channel, const QString& nick, const QString& message, qint64 time)
+{
+    // Stored lines are matched by time, so a line without one would be
+    // stored again on every replay
+    if (time <= 0) {
+        return;
+    }
+    QByteArray prefix = QString(IRCMessage::stripLineBreaks(nick) + "!bridge@waku.bridge").toUtf8();
+    QByteArray text = IRCMessage::stripLineBreaks(message).toUtf8();
+    
+    // Under the casemapped name, as IRC users' messages are, whether or not
+    // the channel has members right now
+    const IRCChannel* target = m_channels.find(channel);
+    const QString key = target ? target->foldedName() : QString::fromUtf8(IRCMessage::foldCase(channel.toUtf8()));
+    if (!m_history.contains(key, time, prefix, text)) {
+        m_history.append(key, time, prefix, text);
+    }
+}
+
+void IRCServer::flushBridgeMessages()
+{
+    m_bridgeFlushScheduled = false;
+    
+    QHash<QString, QByteArray> backlog;
+    backlog.swap(m_bridgeBacklog);
+    for (auto it = backlog.cbegin(); it != backlog.cend(); ++it) {
+        // The channel may have emptied since the messages were queued; the
+        // casemapped key finds it again if it still exists
+        if (const IRCChannel* channel = m_channels.find(it.key())) {
+            sendToChannel(channel, it.value());
+        }
+    }
 } 
\ No newline at end of file
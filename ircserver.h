@@ -2,13 +2,29 @@
 #define IRCSERVER_H
 
 #include <QObject>
+#include <QDateTime>
+#include <QElapsedTimer>
 #include <QTcpServer>
 #include <QMap>
+#include <QHash>
+#include <QJsonObject>
 #include <QString>
-#include <QSet>
+#include <QList>
+#include "ircchannel.h"
 #include "ircclient.h"
+#include "ircepoll.h"
+#include "ircflood.h"
+#include "irchistory.h"
+#include "ircmessage.h"
+#include "ircmetrics.h"
+#include "ircmotd.h"
+#include "ircshard.h"
+#include "irctimerwheel.h"
 
-class IRCServer : public QObject
+class QThread;
+class QTimer;
+
+class IRCServer : public QObject, public IRCShardSink, public IRCEpollSink
 {
     Q_OBJECT
 
@@ -17,45 +33,214 @@ signals:
     void messageSent(const QString& channel, const QString& nick, const QString& message);
 
 public:
+    // How client sockets are served
+    enum Backend {
+        QtSockets,      // a QTcpSocket per connection, optionally on worker shards
+        Epoll           // IRCEpollServer on this thread, Linux only
+    };
+
     explicit IRCServer(QObject* parent = nullptr);
     ~IRCServer();
 
     bool start(const QString& host = "0.0.0.0", quint16 port = 6667);
     void stop();
     
-    // Bridge methods for external message injection
-    void injectBridgeMessage(const QString& channel, const QString& nick, const QString& message);
+    // Number of worker threads serving client sockets, applied on start().
+    // 0 serves everything on the server's own thread.
+    void setWorkerThreads(int count);
+    int workerThreads() const { return m_workerThreads; }
+    
+    // Connection backend, applied on start(). Epoll falls back to QtSockets
+    // where it is not supported, and does not use worker threads.
+    void setBackend(Backend backend);
+    Backend backend() const { return m_backend; }
+    
+    // Outbound queue limit applied to every client connection
+    void setSendQueueLimit(qint64 bytes, IRCConnection::SendQueuePolicy policy);
+    // Current send queue depth in bytes, keyed by nick
+    QMap<QString, qint64> sendQueueDepths() const;
+    
+    // Serves the MOTD from a file, reloaded whenever it changes. An empty
+    // path restores the built-in MOTD.
+    void setMotdFile(const QString& path);
+    
+    // Messages kept per channel in memory for CHATHISTORY
+    void setHistoryCapacity(int entries);
+    // Keeps history in append-only segment files under directory instead,
+    // see IRCHistory::setStorage
+    bool setHistoryStorage(const QString& directory, qint64 segmentBytes, qint64 retentionBytes);
+    IRCHistoryStats historyStats() const { return m_history.stats(); }
+    
+    // Per-client rate limits. Lines a client cannot pay for are held back and
+    // run as its tokens come back, round-robin with other held clients; a
+    // client with a full queue is disconnected with "Excess Flood".
+    void setFloodLimits(const IRCFloodLimits& limits);
+    const IRCFloodLimits& floodLimits() const { return m_floodLimits; }
+    
+    // Seconds a connection has to complete NICK/USER, seconds of silence
+    // before the server sends a PING, and seconds it waits for any reply
+    void setTimeouts(int registration, int pingInterval, int pingTimeout);
+    
+    // Credentials accepted by OPER, which unlocks STATS. An empty name
+    // disables OPER.
+    void setOperator(const QString& name, const QString& password);
+    
+    // Counters and latency histograms; other components may register theirs
+    IRCMetrics& metrics() { return m_metrics; }
+    // The registry plus current gauges: connections, channels, send queues
+    QJsonObject metricsSnapshot() const;
+    
+    // Bridge methods for external message injection. Messages are queued per
+    // channel and fanned out together once per event loop pass. Every message
+    // is stored in history, even when the channel has no members to relay it
+    // to. time is in ms since epoch; 0 means now.
+    void injectBridgeMessage(const QString& channel, const QString& nick, const QString& message, qint64 time = 0);
+    // Stores a bridged message in the channel history without relaying it;
+    // clients page through it with CHATHISTORY. Messages already stored are
+    // skipped, so overlapping replays are harmless; so are messages without
+    // a time (time <= 0), which could not be matched.
+    void recordBridgeHistory(const QString& channel, const QString& nick, const QString& message, qint64 time);
+
+    // IRCShardSink, called from worker threads
+    void postShardEvent(IRCShardEvent&& event) override;
+    
+    // IRCEpollSink, called on this thread
+    void epollConnected(IRCEpollConnection* connection, const QString& peerAddress) override;
+    void epollLineReceived(IRCEpollConnection* connection, QByteArrayView line) override;
+    void epollLineTooLong(IRCEpollConnection* connection) override;
+    void epollSendQueueExceeded(IRCEpollConnection* connection) override;
+    void epollDisconnected(IRCEpollConnection* connection) override;
 
 private slots:
-    void onNewConnection();
-    void onClientMessage(const QString& message);
-    void onClientDisconnected();
+    void drainShardEvents();
+    void flushBridgeMessages();
+    void drainHeldLines();
+    void advanceTimers();
+    void freeReleasedClients();
 
 private:
-    void handleClientMessage(IRCClient* client, const QString& message);
+    void startShards();
+    void stopShards();
+    void onIncomingConnection(qintptr descriptor);
+    IRCClient* clientConnected(IRCConnection* connection, IRCShard* shard, const QString& hostAddress);
+    IRCClient* addClient(IRCClient* client);
+    void releaseClient(IRCClient* client);
+    void processLine(IRCClient* client, QByteArrayView line);
+    qint64 commandCost(IRCClient* client, const IRCParsedMessage& message) const;
+    void holdLine(IRCClient* client, QByteArrayView line);
+    void clientExcessFlood(IRCClient* client);
+    quint64 currentTick() const;
+    void timerExpired(IRCClient* client);
+    void closeLink(IRCClient* client, const QString& reason);
+    void clientLineTooLong(IRCClient* client);
+    void clientSendQueueExceeded(IRCClient* client);
+    void clientDisconnected(IRCClient* client);
+    void handleClientMessage(IRCClient* client, const IRCParsedMessage& message);
     void sendWelcome(IRCClient* client);
-    void broadcastToChannel(const QString& channel, IRCClient* sender, const QString& message);
-    void removeClientFromChannels(IRCClient* client);
+    void renderReplies();
+    void sendToChannel(const IRCChannel* channel, const QByteArray& line, IRCClient* except = nullptr);
+    void sendToNeighbours(IRCClient* client, const QByteArray& line);
+    void addRecipient(IRCClient* client, const QByteArray& line);
+    void flushRecipients(const QByteArray& line);
+    quint32 nextFanoutMark();
+    void unregisterNick(IRCClient* client);
+    void relayMessage(IRCClient* client, const IRCParsedMessage& message, bool notice);
+    void quitChannels(IRCClient* client, const QString& reason);
     void createWakuBridge();
-    void wakuBridgeResponse(const QString& channel, IRCClient* sender, const QString& message);
+    void wakuBridgeResponse(const IRCChannel* channel, IRCClient* sender, const QString& message);
     
     // Command handlers
-    void handleNick(IRCClient* client, const QStringList& args);
-    void handleUser(IRCClient* client, const QStringList& args);
-    void handlePing(IRCClient* client, const QStringList& args);
-    void handleJoin(IRCClient* client, const QStringList& args);
-    void handlePart(IRCClient* client, const QStringList& args);
-    void handlePrivmsg(IRCClient* client, const QStringList& args);
-    void handleWho(IRCClient* client, const QStringList& args);
-    void handleMode(IRCClient* client, const QStringList& args);
-    void handleMotd(IRCClient* client, const QStringList& args);
-    void handleQuit(IRCClient* client, const QStringList& args);
+    void handleNick(IRCClient* client, const IRCParsedMessage& message);
+    void handleUser(IRCClient* client, const IRCParsedMessage& message);
+    void handlePing(IRCClient* client, const IRCParsedMessage& message);
+    void handleJoin(IRCClient* client, const IRCParsedMessage& message);
+    void handlePart(IRCClient* client, const IRCParsedMessage& message);
+    void handlePrivmsg(IRCClient* client, const IRCParsedMessage& message);
+    void handleNotice(IRCClient* client, const IRCParsedMessage& message);
+    void handleWho(IRCClient* client, const IRCParsedMessage& message);
+    void handleMode(IRCClient* client, const IRCParsedMessage& message);
+    void handleMotd(IRCClient* client, const IRCParsedMessage& message);
+    void handleQuit(IRCClient* client, const IRCParsedMessage& message);
+    void handleCap(IRCClient* client, const IRCParsedMessage& message);
+    void handleChatHistory(IRCClient* client, const IRCParsedMessage& message);
+    void handleOper(IRCClient* client, const IRCParsedMessage& message);
+    void handleStats(IRCClient* client, const IRCParsedMessage& message);
 
     QTcpServer* m_server;
-    QMap<QTcpSocket*, IRCClient*> m_clients;
-    QMap<QString, QSet<IRCClient*>> m_channels;
+    IRCEpollServer* m_epoll;    // Only while serving with the epoll backend
+    Backend m_backend;
+    // Nicks, users, hosts and channel names; declared first so it outlives
+    // every client and channel holding one
+    IRCStringTable m_strings;
+    QMap<const void*, IRCClient*> m_clients;    // Keyed by IRCClient::connectionKey()
+    // Client records, and those released but not yet freed
+    IRCClientPool m_clientPool;
+    QList<IRCClient*> m_releasedClients;
+    bool m_releaseScheduled;
+    IRCChannelRegistry m_channels;
+    QHash<const IRCInternedString*, IRCClient*> m_nicks;  // Keyed by IRCClient::nickKey()
     QString m_serverName;
+    QByteArray m_encodedServerName;
+    QDateTime m_created;
+    IRCMotd* m_motd;
+    // Registration burst and MOTD, rendered once with a slot for the nick
+    IRCReplyTemplate m_welcomeReply;
+    IRCReplyTemplate m_motdReply;
     IRCClient* m_wakuBridge;  // Built-in bot user
+    QHash<QString, QByteArray> m_bridgeBacklog;  // Encoded lines per casemapped channel name
+    bool m_bridgeFlushScheduled;
+    IRCHistory m_history;
+    quint32 m_nextBatch;  // Source of BATCH reference tags
+    QString m_operName;
+    QString m_operPassword;
+    
+    // Flood control: clients with held lines in the order they were held,
+    // drained on a timer while there are any
+    IRCFloodLimits m_floodLimits;
+    QList<IRCClient*> m_floodHeld;
+    QTimer* m_floodTimer;
+    QElapsedTimer m_clock;
+    
+    // Timeouts, one timer per client on a wheel that a single coarse timer
+    // advances; in seconds, which is also the wheel's tick
+    IRCTimerWheel m_timers;
+    QTimer* m_wheelTimer;
+    int m_registrationTimeout;
+    int m_pingInterval;
+    int m_pingTimeout;
+    QByteArray m_pingLine;
+    
+    // Instruments looked up once, so the hot paths only bump atomics
+    IRCMetrics m_metrics;
+    IRCCounter* m_linesIn;
+    IRCCounter* m_bytesIn;
+    IRCCounter* m_linesTooLong;
+    IRCCounter* m_connectionsAccepted;
+    IRCCounter* m_connectionsClosed;
+    IRCCounter* m_sendQueueOverflows;
+    IRCCounter* m_bridgeInjected;
+    IRCCounter* m_linesHeld;
+    IRCCounter* m_excessFloods;
+    IRCCounter* m_pingsSent;
+    IRCCounter* m_registrationTimeouts;
+    IRCCounter* m_pingTimeouts;
+    IRCHistogram* m_parseLatency;
+    IRCHistogram* m_fanoutSize;
+    IRCHistogram* m_commandLatency[IRCMessage::CommandCount];
+    qint64 m_sendQueueLimit;
+    IRCConnection::SendQueuePolicy m_sendQueuePolicy;
+    
+    // Worker shards, empty when serving on this thread only
+    int m_workerThreads;
+    int m_nextShard;
+    QList<IRCShard*> m_shards;
+    QList<QThread*> m_shardThreads;
+    IRCMpscQueue<IRCShardEvent> m_shardEvents;
+    
+    // Fan-out state: per-shard recipient lists, and the mark that tells
+    // which clients the current neighbour fan-out has already reached
+    QList<QList<IRCConnection*>> m_fanoutTargets;
+    quint32 m_fanoutMark;
 };
 
 #endif // IRCSERVER_H 
\ No newline at end of file
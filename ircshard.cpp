@@ -0,0 +1,231 @@
+#include "ircshard.h"
+#include <QDebug>
+#include <QTcpSocket>
+
+namespace {
+// Bound the work done per event loop pass so socket I/O is not starved
+constexpr int MaxEventsPerDrain = 1024;
+}
+
+IRCShard::IRCShard(int index, IRCShardSink* sink, QObject* parent)
+    : QObject(parent)
+    , m_index(index)
+    , m_sink(sink)
+    , m_flushScheduled(false)
+    , m_sendQueueLimit(IRCConnection::DefaultSendQueueLimit)
+    , m_sendQueuePolicy(IRCConnection::Disconnect)
+{
+}
+
+IRCShard::~IRCShard()
+{
+    qDeleteAll(m_connections);
+}
+
+void IRCShard::post(IRCShardEvent&& event)
+{
+    if (m_inbound.push(std::move(event))) {
+        QMetaObject::invokeMethod(this, &IRCShard::drain, Qt::QueuedConnection);
+    }
+}
+
+void IRCShard::accept(qintptr descriptor)
+{
+    IRCShardEvent event;
+    event.type = IRCShardEvent::Accept;
+    event.descriptor = descriptor;
+    post(std::move(event));
+}
+
+void IRCShard::send(IRCConnection* connection, const QByteArray& line)
+{
+    IRCShardEvent event;
+    event.type = IRCShardEvent::Send;
+    event.connection = connection;
+    event.data = line;
+    post(std::move(event));
+}
+
+void IRCShard::sendToMany(QList<IRCConnection*>&& connections, const QByteArray& line)
+{
+    IRCShardEvent event;
+    event.type = IRCShardEvent::Send;
+    event.targets = std::move(connections);
+    event.data = line;
+    post(std::move(event));
+}
+
+void IRCShard::disconnectFromHost(IRCConnection* connection)
+{
+    IRCShardEvent event;
+    event.type = IRCShardEvent::Close;
+    event.connection = connection;
+    post(std::move(event));
+}
+
+void IRCShard::abort(IRCConnection* connection)
+{
+    IRCShardEvent event;
+    event.type = IRCShardEvent::Abort;
+    event.connection = connection;
+    post(std::move(event));
+}
+
+void IRCShard::release(IRCConnection* connection)
+{
+    IRCShardEvent event;
+    event.type = IRCShardEvent::Release;
+    event.connection = connection;
+    post(std::move(event));
+}
+
+void IRCShard::configure(qint64 sendQueueLimit, IRCConnection::SendQueuePolicy policy)
+{
+    IRCShardEvent event;
+    event.type = IRCShardEvent::Configure;
+    event.value = sendQueueLimit;
+    event.policy = policy;
+    post(std::move(event));
+}
+
+void IRCShard::shutdown()
+{
+    m_pendingLines.clear();
+    for (IRCConnection* connection : std::as_const(m_connections)) {
+        connection->abort();
+        delete connection;
+    }
+    m_connections.clear();
+}
+
+void IRCShard::drain()
+{
+    m_inbound.beginDrain();
+
+    IRCShardEvent event;
+    for (int handled = 0; handled < MaxEventsPerDrain; ++handled) {
+        if (!m_inbound.pop(event)) {
+            return;
+        }
+        handle(event);
+    }
+
+    // More work left; continue on the next pass
+    QMetaObject::invokeMethod(this, &IRCShard::drain, Qt::QueuedConnection);
+}
+
+void IRCShard::handle(IRCShardEvent& event)
+{
+    // Connections stay allocated until the server releases them, so the
+    // pointers in server events are always valid here
+    switch (event.type) {
+    case IRCShardEvent::Accept:
+        addConnection(event.descriptor);
+        break;
+    case IRCShardEvent::Send:
+        if (event.connection) {
+            event.connection->sendLine(event.data);
+        }
+        for (IRCConnection* connection : std::as_const(event.targets)) {
+            connection->sendLine(event.data);
+        }
+        break;
+    case IRCShardEvent::Close:
+        event.connection->disconnectFromHost();
+        break;
+    case IRCShardEvent::Abort:
+        event.connection->abort();
+        break;
+    case IRCShardEvent::Release:
+        m_pendingLines.remove(event.connection);
+        m_connections.remove(event.connection);
+        event.connection->deleteLater();
+        break;
+    case IRCShardEvent::Configure:
+        m_sendQueueLimit = event.value;
+        m_sendQueuePolicy = event.policy;
+        for (IRCConnection* connection : std::as_const(m_connections)) {
+            connection->setSendQueueLimit(m_sendQueueLimit, m_sendQueuePolicy);
+        }
+        break;
+    default:
+        qWarning() << "IRCShard: unexpected event type" << event.type;
+        break;
+    }
+}
+
+void IRCShard::addConnection(qintptr descriptor)
+{
+    QTcpSocket* socket = new QTcpSocket;
+    if (!socket->setSocketDescriptor(descriptor)) {
+        qWarning() << "IRCShard: failed to adopt accepted socket:" << socket->errorString();
+        delete socket;
+        return;
+    }
+
+    IRCConnection* connection = new IRCConnection(socket);
+    connection->setSendQueueLimit(m_sendQueueLimit, m_sendQueuePolicy);
+    m_connections.insert(connection);
+
+    connect(connection, &IRCConnection::lineReceived, this, [this, connection](QByteArrayView line) {
+        queueLine(connection, line);
+    });
+    connect(connection, &IRCConnection::lineTooLong, this, [this, connection]() {
+        flushLines(connection);
+        postToServer(IRCShardEvent::LineTooLong, connection);
+    });
+    connect(connection, &IRCConnection::sendQueueExceeded, this, [this, connection]() {
+        flushLines(connection);
+        postToServer(IRCShardEvent::SendQueueExceeded, connection);
+    });
+    connect(connection, &IRCConnection::disconnected, this, [this, connection]() {
+        flushLines(connection);
+        postToServer(IRCShardEvent::Disconnected, connection);
+    });
+
+    postToServer(IRCShardEvent::Connected, connection, connection->peerAddress().toUtf8());
+}
+
+void IRCShard::queueLine(IRCConnection* connection, QByteArrayView line)
+{
+    // Lines received during one pass are batched per connection and posted
+    // together, so the server gets one event per read rather than per line
+    QByteArray& pending = m_pendingLines[connection];
+    pending.append(line.data(), line.size());
+    pending.append('\n');
+
+    if (!m_flushScheduled) {
+        m_flushScheduled = true;
+        QMetaObject::invokeMethod(this, &IRCShard::flushInbound, Qt::QueuedConnection);
+    }
+}
+
+void IRCShard::flushLines(IRCConnection* connection)
+{
+    auto it = m_pendingLines.find(connection);
+    if (it == m_pendingLines.end()) {
+        return;
+    }
+    QByteArray lines = std::move(it.value());
+    m_pendingLines.erase(it);
+    postToServer(IRCShardEvent::Lines, connection, lines);
+}
+
+void IRCShard::flushInbound()
+{
+    m_flushScheduled = false;
+    for (auto it = m_pendingLines.begin(); it != m_pendingLines.end(); ++it) {
+        postToServer(IRCShardEvent::Lines, it.key(), it.value());
+    }
+    m_pendingLines.clear();
+}
+
+void IRCShard::postToServer(IRCShardEvent::Type type, IRCConnection* connection, const QByteArray& data)
+{
+    IRCShardEvent event;
+    event.type = type;
+    event.shard = this;
+    event.connection = connection;
+    event.data = data;
+    m_sink->postShardEvent(std::move(event));
+}
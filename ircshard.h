@@ -0,0 +1,105 @@
+#ifndef IRCSHARD_H
+#define IRCSHARD_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QSet>
+#include "ircconnection.h"
+#include "ircqueue.h"
+
+class IRCShard;
+
+// Unit of work exchanged between the server thread and a worker shard
+struct IRCShardEvent
+{
+    enum Type {
+        // Server thread -> shard
+        Accept,             // descriptor: take over a freshly accepted socket
+        Send,               // data: line for connection, or for every entry in targets
+        Close,              // graceful disconnect of connection
+        Abort,              // immediate disconnect of connection
+        Release,            // the server forgot connection, it may be deleted
+        Configure,          // value/policy: send queue limit for all connections
+
+        // Shard -> server thread
+        Connected,          // data: peer address
+        Lines,              // data: '\n' separated lines received on connection
+        LineTooLong,
+        SendQueueExceeded,
+        Disconnected
+    };
+
+    Type type = Send;
+    IRCShard* shard = nullptr;
+    IRCConnection* connection = nullptr;
+    QList<IRCConnection*> targets;
+    QByteArray data;
+    qintptr descriptor = -1;
+    qint64 value = 0;
+    IRCConnection::SendQueuePolicy policy = IRCConnection::Disconnect;
+};
+
+// Receives events posted by worker shards. Implemented by the server; must be
+// safe to call from any thread.
+class IRCShardSink
+{
+public:
+    virtual ~IRCShardSink() {}
+    virtual void postShardEvent(IRCShardEvent&& event) = 0;
+};
+
+// One worker thread's share of the client connections. The shard owns their
+// sockets, frames input and runs their send queues on its own event loop,
+// while channel and nick state stays on the server thread.
+//
+// Everything the server sends goes through this shard's inbound queue, which
+// has a single producer (the server thread) and is drained in order, so each
+// recipient sees channel traffic in the order the server produced it. A
+// channel fan-out costs one queue entry per shard, not one per member.
+class IRCShard : public QObject
+{
+    Q_OBJECT
+
+public:
+    IRCShard(int index, IRCShardSink* sink, QObject* parent = nullptr);
+    ~IRCShard();
+
+    int index() const { return m_index; }
+
+    // Thread-safe; called from the server thread
+    void post(IRCShardEvent&& event);
+    void accept(qintptr descriptor);
+    void send(IRCConnection* connection, const QByteArray& line);
+    void sendToMany(QList<IRCConnection*>&& connections, const QByteArray& line);
+    void disconnectFromHost(IRCConnection* connection);
+    void abort(IRCConnection* connection);
+    void release(IRCConnection* connection);
+    void configure(qint64 sendQueueLimit, IRCConnection::SendQueuePolicy policy);
+
+    // Deletes every connection; invoke on the shard thread before stopping it
+    Q_INVOKABLE void shutdown();
+
+private slots:
+    void drain();
+    void flushInbound();
+
+private:
+    void handle(IRCShardEvent& event);
+    void addConnection(qintptr descriptor);
+    void queueLine(IRCConnection* connection, QByteArrayView line);
+    void flushLines(IRCConnection* connection);
+    void postToServer(IRCShardEvent::Type type, IRCConnection* connection, const QByteArray& data = QByteArray());
+
+    int m_index;
+    IRCShardSink* m_sink;
+    IRCMpscQueue<IRCShardEvent> m_inbound;
+    QSet<IRCConnection*> m_connections;
+    QHash<IRCConnection*, QByteArray> m_pendingLines;
+    bool m_flushScheduled;
+    qint64 m_sendQueueLimit;
+    IRCConnection::SendQueuePolicy m_sendQueuePolicy;
+};
+
+#endif // IRCSHARD_H
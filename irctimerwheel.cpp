@@ -0,0 +1,85 @@
+#include "irctimerwheel.h"
+
+void IRCTimer::unlink()
+{
+    if (!next) {
+        return;
+    }
+    prev->next = next;
+    next->prev = prev;
+    prev = next = nullptr;
+}
+
+IRCTimerWheel::IRCTimerWheel()
+    : m_next(0)
+{
+    for (auto& level : m_slots) {
+        for (IRCTimer& head : level) {
+            head.prev = head.next = &head;
+        }
+    }
+}
+
+IRCTimerWheel::~IRCTimerWheel()
+{
+    // Timers still armed must not point into freed slots when they go away
+    for (auto& level : m_slots) {
+        for (IRCTimer& head : level) {
+            IRCTimer* timer = head.next;
+            while (timer != &head) {
+                IRCTimer* next = timer->next;
+                timer->prev = timer->next = nullptr;
+                timer = next;
+            }
+            head.prev = head.next = nullptr;
+        }
+    }
+}
+
+void IRCTimerWheel::append(IRCTimer* head, IRCTimer* timer)
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+void IRCTimerWheel::arm(IRCTimer* timer, quint64 at)
+{
+    timer->unlink();
+
+    at = qMax(at, m_next);
+    if (at - m_next >= Horizon) {
+        at = m_next + Horizon - 1;
+    }
+    timer->expires = at;
+
+    // The lowest level whose range reaches the tick, slotted by its bits
+    // for that level
+    const quint64 delta = at - m_next;
+    int level = 0;
+    while (level < Levels - 1 && delta >= quint64(1) << (LevelBits * (level + 1))) {
+        ++level;
+    }
+    append(&m_slots[level][(at >> (LevelBits * level)) & (Slots - 1)], timer);
+}
+
+void IRCTimerWheel::cascade(int level, int slot)
+{
+    // Detach first: a timer whose tick is a full turn of this level away
+    // lands back in the same slot
+    IRCTimer* head = &m_slots[level][slot];
+    if (head->next == head) {
+        return;
+    }
+    IRCTimer* timer = head->next;
+    head->prev->next = nullptr;
+    head->prev = head->next = head;
+
+    while (timer) {
+        IRCTimer* next = timer->next;
+        timer->prev = timer->next = nullptr;
+        arm(timer, timer->expires);
+        timer = next;
+    }
+}
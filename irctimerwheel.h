@@ -0,0 +1,99 @@
+#ifndef IRCTIMERWHEEL_H
+#define IRCTIMERWHEEL_H
+
+#include <QtGlobal>
+
+// A timer that lives inside the object it times, e.g. one per client. It is
+// linked into a wheel slot while armed and unlinks itself when destroyed.
+struct IRCTimer
+{
+    IRCTimer() = default;
+    ~IRCTimer() { unlink(); }
+    Q_DISABLE_COPY(IRCTimer)
+
+    bool isArmed() const { return next != nullptr; }
+    void unlink();
+
+    IRCTimer* prev = nullptr;
+    IRCTimer* next = nullptr;
+    quint64 expires = 0;    // Tick it fires on
+    void* data = nullptr;   // The owner, for the expiry callback
+};
+
+// Hierarchical timing wheel with four levels of 64 slots, as in the classic
+// kernel timer wheel. Level 0 holds timers due within 64 ticks, one slot per
+// tick; each level above covers 64 times the range of the one below with the
+// same number of slots, and is cascaded down a slot at a time as the lower
+// level wraps around. Arming and cancelling are O(1), and so is expiry per
+// timer, amortized over the cascades. Timers further out than 64^4 ticks
+// fire at that horizon instead.
+class IRCTimerWheel
+{
+public:
+    static constexpr int LevelBits = 6;
+    static constexpr int Levels = 4;
+    static constexpr int Slots = 1 << LevelBits;
+    static constexpr quint64 Horizon = quint64(1) << (LevelBits * Levels);
+
+    IRCTimerWheel();
+    ~IRCTimerWheel();
+
+    // The next tick to be processed; every timer due before it has fired
+    quint64 now() const { return m_next; }
+
+    // Arms timer for tick at, moving it if it is already armed. A tick that
+    // has already been processed fires on the next one.
+    void arm(IRCTimer* timer, quint64 at);
+    void cancel(IRCTimer* timer) { timer->unlink(); }
+
+    // Processes every tick up to and including now, calling expired(timer)
+    // for each timer due, in tick order. The callback may arm or cancel any
+    // timer, including the one that fired.
+    template<typename Callback>
+    void advance(quint64 now, Callback&& expired);
+
+private:
+    Q_DISABLE_COPY(IRCTimerWheel)
+
+    static void append(IRCTimer* head, IRCTimer* timer);
+    void cascade(int level, int slot);
+
+    IRCTimer m_slots[Levels][Slots];    // List heads, circular
+    quint64 m_next;
+};
+
+template<typename Callback>
+void IRCTimerWheel::advance(quint64 now, Callback&& expired)
+{
+    while (m_next <= now) {
+        int slot = int(m_next & (Slots - 1));
+        // Level 0 wrapped: bring the next stretch of each level above down
+        for (int level = 1; slot == 0 && level < Levels; ++level) {
+            int upper = int((m_next >> (LevelBits * level)) & (Slots - 1));
+            cascade(level, upper);
+            if (upper != 0) break;
+        }
+
+        // Detach the slot first, so timers re-armed for this tick by the
+        // callback wait for the next one instead of looping here
+        IRCTimer due;
+        IRCTimer* head = &m_slots[0][slot];
+        if (head->next != head) {
+            due.next = head->next;
+            due.prev = head->prev;
+            due.next->prev = &due;
+            due.prev->next = &due;
+            head->next = head->prev = head;
+        }
+        ++m_next;
+
+        while (due.next && due.next != &due) {
+            IRCTimer* timer = due.next;
+            timer->unlink();
+            expired(timer);
+        }
+        due.next = due.prev = nullptr;
+    }
+}
+
+#endif // IRCTIMERWHEEL_H
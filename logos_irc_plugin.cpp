@@ -4,14 +4,40 @@
 #include <QVariantList>
 #include <QDateTime>
 #include <QJsonArray>
+#include <QJsonDocument>
 #include <QJsonObject>
+#include <QStandardPaths>
 #include "token_manager.h"
 #include "ircserver.h"
+#include "irchistorylog.h"
+#include "irclog.h"
+#include "ircmessage.h"
+
+namespace {
+// Chat events carry the timestamp as epoch seconds, ms or ns, or as ISO 8601
+// text. Returns ms since epoch, or 0 if it cannot be read.
+qint64 parseTimestamp(const QVariant& value)
+{
+    bool ok = false;
+    qint64 number = value.toLongLong(&ok);
+    if (ok) {
+        if (number >= 100000000000000000LL) return number / 1000000;   // ns
+        if (number >= 100000000000000LL) return number / 1000;         // us
+        if (number >= 100000000000LL) return number;                   // ms
+        return number * 1000;
+    }
+    QDateTime time = QDateTime::fromString(value.toString(), Qt::ISODateWithMs);
+    return time.isValid() ? time.toMSecsSinceEpoch() : 0;
+}
+}
 
 LogosIRCPlugin::LogosIRCPlugin()
 {
     qDebug() << "LogosIRCPlugin: Initializing...";
     
+    // Per-message logging goes through a background writer from here on
+    IRCLog::start();
+    
     // Create and start the IRC server
     ircServer = new IRCServer(this);
     
@@ -19,6 +45,18 @@ LogosIRCPlugin::LogosIRCPlugin()
     connect(ircServer, &IRCServer::channelJoined, this, &LogosIRCPlugin::onIRCChannelJoined);
     connect(ircServer, &IRCServer::messageSent, this, &LogosIRCPlugin::onIRCMessageSent);
     
+    bridgeQueueLag = ircServer->metrics().histogram("bridge.queue_lag_ns");
+    bridgeSendLatency = ircServer->metrics().histogram("bridge.send_ns");
+    bridgeJoinLatency = ircServer->metrics().histogram("bridge.join_ns");
+    bridgeEchoLatency = ircServer->metrics().histogram("bridge.echo_ms");
+    
+    // History is answered locally and survives restarts
+    QString historyDirectory = QStandardPaths::writableLocation(QStandardPaths::AppLocalDataLocation);
+    if (!historyDirectory.isEmpty()) {
+        ircServer->setHistoryStorage(historyDirectory + "/logos-irc/history",
+                                     IRCHistoryLog::DefaultSegmentBytes, IRCHistoryLog::DefaultRetentionBytes);
+    }
+    
     if (ircServer->start("0.0.0.0", 6667)) {
         qDebug() << "LogosIRCPlugin: IRC Server started successfully on port 6667";
     } else {
@@ -30,7 +68,16 @@ LogosIRCPlugin::LogosIRCPlugin()
 
 LogosIRCPlugin::~LogosIRCPlugin() 
 {
-    // Clean up resources
+    // Clean up resources. The outbox goes first: its thread records into
+    // the server's metrics, and deletes its own module proxies on the way out.
+    if (outbox) {
+        delete outbox;
+        outbox = nullptr;
+    }
+    if (joinOutbox) {
+        delete joinOutbox;
+        joinOutbox = nullptr;
+    }
     if (ircServer) {
         ircServer->stop();
         delete ircServer;
@@ -45,6 +92,8 @@ LogosIRCPlugin::~LogosIRCPlugin()
         delete logosAPI;
         logosAPI = nullptr;
     }
+    
+    IRCLog::stop();
 }
 
 bool LogosIRCPlugin::foo(const QString &bar)
@@ -85,6 +134,140 @@ bool LogosIRCPlugin::foo(const QString &bar)
     return true;
 }
 
+bool LogosIRCPlugin::setWorkerThreads(int count)
+{
+    if (!ircServer) {
+        return false;
+    }
+    if (count == ircServer->workerThreads()) {
+        return true;
+    }
+    
+    qDebug() << "LogosIRCPlugin: Restarting IRC Server with" << count << "worker threads";
+    ircServer->stop();
+    ircServer->setWorkerThreads(count);
+    if (!ircServer->start("0.0.0.0", 6667)) {
+        qWarning() << "LogosIRCPlugin: Failed to restart IRC Server";
+        return false;
+    }
+    return true;
+}
+
+bool LogosIRCPlugin::setEpollBackend(bool enabled)
+{
+    if (!ircServer) {
+        return false;
+    }
+    IRCServer::Backend backend = enabled ? IRCServer::Epoll : IRCServer::QtSockets;
+    if (backend == ircServer->backend()) {
+        return true;
+    }
+    
+    qDebug() << "LogosIRCPlugin: Restarting IRC Server with the" << (enabled ? "epoll" : "QTcpSocket") << "backend";
+    ircServer->stop();
+    ircServer->setBackend(backend);
+    if (!ircServer->start("0.0.0.0", 6667)) {
+        qWarning() << "LogosIRCPlugin: Failed to restart IRC Server";
+        return false;
+    }
+    return true;
+}
+
+void LogosIRCPlugin::setMotdFile(const QString& path)
+{
+    if (ircServer) {
+        ircServer->setMotdFile(path);
+    }
+}
+
+bool LogosIRCPlugin::setHistoryStorage(const QString& directory, qint64 segmentBytes, qint64 retentionBytes)
+{
+    return ircServer && ircServer->setHistoryStorage(directory, segmentBytes, retentionBytes);
+}
+
+QVariantMap LogosIRCPlugin::historyStats() const
+{
+    QVariantMap stats;
+    if (!ircServer) {
+        return stats;
+    }
+    
+    IRCHistoryStats history = ircServer->historyStats();
+    stats["archivedBytes"] = history.archivedBytes;
+    stats["archivedRawBytes"] = history.archivedRawBytes;
+    stats["compressionRatio"] = history.archivedBytes > 0 ? double(history.archivedRawBytes) / history.archivedBytes : 0.0;
+    stats["decodedBytes"] = history.decodedBytes;
+    stats["decodeBytesPerSecond"] = history.decodeNsecs > 0 ? history.decodedBytes * 1e9 / history.decodeNsecs : 0.0;
+    return stats;
+}
+
+QVariantMap LogosIRCPlugin::bridgeStats() const
+{
+    QVariantMap stats;
+    stats["echoesDropped"] = echoesDropped;
+    stats["replaysDropped"] = replaysDropped;
+    stats["unroutedDropped"] = unroutedDropped;
+    stats["untimedHistoryDropped"] = untimedHistoryDropped;
+    if (outbox) {
+        stats["outboundQueued"] = outbox->depth();
+        stats["outboundSent"] = outbox->sent();
+        stats["outboundDropped"] = outbox->dropped();
+        stats["outboundBatches"] = outbox->batches();
+        stats["outboundHeldDropped"] = heldSendsDropped;
+    }
+    if (joinOutbox) {
+        stats["joinsQueued"] = joinOutbox->depth();
+        stats["joinsSent"] = joinOutbox->sent();
+    }
+    return stats;
+}
+
+void LogosIRCPlugin::setFloodLimits(int rate, int burst, int queueLines, int fanoutPerToken)
+{
+    if (ircServer) {
+        IRCFloodLimits limits;
+        limits.rate = rate;
+        limits.burst = burst;
+        limits.queueLines = queueLines;
+        limits.fanoutPerToken = fanoutPerToken;
+        ircServer->setFloodLimits(limits);
+    }
+}
+
+void LogosIRCPlugin::setTimeouts(int registration, int pingInterval, int pingTimeout)
+{
+    if (ircServer) {
+        ircServer->setTimeouts(registration, pingInterval, pingTimeout);
+    }
+}
+
+void LogosIRCPlugin::setOperator(const QString& name, const QString& password)
+{
+    if (ircServer) {
+        ircServer->setOperator(name, password);
+    }
+}
+
+QString LogosIRCPlugin::metricsSnapshot() const
+{
+    if (!ircServer) {
+        return QString();
+    }
+    QJsonObject snapshot = ircServer->metricsSnapshot();
+    snapshot["history"] = QJsonObject::fromVariantMap(historyStats());
+    snapshot["bridge"] = QJsonObject::fromVariantMap(bridgeStats());
+    return QString::fromUtf8(QJsonDocument(snapshot).toJson(QJsonDocument::Compact));
+}
+
+bool LogosIRCPlugin::setLogLevels(const QString& spec)
+{
+    if (!IRCLog::setLevels(spec)) {
+        qWarning() << "LogosIRCPlugin: invalid log level spec" << spec;
+        return false;
+    }
+    return true;
+}
+
 void LogosIRCPlugin::initLogos(LogosAPI* logosAPIInstance) {
     logosAPI = logosAPIInstance;
     if (logos) {
@@ -105,6 +288,55 @@ void LogosIRCPlugin::initChatBridge() {
     
     qDebug() << "LogosIRCPlugin: Initializing chat bridge...";
     
+    // Outbound traffic leaves from threads of its own, so a slow chat module
+    // never stalls the IRC server. Joins wait for the history round trip,
+    // so they get a second thread rather than hold up sends.
+    if (!outbox) {
+        outbox = new IRCBridgeOutbox([this](const IRCBridgeMessage& message) {
+            if (!outboxLogos) {
+                outboxAPI = new LogosAPI(name());
+                outboxLogos = new LogosModules(outboxAPI);
+            }
+            
+            qint64 start = IRCMetrics::now();
+            bridgeQueueLag->record(quint64(start - message.posted));
+            outboxLogos->chat.sendMessage(message.channel, message.nick, message.text);
+            bridgeSendLatency->record(quint64(IRCMetrics::now() - start));
+        }, [this]() {
+            delete outboxLogos;
+            outboxLogos = nullptr;
+            delete outboxAPI;
+            outboxAPI = nullptr;
+        });
+        outbox->start();
+    }
+    if (!joinOutbox) {
+        joinOutbox = new IRCBridgeOutbox([this](const IRCBridgeMessage& message) {
+            if (!joinLogos) {
+                joinAPI = new LogosAPI(name());
+                joinLogos = new LogosModules(joinAPI);
+            }
+            
+            qint64 start = IRCMetrics::now();
+            bridgeQueueLag->record(quint64(start - message.posted));
+            bool joined = joinLogos->chat.joinChannel(message.channel).toBool();
+            if (joined) {
+                QVariant historyResult = joinLogos->chat.retrieveHistory(message.channel);
+                IRC_DEBUG(Bridge, "retrieve_history", "channel=" + message.channel + " result=" + IRCLog::quoted(historyResult.toString()));
+            }
+            bridgeJoinLatency->record(quint64(IRCMetrics::now() - start));
+            QMetaObject::invokeMethod(this, [this, channel = message.channel, joined]() {
+                onChatChannelJoined(channel, joined);
+            }, Qt::QueuedConnection);
+        }, [this]() {
+            delete joinLogos;
+            joinLogos = nullptr;
+            delete joinAPI;
+            joinAPI = nullptr;
+        });
+        joinOutbox->start();
+    }
+    
     if (!logos->chat.on("chatMessage", [this](const QVariantList& data) {
             onChatMessage(data);
         })) {
@@ -130,92 +362,188 @@ void LogosIRCPlugin::initChatBridge() {
 }
 
 void LogosIRCPlugin::onChatMessage(const QVariantList& data) {
+    if (deferUntilJoined(data, false)) {
+        return;
+    }
     if (data.size() >= 3) {
-        QString timestamp = data[0].toString();
+        qint64 timestamp = parseTimestamp(data[0]);
         QString nick = data[1].toString();
         QString message = data[2].toString();
         
-        qDebug() << "LogosIRCPlugin: Received chat message from" << nick << ":" << message;
+        IRC_TRACE(Bridge, "chat_message", "nick=" + IRCLog::quoted(nick) + " text=" + IRCLog::quoted(message));
         
         // Forward this message to IRC clients as a bridge message
         if (ircServer) {
-            // Forward to all joined channels for now
-            // TODO: We need channel information in the message data to properly route
-            for (const QString& channel : joinedChannels) {
-                QString ircChannel = QString("#%1").arg(channel);
-                
-                // Prefix the nick to indicate it's from the bridge
-                QString bridgeNick = QString("[WAKU]%1").arg(nick);
-                
-                ircServer->injectBridgeMessage(ircChannel, bridgeNick, message);
+            // Prefix the nick to indicate it's from the bridge
+            QString bridgeNick = QString("[WAKU]%1").arg(nick);
+            qint64 now = QDateTime::currentMSecsSinceEpoch();
+            
+            QString ircChannel = bridgeTarget(data);
+            if (ircChannel.isEmpty()) {
+                return;
+            }
+            
+            // A line an IRC user sent, coming back from chat; they already saw it
+            qint64 sent = 0;
+            if (echoCache.take(IRCDedupCache::key(ircChannel, nick, 0, message), now, &sent)) {
+                ++echoesDropped;
+                bridgeEchoLatency->record(quint64(qMax<qint64>(0, now - sent)));
+                return;
+            }
+            // Only a timestamp tells a replay from the same words said again
+            if (timestamp > 0 && !deliveredCache.insert(IRCDedupCache::key(ircChannel, nick, timestamp, message), now)) {
+                ++replaysDropped;
+                return;
             }
+            ircServer->injectBridgeMessage(ircChannel, bridgeNick, message, timestamp);
         }
-        
-        Q_UNUSED(timestamp)
     }
 }
 
 void LogosIRCPlugin::onHistoryMessage(const QVariantList& data) {
+    if (deferUntilJoined(data, true)) {
+        return;
+    }
     if (data.size() >= 3) {
-        QString timestamp = data[0].toString();
+        qint64 timestamp = parseTimestamp(data[0]);
         QString nick = data[1].toString();
         QString message = data[2].toString();
         
-        qDebug() << "LogosIRCPlugin: Received history message from" << nick << ":" << message;
+        IRC_TRACE(Bridge, "history_message", "nick=" + IRCLog::quoted(nick) + " text=" + IRCLog::quoted(message));
         
-        // Forward this history message to IRC clients as a bridge message
+        // Without its original time a replayed line cannot be told from the
+        // same line replayed again, nor placed in CHATHISTORY order
+        if (timestamp <= 0) {
+            ++untimedHistoryDropped;
+            return;
+        }
+        
+        // History is stored rather than replayed into the channel; IRC clients
+        // page through it with CHATHISTORY
         if (ircServer) {
-            // Forward to all joined channels for now
-            // TODO: We need channel information in the message data to properly route
-            for (const QString& channel : joinedChannels) {
-                QString ircChannel = QString("#%1").arg(channel);
-                
-                // Prefix the nick to indicate it's from the bridge and mark as history
-                QString bridgeNick = QString("[HISTORY][WAKU]%1").arg(nick);
-                
-                ircServer->injectBridgeMessage(ircChannel, bridgeNick, message);
+            QString bridgeNick = QString("[WAKU]%1").arg(nick);
+            qint64 now = QDateTime::currentMSecsSinceEpoch();
+            
+            QString ircChannel = bridgeTarget(data);
+            if (ircChannel.isEmpty()) {
+                return;
+            }
+            
+            // An IRC user's own line, already in history under their prefix
+            if (sentCache.contains(IRCDedupCache::key(ircChannel, nick, 0, message), now)) {
+                ++echoesDropped;
+                return;
             }
+            // Overlapping replays repeat what was already delivered live
+            if (!deliveredCache.insert(IRCDedupCache::key(ircChannel, nick, timestamp, message), now)) {
+                ++replaysDropped;
+                return;
+            }
+            ircServer->recordBridgeHistory(ircChannel, bridgeNick, message, timestamp);
         }
-        
-        Q_UNUSED(timestamp)
     }
 }
 
+QString LogosIRCPlugin::bridgeTarget(const QVariantList& data) {
+    // Events carry the chat channel after timestamp, nick and message.
+    // Without it the origin is unknown, and guessing spams every channel.
+    QString channel = data.size() >= 4 ? data[3].toString() : QString();
+    if (channel.isEmpty()) {
+        ++unroutedDropped;
+        return QString();
+    }
+    if (!joinedChannels.contains(channel)) {
+        return QString();
+    }
+    return QString("#%1").arg(channel);
+}
+
+QString LogosIRCPlugin::chatChannel(const QString& ircChannel) {
+    // Extract channel name without # prefix for chat API
+    QString channelName = ircChannel;
+    if (channelName.startsWith("#")) {
+        channelName = channelName.mid(1);
+    }
+    
+    // IRC matches channel names under casemapping, chat may not; every
+    // spelling of an IRC channel goes to the chat channel its first one named
+    QString folded = QString::fromUtf8(IRCMessage::foldCase(channelName.toUtf8()));
+    auto it = chatChannels.find(folded);
+    if (it == chatChannels.end()) {
+        it = chatChannels.insert(folded, channelName);
+    }
+    return it.value();
+}
+
 void LogosIRCPlugin::onIRCChannelJoined(const QString& channel) {
     if (!logosAPI) {
         qWarning() << "LogosIRCPlugin: Cannot join chat channel - LogosAPI not available";
         return;
     }
     
-    // Extract channel name without # prefix for chat API
-    QString channelName = channel;
-    if (channelName.startsWith("#")) {
-        channelName = channelName.mid(1);
-    }
+    QString channelName = chatChannel(channel);
     
-    // Check if we've already joined this channel
+    // Check if we've already joined this channel, or are joining it
     if (joinedChannels.contains(channelName)) {
-        qDebug() << "LogosIRCPlugin: Channel" << channelName << "already joined on chat side";
+        IRC_TRACE(Bridge, "join_skipped", "channel=" + channelName + " state=joined");
+        return;
+    }
+    if (pendingJoins.contains(channelName)) {
+        IRC_TRACE(Bridge, "join_skipped", "channel=" + channelName + " state=joining");
         return;
     }
     
-    qDebug() << "LogosIRCPlugin: IRC user joined channel" << channel << ", joining chat channel:" << channelName;
+    IRC_DEBUG(Bridge, "join", "irc_channel=" + channel + " channel=" + channelName);
     
-    // Join the channel on the chat side
-    QVariant joinResult = logos->chat.joinChannel(channelName);
-    if (joinResult.toBool()) {
-        qDebug() << "LogosIRCPlugin: Successfully joined chat channel:" << channelName;
-        
-        // Add to our list of joined channels
-        joinedChannels.append(channelName);
-        
-        // Automatically retrieve message history for the joined channel
-        qDebug() << "LogosIRCPlugin: Retrieving message history for channel:" << channelName;
-        QVariant historyResult = logos->chat.retrieveHistory(channelName);
-        qDebug() << "LogosIRCPlugin: retrieveHistory result:" << historyResult;
-    } else {
+    // Join and retrieve history on the join thread; the IRC JOIN completes
+    // without waiting for either
+    pendingJoins.insert(channelName, QList<DeferredEvent>());
+    heldSends.insert(channelName, QList<IRCBridgeMessage>());
+    IRCBridgeMessage join;
+    join.type = IRCBridgeMessage::Join;
+    join.channel = channelName;
+    joinOutbox->post(std::move(join));
+}
+
+void LogosIRCPlugin::onChatChannelJoined(const QString& channelName, bool joined) {
+    QList<DeferredEvent> deferred = pendingJoins.take(channelName);
+    
+    // Lines sent meanwhile go out now, as they would have after the join on
+    // a single thread
+    QList<IRCBridgeMessage> held = heldSends.take(channelName);
+    for (IRCBridgeMessage& message : held) {
+        outbox->post(std::move(message));
+    }
+    
+    if (!joined) {
+        // The next IRC JOIN to the channel tries again
         qWarning() << "LogosIRCPlugin: Failed to join chat channel:" << channelName;
+        return;
     }
+    
+    IRC_INFO(Bridge, "joined", "channel=" + channelName);
+    joinedChannels.append(channelName);
+    
+    // Deliver what arrived while the join was in flight, in order
+    for (const DeferredEvent& event : std::as_const(deferred)) {
+        if (event.history) {
+            onHistoryMessage(event.data);
+        } else {
+            onChatMessage(event.data);
+        }
+    }
+}
+
+bool LogosIRCPlugin::deferUntilJoined(const QVariantList& data, bool history) {
+    if (data.size() < 4) {
+        return false;
+    }
+    auto pending = pendingJoins.find(data[3].toString());
+    if (pending == pendingJoins.end()) {
+        return false;
+    }
+    pending->append(DeferredEvent{history, data});
+    return true;
 }
 
 void LogosIRCPlugin::onIRCMessageSent(const QString& channel, const QString& nick, const QString& message) {
@@ -224,14 +552,29 @@ void LogosIRCPlugin::onIRCMessageSent(const QString& channel, const QString& nic
         return;
     }
     
-    // Extract channel name without # prefix for chat API
-    QString channelName = channel;
-    if (channelName.startsWith("#")) {
-        channelName = channelName.mid(1);
-    }
+    QString channelName = chatChannel(channel);
+    
+    IRC_TRACE(Bridge, "forward", "nick=" + nick + " channel=" + channelName + " text=" + IRCLog::quoted(message));
     
-    qDebug() << "LogosIRCPlugin: Forwarding IRC message from" << nick << "in channel" << channelName << ":" << message;
+    // Remember the line so its echo from chat is not relayed back, under the
+    // name bridgeTarget() gives the echo
+    quint64 key = IRCDedupCache::key("#" + channelName, nick, 0, message);
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    echoCache.insert(key, now);
+    sentCache.insert(key, now);
+    
+    // Chat gets the channel's join first; until it completes the line waits here
+    IRCBridgeMessage send{IRCBridgeMessage::Send, channelName, nick, message};
+    auto held = heldSends.find(channelName);
+    if (held != heldSends.end()) {
+        if (held->size() < IRCBridgeOutbox::DefaultLimit) {
+            held->append(std::move(send));
+        } else {
+            ++heldSendsDropped;
+        }
+        return;
+    }
     
-    // Send the message to the chat module
-    logos->chat.sendMessage(channelName, nick, message);
+    // Queue the message for the chat module; dropped if chat has fallen too far behind
+    outbox->post(std::move(send));
 } 
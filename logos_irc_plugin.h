@@ -3,9 +3,12 @@
 #include <QtCore/QObject>
 #include <QtCore/QJsonArray>
 #include <QtCore/QStringList>
+#include <QtCore/QVariantMap>
 #include "logos_irc_interface.h"
 #include "logos_api.h"
 #include "logos_api_client.h"
+#include "ircbridge.h"
+#include "ircdedup.h"
 #include "ircserver.h"
 #include "logos_sdk.h"
 
@@ -26,6 +29,52 @@ public:
     // LogosAPI initialization
     Q_INVOKABLE void initLogos(LogosAPI* logosAPIInstance);
 
+    // Restarts the IRC server with client sockets spread over count worker
+    // threads (0 serves everything on the plugin thread)
+    Q_INVOKABLE bool setWorkerThreads(int count);
+
+    // Restarts the IRC server serving connections on a native epoll set
+    // (Linux only) instead of a QTcpSocket each
+    Q_INVOKABLE bool setEpollBackend(bool enabled);
+
+    // Serves the MOTD from a file (e.g. the installed motd.txt), reloaded
+    // whenever it changes; an empty path restores the built-in MOTD
+    Q_INVOKABLE void setMotdFile(const QString& path);
+
+    // Keeps channel history in append-only segment files under directory,
+    // rotated at segmentBytes and trimmed to retentionBytes per channel. An
+    // empty directory keeps recent history in memory only.
+    Q_INVOKABLE bool setHistoryStorage(const QString& directory, qint64 segmentBytes, qint64 retentionBytes);
+
+    // Archive tier metrics: bytes on disk and uncompressed, the compression
+    // ratio, and bytes decoded by history reads with their throughput
+    Q_INVOKABLE QVariantMap historyStats() const;
+
+    // Bridge counters: echoes of our own lines and replayed messages
+    // dropped, and the outbound queue's depth, sent, dropped and batches
+    Q_INVOKABLE QVariantMap bridgeStats() const;
+
+    // Sets log levels per component, e.g. "info,server=debug,bridge=trace";
+    // components are server, client, channel, bridge and history. A level
+    // may carry a records-per-second limit, e.g. "bridge=trace/200".
+    Q_INVOKABLE bool setLogLevels(const QString& spec);
+
+    // Per-client flood control: tokens regained per second, bucket size,
+    // lines held back before "Excess Flood", and channel members one token
+    // of fan-out pays for. A rate of 0 turns it off.
+    Q_INVOKABLE void setFloodLimits(int rate, int burst, int queueLines, int fanoutPerToken);
+
+    // Seconds to complete registration, seconds of silence before a PING,
+    // and seconds to wait for a reply before dropping the connection
+    Q_INVOKABLE void setTimeouts(int registration, int pingInterval, int pingTimeout);
+
+    // OPER credentials for IRC clients, which unlock the STATS command
+    Q_INVOKABLE void setOperator(const QString& name, const QString& password);
+
+    // Counters, latency histograms and gauges from the server and the bridge,
+    // with historyStats() and bridgeStats() folded in, as a JSON document
+    Q_INVOKABLE QString metricsSnapshot() const;
+
 private slots:
     void onIRCChannelJoined(const QString& channel);
     void onIRCMessageSent(const QString& channel, const QString& nick, const QString& message);
@@ -34,11 +83,61 @@ private:
     void initChatBridge();
     void onChatMessage(const QVariantList& data);
     void onHistoryMessage(const QVariantList& data);
+    void onChatChannelJoined(const QString& channelName, bool joined);
+    bool deferUntilJoined(const QVariantList& data, bool history);
+    // The IRC channel a chat event belongs to, or an empty string if it is
+    // not bridged; events without a chat channel are counted and dropped
+    QString bridgeTarget(const QVariantList& data);
+    // The chat channel an IRC channel bridges to, without the '#'
+    QString chatChannel(const QString& ircChannel);
     
     LogosAPI* logosAPI = nullptr;
     LogosModules* logos = nullptr;
+    // A LogosAPI and module proxies of the outbound worker's own, created
+    // and deleted on that thread; logosAPI and its remote objects belong to
+    // the plugin thread
+    LogosAPI* outboxAPI = nullptr;
+    LogosModules* outboxLogos = nullptr;
+    IRCBridgeOutbox* outbox = nullptr;
+    // The same for chat joins and history retrieval, which take a round trip
+    // each and have a thread of their own
+    LogosAPI* joinAPI = nullptr;
+    LogosModules* joinLogos = nullptr;
+    IRCBridgeOutbox* joinOutbox = nullptr;
     IRCServer* ircServer = nullptr;
+    // Chat channel for each casemapped IRC channel name, without the '#'.
+    // The bookkeeping below is keyed on chat channel names.
+    QHash<QString, QString> chatChannels;
     QStringList joinedChannels;
+    // Chat joins in flight, with the chat events that arrived for them meanwhile
+    struct DeferredEvent
+    {
+        bool history;
+        QVariantList data;
+    };
+    QHash<QString, QList<DeferredEvent>> pendingJoins;
+    // Lines from IRC for those channels, posted once the join completes
+    QHash<QString, QList<IRCBridgeMessage>> heldSends;
+    qint64 heldSendsDropped = 0;
+    
+    // Lines sent to chat, matched against what comes back
+    IRCDedupCache echoCache;
+    // The same lines under the same keys, kept for a day and never taken, so
+    // history replays can tell them apart from chat users' messages
+    IRCDedupCache sentCache { IRCDedupCache::DefaultCapacity * 4, 24 * 60 * 60 * 1000 };
+    // Chat messages already delivered, by original timestamp
+    IRCDedupCache deliveredCache;
+    qint64 echoesDropped = 0;
+    qint64 replaysDropped = 0;
+    qint64 unroutedDropped = 0;
+    qint64 untimedHistoryDropped = 0;  // Replayed lines without a time, not duplicates
+    
+    // Bridge latencies, registered with the server's metrics. The outbound
+    // ones are recorded on the outbox thread.
+    IRCHistogram* bridgeQueueLag = nullptr;     // post() to the chat call
+    IRCHistogram* bridgeSendLatency = nullptr;  // chat sendMessage call
+    IRCHistogram* bridgeJoinLatency = nullptr;  // chat join and history calls
+    IRCHistogram* bridgeEchoLatency = nullptr;  // IRC line to its chat echo, ms
 
 signals:
     // for now this is required for events, later it might not be necessary if using a proxy